@@ -7,20 +7,46 @@
 
 #define _GNU_SOURCE
 #include <argp.h>
+#include <fcntl.h>
 #include <libusb-1.0/libusb.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#if __has_include(<b64/cdecode.h>) || ! defined (NO_HID)
-  #include <b64/cdecode.h>
-  #define HAS_HID 1
+#if LIBUSB_API_VERSION >= 0x01000108
+  // libusb_wrap_sys_device and LIBUSB_OPTION_NO_DEVICE_DISCOVERY
+  #define HAS_SYS_DEVICE 1
 #endif
+#if !defined(NO_URING) && __has_include(<liburing.h>)
+  #include <liburing.h>
+  #define HAS_URING 1
+#endif
+#include <inttypes.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <netdb.h>
+#include <arpa/inet.h>
+#include <limits.h>
+#include <math.h>
+#include <linux/input.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
 
 #if __has_include("version.h")
 #include "version.h"
@@ -31,6 +57,86 @@
 #endif
 
 #define PORT_NUMBERS_LEN 8
+#define DEFAULT_TRANSFERS 4
+#define MAX_TRANSFERS 64
+#define DEFAULT_BUFFER_SIZE 16384
+#define MAX_BUFFER_SIZE (1024 * 1024)
+// positions in a --capture ring are 32 bit, see struct capture_header
+#define CAPTURE_MAX_SIZE (1024 * 1024 * 1024)
+
+// AOAv2 audio is always 16 bit stereo PCM at 44.1 kHz
+#define AUDIO_RATE 44100
+#define AUDIO_FRAME_SIZE 4
+
+// keys of options without a short form
+enum {
+  OPT_SIM_APP = 256,
+  OPT_SIM_PACKET_SIZE,
+  OPT_SIM_LATENCY,
+  OPT_SIM_BANDWIDTH,
+  OPT_BENCH_SIZE,
+  OPT_BENCH_MESSAGE,
+  OPT_BENCH_ROUNDS,
+  OPT_BENCH_PATTERN,
+  OPT_JSON,
+  OPT_METRICS,
+  OPT_THREADS,
+  OPT_IO_URING,
+  OPT_ENUMERATE,
+  OPT_RECONNECT,
+  OPT_COALESCE_DELAY,
+  OPT_COALESCE_SIZE,
+  OPT_IDLE_TIMEOUT,
+  OPT_STALL_TIMEOUT,
+  OPT_KEEPALIVE,
+  OPT_HID_BINARY,
+  OPT_HID_RATE,
+  OPT_GRAB,
+  OPT_HID_REPLAY,
+  OPT_LISTEN,
+  OPT_CAPTURE,
+  OPT_CAPTURE_SIZE,
+  OPT_CAPTURE_SNAPLEN,
+  OPT_CAPTURE_EXPORT,
+  OPT_CAPTURE_REPLAY,
+  OPT_AUDIO_STREAM,
+  OPT_AUDIO_OUT,
+  OPT_AUDIO_LATENCY,
+};
+
+enum bench_pattern { BENCH_ZERO, BENCH_COUNTER, BENCH_RANDOM, BENCH_PATTERN_MAX };
+static const char *bench_pattern_names[BENCH_PATTERN_MAX] = {"zero", "counter",
+                                                              "random"};
+
+// protocols recognized by the first bytes the AOA device sends
+enum route {
+  ROUTE_SSH,
+  ROUTE_TLS,
+  ROUTE_HTTP,
+  ROUTE_MAX
+};
+static const char *route_names[ROUTE_MAX] = {"ssh", "tls", "http"};
+
+// Framed multi-channel protocol (--mux). Every frame starts with an 8 byte
+// header: type, priority, channel id (u16) and payload length (u32), both in
+// network byte order.
+//
+// The phone opens a channel with MUX_OPEN, the payload names the route (ssh,
+// tls, http or empty for --connect). The proxy acknowledges with an empty
+// MUX_OPEN or refuses with MUX_CLOSE. Each side may then send MUX_WINDOW bytes
+// of MUX_DATA and grants more with MUX_WINDOW_UPDATE (u32 increment).
+// MUX_CLOSE ends one direction, the channel is gone once both sent it.
+#define MUX_HEADER_SIZE 8
+#define MUX_MAX_PAYLOAD 16384
+#define MUX_WINDOW (64 * 1024)
+#define MUX_MAX_LISTENERS 8
+
+enum mux_frame_type {
+  MUX_OPEN = 1,
+  MUX_DATA = 2,
+  MUX_CLOSE = 3,
+  MUX_WINDOW_UPDATE = 4,
+};
 
 const char *argp_program_version = "aoa-proxy " GIT_VERSION;
 const char *argp_program_bug_address = "https://github.com/jo-bitsch/aoa-proxy/issues";
@@ -45,6 +151,11 @@ static char doc[] =
     "  (2) Forwarding mode: Forward all input from stdin to the AOA device and "
     "all output from AOA to stdout."
     "\n\n"
+    "The announce strings may contain %hostname%, %os% (PRETTY_NAME of "
+    "os-release), %model% (of the hardware), %addrs% (one \"address<TAB>"
+    "interface\" line per address) and %% for a percent sign, e.g. "
+    "--serial %hostname%."
+    "\n\n"
     "This is best called automatically from udev to react to the hotplugging "
     "of devices. "
     "Once AOA mode is triggered, the USB device reattaches itself, so the "
@@ -57,16 +168,54 @@ static char doc[] =
 
 static struct argp_option options[] = {
     {0, 0, 0, 0, "Device selection options", 0},
-    {"port", 'p', "BUSNUM-PORTNUMS", 0, "Connect to this USB device. e.g. \"2-2\"", 0},
+    {"port", 'p', "BUSNUM-PORTNUMS", 0,
+     "Connect to this USB device. e.g. \"2-2\". A sysfs path or udev DEVPATH "
+     "ending in it works as well, so does the device node (udev DEVNAME) "
+     "like /dev/bus/usb/002/005.", 0},
+    {"enumerate", OPT_ENUMERATE, 0, 0,
+     "Find the --port device by enumerating all USB devices, instead of "
+     "opening its device node directly.", 0},
+    {"simulate", 'S', 0, 0,
+     "Use a simulated AOA device instead of a real one, for testing and "
+     "benchmarking without a phone. No --port needed.", 0},
     {0, 0, 0, 0, "Possible actions", 0},
     {"announce", 'a', 0, 0,
      "Announce AOA to the device.", 0},
     {"forward", 'f', 0, 0,
      "Forward stdin to AOA device and forward AOA device to stdout.", 0},
-#ifdef HAS_HID
+    {"mux-loopback", 'L', "PORT[:ROUTE[:PRIORITY]]", 0,
+     "Test the --mux protocol without a device: connections to the local "
+     "PORT are carried as channels to ROUTE through an in-process loopback "
+     "link. May be given several times.", 0},
+    {"daemon", 'D', 0, 0,
+     "Keep running and handle every device that gets plugged in: announce to "
+     "new devices (with --announce) and forward devices in AOA mode (with "
+     "--forward, requires --connect). No --port needed.", 0},
+    {"bench", 'B', 0, 0,
+     "Measure throughput and round trip latency of the forwarding path "
+     "against an app that echos everything back, e.g. with --simulate.", 0},
     {"hid",'y', 0, 0, 
      "send HID events instead (first line: base64 encoded descriptor, next lines: base64 encoded events", 0},
-#endif
+    {"hid-binary", OPT_HID_BINARY, 0, 0,
+     "Like --hid, but read frames of a little endian u16 length and that "
+     "many bytes, the descriptor first, instead of base64 lines.", 0},
+    {"evdev", 'e', "DEVICE", 0,
+     "Register the keyboard, mouse or touchscreen at DEVICE, e.g. "
+     "/dev/input/event3, as HID device and forward its input. Can be given "
+     "up to 8 times.", 0},
+    {"grab", OPT_GRAB, 0, 0,
+     "Grab the --evdev device, so that its input only goes to the device.", 0},
+    {"hid-replay", OPT_HID_REPLAY, 0, 0,
+     "Register several HID devices and replay timed events for them from "
+     "stdin: lines of \"descriptor INDEX BASE64\", then of \"SECONDS INDEX "
+     "BASE64\".", 0},
+    {"hid-rate", OPT_HID_RATE, "HZ", 0,
+     "Send HID events on a fixed schedule of HZ per second and report the "
+     "jitter. (default: 0, as fast as the device takes them)", 0},
+    {"audio-stream", OPT_AUDIO_STREAM, 0, 0,
+     "Play the AOAv2 audio of a device announced with --audio: receive its "
+     "16 bit stereo PCM at 44.1 kHz with --transfers isochronous transfers "
+     "in flight and write it to --audio-out, e.g. into aplay -t raw -f cd.", 0},
     {0, 0, 0, 0, "Announce options", 0},
     {"audio", 'A', 0, 0,
      "enable audio interface for AOAv2. (default: false)", 0},
@@ -84,10 +233,111 @@ static struct argp_option options[] = {
     {0, 0, 0, 0, "Forwarding only options", 0},
     {"wait", 'w', 0, 0,
      "Wait for first byte from AOA device before forwarding input from stdin. "
-     "(default: false)", 0},
+     "With --connect, connect only then. (default: false)", 0},
     {"connect", 'c', "PORT", 0,
-     "Connect to a tcp port on localhost and forward AOA traffic via network instead of stdio. "
+     "Connect to a tcp port on localhost, HOST:PORT or a unix socket as "
+     "unix:PATH and forward AOA traffic via network instead of stdio. "
      "(default: \"\")", 0},
+    {"route", 'R', "PROTOCOL=PORT", 0,
+     "Connect only once the AOA device sent its first bytes and pick the tcp "
+     "port by protocol: ssh, tls or http. May be given several times, "
+     "--connect is used for everything else.", 0},
+    {"listen", OPT_LISTEN, "PORT", 0,
+     "Instead of connecting anywhere, let one client at a time connect to "
+     "the tcp PORT on localhost, unix:PATH or the socket systemd passed "
+     "with \"systemd\", and forward AOA traffic to it.", 0},
+    {"reconnect", OPT_RECONNECT, "MARKER", OPTION_ARG_OPTIONAL,
+     "Keep the AOA session when the backend closes the connection and "
+     "connect again once the device sends more, retrying with backoff. "
+     "MARKER, if given, is sent to the device each time the backend went "
+     "away. Not for stdio. (default: false)", 0},
+    {"mux", 'x', 0, 0,
+     "Carry many tcp connections as channels of a framed protocol over the "
+     "AOA link, opened by the device per --route or --connect. "
+     "(default: false)", 0},
+    {"metrics", OPT_METRICS, "PATH", 0,
+     "Serve the counters of all sessions in the Prometheus text format on "
+     "the unix socket PATH. SIGUSR1 prints them to stderr in any case.", 0},
+    {"transfers", 't', "N", 0,
+     "Number of bulk transfers kept in flight per direction. (default: 4)", 0},
+    {"buffer-size", 'b', "BYTES", 0,
+     "Size of each bulk transfer buffer, rounded up to a multiple of the "
+     "packet size. (default: 16384)", 0},
+    {"coalesce-delay", OPT_COALESCE_DELAY, "USEC", 0,
+     "While transfers to the device are in flight, hold back small data for "
+     "up to USEC so that more joins it in one transfer. An idle link sends "
+     "right away. (default: 0, off)", 0},
+    {"coalesce-size", OPT_COALESCE_SIZE, "BYTES", 0,
+     "Send held back data once this much is pending. (default: "
+     "--buffer-size)", 0},
+    {"idle-timeout", OPT_IDLE_TIMEOUT, "SEC", 0,
+     "End a session after SEC seconds without any transfer in either "
+     "direction. (default: 0, never)", 0},
+    {"stall-timeout", OPT_STALL_TIMEOUT, "SEC", 0,
+     "End a session when data waits for the device but no transfer to it "
+     "completed for SEC seconds, e.g. because the app froze. "
+     "(default: 0, never)", 0},
+    {"keepalive", OPT_KEEPALIVE, "SEC", 0,
+     "After SEC seconds without transfers, ask the device for its status "
+     "and end the session if it does not answer within a second. "
+     "(default: 0, off)", 0},
+    {"threads", OPT_THREADS, 0, 0,
+     "Handle the USB transfers in a thread of their own, so that they "
+     "complete while the other side is busy with the backend. "
+     "(default: false)", 0},
+#ifdef HAS_URING
+    {"io-uring", OPT_IO_URING, 0, 0,
+     "Read and write the local side with io_uring instead of epoll and "
+     "read()/write(). Not for --mux. (default: false)", 0},
+#endif
+    {0, 0, 0, 0, "Simulation options", 0},
+    {"sim-app", OPT_SIM_APP, "echo|PORT", 0,
+     "What runs on the simulated phone: echo everything back, or hand the "
+     "accessory to the first connection on the local tcp PORT. "
+     "(default: echo)", 0},
+    {"sim-packet-size", OPT_SIM_PACKET_SIZE, "BYTES", 0,
+     "wMaxPacketSize of the simulated bulk endpoints. (default: 512)", 0},
+    {"sim-latency", OPT_SIM_LATENCY, "USEC", 0,
+     "Time from the end of a transfer on the bus to its completion. "
+     "(default: 125)", 0},
+    {"sim-bandwidth", OPT_SIM_BANDWIDTH, "BYTES", 0,
+     "Bytes per second the simulated bus carries, shared by both "
+     "directions. (default: 40000000)", 0},
+    {0, 0, 0, 0, "Benchmark options", 0},
+    {"bench-size", OPT_BENCH_SIZE, "BYTES", 0,
+     "Bytes to send for the throughput measurement. (default: 67108864)", 0},
+    {"bench-message", OPT_BENCH_MESSAGE, "BYTES", 0,
+     "Size of each round trip for the latency measurement. (default: 64)", 0},
+    {"bench-rounds", OPT_BENCH_ROUNDS, "N", 0,
+     "Number of round trips for the latency measurement. (default: 5000)", 0},
+    {"bench-pattern", OPT_BENCH_PATTERN, "zero|counter|random", 0,
+     "What to send, the echo is checked against it. (default: random)", 0},
+    {"json", OPT_JSON, 0, 0,
+     "Print the results as JSON. (default: false)", 0},
+    {0, 0, 0, 0, "Audio options", 0},
+    {"audio-out", OPT_AUDIO_OUT, "SINK", 0,
+     "Where --audio-stream writes to: - for stdout, unix:PATH for a unix "
+     "socket, or the path of a FIFO or file. (default: -)", 0},
+    {"audio-latency", OPT_AUDIO_LATENCY, "MSEC", 0,
+     "Audio buffered before playing starts, to ride out late transfers. Less "
+     "delays the sound less, but underruns sooner. (default: 40)", 0},
+    {0, 0, 0, 0, "Capture options", 0},
+    {"capture", OPT_CAPTURE, "FILE", 0,
+     "Record every bulk transfer of the forwarding path with its timing, "
+     "status and first bytes into a ring in FILE, overwriting the oldest "
+     "records once it is full.", 0},
+    {"capture-size", OPT_CAPTURE_SIZE, "BYTES", 0,
+     "Size of the --capture ring, rounded up to a power of 2. (default: "
+     "16777216)", 0},
+    {"capture-snaplen", OPT_CAPTURE_SNAPLEN, "BYTES", 0,
+     "Bytes of each transfer to keep. (default: 256)", 0},
+    {"capture-export", OPT_CAPTURE_EXPORT, "PCAPNG", 0,
+     "Convert the --capture FILE to PCAPNG for Wireshark, as usbmon "
+     "packets, and exit. No --port needed.", 0},
+    {"capture-replay", OPT_CAPTURE_REPLAY, "FILE", 0,
+     "Send the data recorded towards the device in FILE to it again with "
+     "the recorded timing, and compare when its answers arrive with the "
+     "recording.", 0},
     {0, 0, 0, 0, "Forwarding/HID options", 0},
     {"reset-on-exit", 'r', 0, 0,
      "leave AOA mode on exit from forwarding."
@@ -97,16 +347,67 @@ static struct argp_option options[] = {
 struct arguments {
   int busnum;
   uint8_t portnums[PORT_NUMBERS_LEN];
+  char *port;     // BUSNUM-PORTNUMS as given
+  char *devname;  // --port given as device node
+  bool enumerate;
   char *manufacturer, *model, *version, *serial, *description, *url;
   bool audio;
   bool wait;
   bool reset;
   bool announce;
   bool forward;
+  bool daemon;
+  bool simulate;
+  bool bench;
+  uint64_t bench_size;
+  size_t bench_message;
+  size_t bench_rounds;
+  enum bench_pattern bench_pattern;
+  bool json;
+  char *metrics;
+  char *sim_app;
+  uint16_t sim_packet_size;
+  unsigned long sim_latency;
+  unsigned long sim_bandwidth;
   char *connect;
-#ifdef HAS_HID
-  bool hid;
+  char *routes[ROUTE_MAX];
+  bool route;
+  bool reconnect;
+  char *reconnect_marker;  // NULL: none
+  bool mux;
+  struct {
+    char *port;
+    char *route;
+    uint8_t priority;
+  } mux_loopback[MUX_MAX_LISTENERS];
+  size_t num_mux_loopback;
+  int transfers;
+  size_t buffer_size;
+  unsigned long coalesce_delay;  // us
+  size_t coalesce_size;          // 0: buffer_size
+  unsigned long idle_timeout;    // s, 0: off
+  unsigned long stall_timeout;   // s, 0: off
+  unsigned long keepalive;       // s, 0: off
+  bool threads;
+#ifdef HAS_URING
+  bool io_uring;
 #endif
+  bool hid;
+  bool hid_binary;
+  unsigned long hid_rate;
+  char *evdev[8];
+  size_t num_evdev;
+  bool grab;
+  bool hid_replay;
+  char *listen;
+  char *capture;
+  uint64_t capture_size;
+  uint32_t capture_snaplen;
+  char *capture_export;
+  char *capture_replay;
+  bool audio_stream;
+  char *audio_out;
+  unsigned long audio_latency;  // ms
 };
 
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
@@ -114,6 +415,15 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
   char *p;
   switch (key) {
   case 'p':
+    if (strncmp(arg, "/dev/", 5) == 0) {
+      arguments->devname = arg;
+      break;
+    }
+    // a sysfs path or DEVPATH ends in BUSNUM-PORTNUMS
+    if (strrchr(arg, '/') != NULL) {
+      arg = strrchr(arg, '/') + 1;
+    }
+    arguments->port = arg;
     p=arg;
     arguments->busnum = atoi(p);
     if (arguments->busnum < 0 || arguments->busnum > 255) {
@@ -184,22 +494,312 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
   case 'f':
     arguments->forward = true;
     break;
+  case 'D':
+    arguments->daemon = true;
+    break;
+  case 'S':
+    arguments->simulate = true;
+    break;
+  case 'B':
+    arguments->bench = true;
+    break;
+  case OPT_BENCH_SIZE:
+    arguments->bench_size = strtoull(arg, NULL, 0);
+    if (arguments->bench_size < 1) {
+      argp_error(state, "bench-size has to be at least 1");
+    }
+    break;
+  case OPT_BENCH_MESSAGE:
+    arguments->bench_message = strtoul(arg, NULL, 0);
+    if (arguments->bench_message < 1 || arguments->bench_message > MAX_BUFFER_SIZE) {
+      argp_error(state, "only values between 1 and %d are allowed for bench-message", MAX_BUFFER_SIZE);
+    }
+    break;
+  case OPT_BENCH_ROUNDS:
+    arguments->bench_rounds = strtoul(arg, NULL, 0);
+    if (arguments->bench_rounds < 1) {
+      argp_error(state, "bench-rounds has to be at least 1");
+    }
+    break;
+  case OPT_BENCH_PATTERN:
+    arguments->bench_pattern = BENCH_PATTERN_MAX;
+    for (int i = 0; i < BENCH_PATTERN_MAX; i++) {
+      if (strcmp(arg, bench_pattern_names[i]) == 0) {
+        arguments->bench_pattern = i;
+      }
+    }
+    if (arguments->bench_pattern == BENCH_PATTERN_MAX) {
+      argp_error(state, "only zero, counter and random are known bench patterns");
+    }
+    break;
+  case OPT_JSON:
+    arguments->json = true;
+    break;
+  case OPT_METRICS:
+    arguments->metrics = arg;
+    break;
+  case OPT_SIM_APP:
+    arguments->sim_app = arg;
+    break;
+  case OPT_SIM_PACKET_SIZE: {
+    int size = atoi(arg);
+    if (size < 8 || size > 1024 || (size & (size - 1)) != 0) {
+      argp_error(state, "only powers of two between 8 and 1024 are allowed for sim-packet-size");
+    }
+    arguments->sim_packet_size = size;
+    break;
+  }
+  case OPT_SIM_LATENCY:
+    arguments->sim_latency = strtoul(arg, NULL, 0);
+    break;
+  case OPT_SIM_BANDWIDTH:
+    arguments->sim_bandwidth = strtoul(arg, NULL, 0);
+    if (arguments->sim_bandwidth < 1) {
+      argp_error(state, "sim-bandwidth has to be at least 1");
+    }
+    break;
+  case 'x':
+    arguments->mux = true;
+    break;
+  case 'L':
+    if (arguments->num_mux_loopback >= MUX_MAX_LISTENERS) {
+      argp_error(state, "at most %d mux-loopback ports are supported", MUX_MAX_LISTENERS);
+      break;
+    }
+    arguments->mux_loopback[arguments->num_mux_loopback].port = strsep(&arg, ":");
+    p = strsep(&arg, ":");
+    arguments->mux_loopback[arguments->num_mux_loopback].route = p != NULL ? p : "";
+    if (arg != NULL) {
+      int priority = atoi(arg);
+      if (priority < 0 || priority > 255) {
+        argp_error(state, "only values between 0 and 255 are allowed for the priority");
+      }
+      arguments->mux_loopback[arguments->num_mux_loopback].priority = priority;
+    }
+    arguments->num_mux_loopback++;
+    break;
   case 'c':
     arguments->connect = arg;
     break;
+  case 'R':
+    p = strchr(arg, '=');
+    if (p == NULL || p[1] == 0) {
+      argp_error(state, "follow the format PROTOCOL=PORT");
+      break;
+    }
+    for (int i = 0; i < ROUTE_MAX; i++) {
+      if (strncmp(arg, route_names[i], p - arg) == 0 &&
+          strlen(route_names[i]) == (size_t)(p - arg)) {
+        arguments->routes[i] = p + 1;
+        arguments->route = true;
+        p = NULL;
+        break;
+      }
+    }
+    if (p != NULL) {
+      argp_error(state, "only ssh, tls and http are known protocols for route");
+    }
+    break;
+  case 't':
+    arguments->transfers = atoi(arg);
+    if (arguments->transfers < 1 || arguments->transfers > MAX_TRANSFERS) {
+      argp_error(state, "only values between 1 and %d are allowed for transfers", MAX_TRANSFERS);
+    }
+    break;
+  case 'b':
+    arguments->buffer_size = strtoul(arg, NULL, 0);
+    if (arguments->buffer_size < 1 || arguments->buffer_size > MAX_BUFFER_SIZE) {
+      argp_error(state, "only values between 1 and %d are allowed for buffer-size", MAX_BUFFER_SIZE);
+    }
+    break;
+  case OPT_COALESCE_DELAY:
+    arguments->coalesce_delay = strtoul(arg, NULL, 0);
+    break;
+  case OPT_COALESCE_SIZE:
+    arguments->coalesce_size = strtoul(arg, NULL, 0);
+    if (arguments->coalesce_size < 1) {
+      argp_error(state, "coalesce-size has to be at least 1");
+    }
+    break;
+  case OPT_IDLE_TIMEOUT:
+    arguments->idle_timeout = strtoul(arg, NULL, 0);
+    break;
+  case OPT_STALL_TIMEOUT:
+    arguments->stall_timeout = strtoul(arg, NULL, 0);
+    break;
+  case OPT_KEEPALIVE:
+    arguments->keepalive = strtoul(arg, NULL, 0);
+    break;
+  case OPT_THREADS:
+    arguments->threads = true;
+    break;
+  case OPT_ENUMERATE:
+    arguments->enumerate = true;
+    break;
+  case OPT_RECONNECT:
+    arguments->reconnect = true;
+    arguments->reconnect_marker = arg != NULL && arg[0] != 0 ? arg : NULL;
+    break;
   case 'r':
     arguments->reset = true;
     break;
   case 'w':
     arguments->wait = true;
     break;
-#ifdef HAS_HID
   case 'y':
     arguments->hid = true;
     break;
+  case OPT_HID_BINARY:
+    arguments->hid = true;
+    arguments->hid_binary = true;
+    break;
+  case 'e':
+    if (arguments->num_evdev == sizeof(arguments->evdev) / sizeof(char *)) {
+      argp_error(state, "too many input devices");
+    }
+    arguments->evdev[arguments->num_evdev++] = arg;
+    break;
+  case OPT_HID_REPLAY:
+    arguments->hid_replay = true;
+    break;
+  case OPT_LISTEN:
+    arguments->listen = arg;
+    break;
+  case OPT_AUDIO_STREAM:
+    arguments->audio_stream = true;
+    break;
+  case OPT_AUDIO_OUT:
+    arguments->audio_out = arg;
+    break;
+  case OPT_AUDIO_LATENCY:
+    arguments->audio_latency = strtoul(arg, NULL, 0);
+    if (arguments->audio_latency < 1 || arguments->audio_latency > 2000) {
+      argp_error(state, "only values between 1 and 2000 are allowed for audio-latency");
+    }
+    break;
+  case OPT_CAPTURE:
+    arguments->capture = arg;
+    break;
+  case OPT_CAPTURE_SIZE:
+    arguments->capture_size = strtoull(arg, NULL, 0);
+    if (arguments->capture_size < 65536 ||
+        arguments->capture_size > CAPTURE_MAX_SIZE) {
+      argp_error(state, "capture-size has to be between 65536 and %d",
+                 CAPTURE_MAX_SIZE);
+    }
+    break;
+  case OPT_CAPTURE_SNAPLEN:
+    arguments->capture_snaplen = strtoul(arg, NULL, 0);
+    if (arguments->capture_snaplen > MAX_BUFFER_SIZE) {
+      argp_error(state, "only values up to %d are allowed for capture-snaplen", MAX_BUFFER_SIZE);
+    }
+    break;
+  case OPT_CAPTURE_EXPORT:
+    arguments->capture_export = arg;
+    break;
+  case OPT_CAPTURE_REPLAY:
+    arguments->capture_replay = arg;
+    break;
+  case OPT_GRAB:
+    arguments->grab = true;
+    break;
+  case OPT_HID_RATE:
+    arguments->hid_rate = strtoul(arg, NULL, 0);
+    break;
+#ifdef HAS_URING
+  case OPT_IO_URING:
+    arguments->io_uring = true;
+    break;
 #endif
 
   case ARGP_KEY_END:
+    if (arguments->capture_export != NULL) {
+      if (arguments->capture == NULL) {
+        argp_error(state, "--capture-export needs the --capture FILE to read");
+      }
+      break;
+    }
+    if (arguments->capture != NULL &&
+        arguments->capture_snaplen > arguments->capture_size / 4) {
+      argp_error(state, "capture-snaplen has to fit a quarter of capture-size");
+    }
+    if (arguments->capture != NULL && arguments->daemon) {
+      argp_error(state, "--capture cannot be combined with --daemon");
+    }
+    if (arguments->capture_replay != NULL) {
+      if (arguments->bench || arguments->mux || arguments->route ||
+          arguments->daemon || arguments->listen != NULL) {
+        argp_error(state, "--capture-replay cannot be combined with --bench, "
+                   "--mux, --route, --daemon or --listen");
+      }
+      if (arguments->capture != NULL &&
+          strcmp(arguments->capture, arguments->capture_replay) == 0) {
+        argp_error(state, "--capture has to be another file than --capture-replay");
+      }
+    }
+    if (arguments->num_mux_loopback > 0) {
+      break;
+    }
+    if (arguments->bench && (arguments->mux || arguments->route || arguments->daemon)) {
+      argp_error(state, "--bench cannot be combined with --mux, --route or --daemon");
+    }
+    if (arguments->threads && arguments->daemon) {
+      argp_error(state, "--threads cannot be combined with --daemon");
+    }
+    if (arguments->listen != NULL &&
+        (strlen(arguments->connect) > 0 || arguments->route ||
+         arguments->mux || arguments->daemon || arguments->bench ||
+         arguments->reconnect)) {
+      argp_error(state, "--listen cannot be combined with --connect, --route, "
+                 "--mux, --daemon, --bench or --reconnect");
+    }
+#ifdef HAS_URING
+    if (arguments->io_uring && arguments->listen != NULL) {
+      argp_error(state, "--io-uring cannot be combined with --listen");
+    }
+    if (arguments->io_uring && arguments->mux) {
+      argp_error(state, "--io-uring cannot be combined with --mux");
+    }
+    if (arguments->io_uring && arguments->reconnect) {
+      argp_error(state, "--io-uring cannot be combined with --reconnect");
+    }
+#endif
+    if (arguments->reconnect &&
+        (arguments->mux ||
+         (strlen(arguments->connect) == 0 && !arguments->route))) {
+      argp_error(state, "--reconnect requires --connect or --route, without --mux");
+    }
+    if (arguments->hid_replay &&
+        (arguments->hid_rate != 0 || arguments->num_evdev > 0)) {
+      argp_error(state, "--hid-replay cannot be combined with --hid-rate or --evdev");
+    }
+    if (arguments->audio_stream &&
+        (arguments->forward || arguments->daemon || arguments->bench ||
+         arguments->hid || arguments->num_evdev > 0 || arguments->hid_replay ||
+         arguments->capture_replay != NULL)) {
+      argp_error(state, "--audio-stream cannot be combined with --forward, "
+                 "--daemon, --bench, --hid, --evdev, --hid-replay or "
+                 "--capture-replay");
+    }
+    if (arguments->simulate) {
+      if (arguments->daemon) {
+        argp_error(state, "--simulate cannot be combined with --daemon");
+      }
+      break;
+    }
+    if (arguments->daemon) {
+      if (arguments->forward && strlen(arguments->connect) == 0 &&
+          !arguments->route) {
+        argp_error(state, "forwarding in daemon mode requires --connect or --route");
+      }
+      break;
+    }
+    if (arguments->devname != NULL) {
+#ifndef HAS_SYS_DEVICE
+      argp_error(state, "this libusb cannot open a device node, use BUSNUM-PORTNUMS");
+#endif
+      break;
+    }
     if (arguments->busnum == -1 || arguments->portnums[0] == 0) {
       argp_error(state, "port is required");
     }
@@ -274,434 +874,7027 @@ static libusb_device_handle *get_usb_device(uint8_t busnum, uint8_t* portnums) {
   return ret;
 }
 
-static bool is_device_in_AOA_mode(libusb_device_handle *dev) {
-  struct libusb_device_descriptor desc;
-  libusb_get_device_descriptor(libusb_get_device(dev), &desc);
-  bool ret = false;
-  // fprintf(stderr, "idVendor: %04x, idProduct: %04x\n", desc.idVendor, desc.idProduct);
-
-  if (desc.idVendor != 0x18d1 || (desc.idProduct != 0x2d00 &&
-      desc.idProduct != 0x2d01 && desc.idProduct != 0x2d02 &&
-      desc.idProduct != 0x2d03 && desc.idProduct != 0x2d04 &&
-      desc.idProduct != 0x2d05)) {
-    ret = false;
-  } else {
-    ret = true;
-  }
+// The event loop: one epoll set for the whole process. Whoever owns an fd
+// embeds a struct watch for it and sets the interest before each round; it
+// is only handed to epoll_ctl when it differs from what is registered, so a
+// busy session costs no syscalls besides its reads and writes.
+struct watch {
+  int fd;
+  uint32_t events;   // registered interest, 0 while not in the epoll set
+  uint32_t revents;  // what happened in the current round
+  bool always;       // epoll refuses regular files, they are always ready
+  bool usb;          // one of libusb's fds
+  struct watch *next;  // in the list of usb or always ready watches
+};
 
-  return ret;
-}
+#define LOOP_MAX_EVENTS 64
 
-static void aoa_announce(libusb_device_handle *device,
-                         struct arguments *arguments) {
-  uint8_t buffer[256];
-  uint16_t aoa_version = 0;
-  int r = 0;
-  buffer[sizeof(buffer)-1] = 0;
-
-
-  r = libusb_control_transfer(device,
-                          LIBUSB_REQUEST_TYPE_VENDOR |
-                              LIBUSB_TRANSFER_TYPE_CONTROL |
-                              LIBUSB_ENDPOINT_IN,
-                          51, 0, 0, buffer, 2, 1000);
-  if(r==LIBUSB_ERROR_PIPE){
-    fprintf(stderr, "device does not support AOA mode (control request was not supported by the device)\n");
-    return;
-  }else if(r<0){
-    fprintf(stderr, "device responded to AOA version request control transfer with an error(%d): %s\n", r, libusb_error_name(r));
-    return;
-  }
-  aoa_version = buffer[0] + (buffer[1]<<8);
-  if (aoa_version != 1 && aoa_version != 2) {
-    fprintf(stderr, "device does not support AOA mode (version returned should be in [1, 2], but is: %d)\n", aoa_version);
-    return;
-  }
-  fprintf(stderr, "device supports AOAv%d\n", aoa_version);
-  if (strnlen(arguments->manufacturer, sizeof(buffer)-1)!=0 && strnlen(arguments->model, sizeof(buffer)-1)!=0){
-    strncpy((char *)buffer, arguments->manufacturer, sizeof(buffer) - 1);
-    libusb_control_transfer(device,
-                            LIBUSB_REQUEST_TYPE_VENDOR |
-                                LIBUSB_TRANSFER_TYPE_CONTROL |
-                                LIBUSB_ENDPOINT_OUT,
-                            52, 0, 0, buffer, strlen((char *)buffer) + 1, 0);
-
-    strncpy((char *)buffer, arguments->model, sizeof(buffer) - 1);
-    libusb_control_transfer(device,
-                            LIBUSB_REQUEST_TYPE_VENDOR |
-                                LIBUSB_TRANSFER_TYPE_CONTROL |
-                                LIBUSB_ENDPOINT_OUT,
-                            52, 0, 1, buffer, strlen((char *)buffer) + 1, 0);
-
-    strncpy((char *)buffer, arguments->description, sizeof(buffer) - 1);
-    libusb_control_transfer(device,
-                            LIBUSB_REQUEST_TYPE_VENDOR |
-                                LIBUSB_TRANSFER_TYPE_CONTROL |
-                                LIBUSB_ENDPOINT_OUT,
-                            52, 0, 2, buffer, strlen((char *)buffer) + 1, 0);
-
-    strncpy((char *)buffer, arguments->version, sizeof(buffer) - 1);
-    libusb_control_transfer(device,
-                            LIBUSB_REQUEST_TYPE_VENDOR |
-                                LIBUSB_TRANSFER_TYPE_CONTROL |
-                                LIBUSB_ENDPOINT_OUT,
-                            52, 0, 3, buffer, strlen((char *)buffer) + 1, 0);
-
-    strncpy((char *)buffer, arguments->url, sizeof(buffer) - 1);
-    libusb_control_transfer(device,
-                            LIBUSB_REQUEST_TYPE_VENDOR |
-                                LIBUSB_TRANSFER_TYPE_CONTROL |
-                                LIBUSB_ENDPOINT_OUT,
-                            52, 0, 4, buffer, strlen((char *)buffer) + 1, 0);
-
-
-    strncpy((char *)buffer, arguments->serial, sizeof(buffer)-1);
-    libusb_control_transfer(device,
-                            LIBUSB_REQUEST_TYPE_VENDOR |
-                                LIBUSB_TRANSFER_TYPE_CONTROL |
-                                LIBUSB_ENDPOINT_OUT,
-                            52, 0, 5, buffer, strlen((char *)buffer) + 1, 0);
-  }
-
-  if(aoa_version==2 && arguments->audio){
-    libusb_control_transfer(device,
-                            LIBUSB_REQUEST_TYPE_VENDOR |
-                                LIBUSB_TRANSFER_TYPE_CONTROL |
-                                LIBUSB_ENDPOINT_OUT,
-                            58, 1, 0, NULL, 0, 0);
-  }
-
-  libusb_control_transfer(device,
-                          LIBUSB_REQUEST_TYPE_VENDOR |
-                              LIBUSB_TRANSFER_TYPE_CONTROL |
-                              LIBUSB_ENDPOINT_OUT,
-                          53, 0, 0, NULL, 0, 0);
+static struct {
+  int epfd;
+  struct watch signals;  // signalfd for SIGINT, SIGTERM and SIGUSR1
+  struct watch timer;    // timerfd for loop_wait_until
+  uint64_t timer_due;    // what it is armed for, 0: not armed
+  struct watch *usb;
+  struct watch *always;
+  struct epoll_event events[LOOP_MAX_EVENTS];
+  int num_events;
+  bool usb_ready;
+  bool usb_threaded;     // libusb is handled by a USB thread (--threads)
+  bool stats_requested;  // SIGUSR1
+} loop = {.epfd = -1};
+
+static void loop_init(void);
+
+static void watch_init(struct watch *w) {
+  memset(w, 0, sizeof(*w));
+  w->fd = -1;
 }
 
-static void stdin_to_aoa_cb(struct libusb_transfer *transfer) {
-  if (transfer->user_data != NULL) {
-    *((ssize_t *)transfer->user_data) = 0;
+static void watch_unlink(struct watch **list, struct watch *w) {
+  for (struct watch **p = list; *p != NULL; p = &(*p)->next) {
+    if (*p == w) {
+      *p = w->next;
+      return;
+    }
   }
 }
-static void aoa_to_stdout_cb(struct libusb_transfer *transfer) {
-  if (transfer->user_data != NULL) {
-    *((ssize_t *)transfer->user_data) = transfer->actual_length;
+
+// Stop watching w->fd, before it is closed or its owner freed.
+static void watch_del(struct watch *w) {
+  if (w->fd < 0) {
+    return;
   }
-  if (transfer->status != LIBUSB_TRANSFER_COMPLETED ){
-    *((ssize_t *)transfer->user_data) = -1;
-    fprintf(stderr, "transfer->status = %x\n", transfer->status);
+  if (w->always) {
+    watch_unlink(&loop.always, w);
+    w->always = false;
+  } else if (w->events != 0) {
+    epoll_ctl(loop.epfd, EPOLL_CTL_DEL, w->fd, NULL);
+  }
+  // drop it from the current round as well
+  for (int i = 0; i < loop.num_events; i++) {
+    if (loop.events[i].data.ptr == w) {
+      loop.events[i].data.ptr = NULL;
+    }
   }
-  
+  w->fd = -1;
+  w->events = 0;
+  w->revents = 0;
 }
 
-static void signal_handler(__attribute__ ((unused)) int sig) {}
-
-static void aoa_cat(libusb_device_handle *device, struct arguments *arguments) {
-  libusb_device *dev = libusb_get_device(device);
-
-  int r = libusb_set_auto_detach_kernel_driver(device, 1);
-  if (r != 0) {
-    fprintf(stderr,
-            "error setting auto_detach for kernel driver for the device: %s\n",
-            libusb_error_name(r));
-    libusb_exit(NULL);
-    exit(EXIT_FAILURE);
+// Watch fd for events. No interest takes it out of the epoll set, as hangups
+// would be reported regardless.
+static void watch_set(struct watch *w, int fd, uint32_t events) {
+  if (loop.epfd < 0) {
+    loop_init();
   }
-  r = libusb_claim_interface(device, 0);
-  if (r != 0) {
-    fprintf(stderr, "error claiming the interface of the device: %s\n",
-            libusb_error_name(r));
-    libusb_exit(NULL);
-    exit(EXIT_FAILURE);
+  if (w->fd != fd) {
+    watch_del(w);
+    w->fd = fd;
   }
-
-  struct libusb_config_descriptor *config = NULL;
-  libusb_get_active_config_descriptor(dev, &config);
-  uint16_t max_packet_size =
-      config->interface[0].altsetting[0].endpoint[0].wMaxPacketSize;
-
-  struct libusb_transfer *AOA_to_stdout = libusb_alloc_transfer(0);
-  struct libusb_transfer *stdin_to_AOA = libusb_alloc_transfer(0);
-
-  uint8_t buffer_from_stdin[max_packet_size];
-  ssize_t buffer_from_stdin_len = 0;
-
-  uint8_t buffer_from_aoain[max_packet_size];
-  ssize_t buffer_from_aoain_len = 0;
-
-  libusb_fill_bulk_transfer(AOA_to_stdout, device, 0x81, buffer_from_aoain,
-                            max_packet_size, aoa_to_stdout_cb,
-                            &buffer_from_aoain_len, 0);
-  libusb_submit_transfer(AOA_to_stdout);
-
-  bool aoa_sent_already = !(arguments->wait);
-
-  int fd_in = STDIN_FILENO;
-  int fd_out = STDOUT_FILENO;
-
-  if (strlen(arguments->connect)>0)
-  {
-    struct addrinfo hints;
-    struct addrinfo *result, *rp;
-    int s, sfd;
-
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = 0;
-    hints.ai_protocol = 0;
-
-    s = getaddrinfo("localhost", arguments->connect, &hints, &result);
-    if (s !=0 ) {
-      fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
-      libusb_exit(NULL);
-      exit(EXIT_FAILURE);
-    }
-
-    for (rp = result; rp != NULL; rp = rp->ai_next) {
-      sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-
-      if (sfd == -1)
-        continue;
-      if (connect(sfd, rp->ai_addr, rp->ai_addrlen) != -1)
-        break;  // Success
-      
-      close(sfd);
-    }
-    if (rp == NULL) {
-      fprintf(stderr, "Could not connect\n");
-      libusb_exit(NULL);
-      exit(EXIT_FAILURE);
+  if (events == w->events) {
+    return;
+  }
+  if (w->always) {
+    w->events = events;
+    return;
+  }
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = w;
+  int op = w->events == 0 ? EPOLL_CTL_ADD
+                          : events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+  if (epoll_ctl(loop.epfd, op, fd, &ev) != 0) {
+    if (errno == EPERM) {
+      w->always = true;
+      w->next = loop.always;
+      loop.always = w;
+    } else {
+      fprintf(stderr, "could not watch fd %d: %s\n", fd, strerror(errno));
+      return;
     }
+  }
+  w->events = events;
+}
 
-    freeaddrinfo(result);
-
-    // sfd contains the open socket file descriptor
-    fd_in = sfd;
-    fd_out = sfd;
+static void usb_fd_added(int fd, short events,
+                         __attribute__ ((unused)) void *user_data) {
+  struct watch *w = malloc(sizeof(struct watch));
+  if (w == NULL) {
+    fprintf(stderr, "could not allocate a watch for a libusb fd\n");
+    return;
   }
+  watch_init(w);
+  watch_set(w, fd, events);
+  w->usb = true;
+  w->next = loop.usb;
+  loop.usb = w;
+}
 
-  while (1) {
-    if (buffer_from_stdin_len < 0 || buffer_from_aoain_len < 0) {
-      goto exiting;
+static void usb_fd_removed(int fd, __attribute__ ((unused)) void *user_data) {
+  for (struct watch *w = loop.usb; w != NULL; w = w->next) {
+    if (w->fd == fd) {
+      watch_unlink(&loop.usb, w);
+      watch_del(w);
+      free(w);
+      return;
     }
+  }
+}
 
-    // fill pollfd list
-    const struct libusb_pollfd **usb_fds = libusb_get_pollfds(NULL);
-    size_t num_pollfd = 0;
+static void loop_init(void) {
+  loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop.epfd < 0) {
+    fprintf(stderr, "could not create the epoll set: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
 
-    for (int i = 0; usb_fds[i] != NULL; i++) {
-      num_pollfd++;
-    }
-    if (aoa_sent_already && buffer_from_stdin_len == 0) {
-      num_pollfd++;
-    }
-    if (buffer_from_aoain_len > 0) {
-      num_pollfd++;
-    }
+  // delivered through the loop from now on
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGUSR1);
+  sigprocmask(SIG_BLOCK, &set, NULL);
+  watch_init(&loop.signals);
+  int sfd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (sfd < 0) {
+    fprintf(stderr, "could not create the signalfd: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  watch_set(&loop.signals, sfd, EPOLLIN);
 
-    struct pollfd fds[num_pollfd];
+  watch_init(&loop.timer);
+  int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (tfd < 0) {
+    fprintf(stderr, "could not create the loop timer: %s\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  watch_set(&loop.timer, tfd, EPOLLIN);
 
-    size_t j = 0;
+  const struct libusb_pollfd **usb_fds = libusb_get_pollfds(NULL);
+  for (int i = 0; usb_fds != NULL && usb_fds[i] != NULL; i++) {
+    usb_fd_added(usb_fds[i]->fd, usb_fds[i]->events, NULL);
+  }
+  libusb_free_pollfds(usb_fds);
+  libusb_set_pollfd_notifiers(NULL, usb_fd_added, usb_fd_removed, NULL);
+}
 
-    for (int i = 0; usb_fds[i] != NULL; i++) {
-      fds[j].fd = usb_fds[i]->fd;
-      fds[j].events = usb_fds[i]->events;
-      j++;
-    }
-    libusb_free_pollfds(usb_fds);
+// With --threads libusb belongs to the USB thread, the loop stops watching its
+// fds for good.
+static void loop_release_usb(void) {
+  if (loop.epfd < 0) {
+    loop_init();
+  }
+  libusb_set_pollfd_notifiers(NULL, NULL, NULL, NULL);
+  while (loop.usb != NULL) {
+    struct watch *w = loop.usb;
+    loop.usb = w->next;
+    watch_del(w);
+    free(w);
+  }
+  loop.usb_threaded = true;
+}
 
-    if (aoa_sent_already && buffer_from_stdin_len == 0) {
-      fds[j].fd = fd_in;
-      fds[j].events = POLLIN;
-      j++;
+// Wait up to timeout_ms for the watched fds and set their revents for this
+// round. Returns false once SIGINT or SIGTERM was received.
+static bool loop_wait(int timeout_ms) {
+  if (loop.epfd < 0) {
+    loop_init();
+  }
+  // forget the previous round
+  for (int i = 0; i < loop.num_events; i++) {
+    struct watch *w = loop.events[i].data.ptr;
+    if (w != NULL) {
+      w->revents = 0;
     }
-
-    if (buffer_from_aoain_len > 0) {
-      fds[j].fd = fd_out;
-      fds[j].events = POLLOUT;
-      j++;
+  }
+  loop.num_events = 0;
+  loop.usb_ready = false;
+  for (struct watch *w = loop.always; w != NULL; w = w->next) {
+    if (w->events != 0) {
+      timeout_ms = 0;
     }
+  }
 
-    struct timeval timeout;
-    if (!libusb_get_next_timeout(NULL, &timeout)) {
-      // no pending timeouts, call with 1 sec instead.
-      timeout.tv_sec = 1;
-      timeout.tv_usec = 0;
+  int n = epoll_wait(loop.epfd, loop.events, LOOP_MAX_EVENTS, timeout_ms);
+  if (n < 0) {
+    if (errno == EINTR) {
+      return true;
     }
-    struct timespec tmo;
-    tmo.tv_sec = timeout.tv_sec;
-    tmo.tv_nsec = timeout.tv_usec * 1000000;
-
-    sigset_t emptyset, blockset;
-    struct sigaction sa;
-    sigemptyset(&blockset);
-    sigaddset(&blockset, SIGINT);
-    sigaddset(&blockset, SIGTERM);
-    sigprocmask(SIG_BLOCK, &blockset, NULL);
-
-    sa.sa_handler = signal_handler;
-    sa.sa_flags = 0;
-    sigemptyset(&sa.sa_mask);
-
-    sigaction(SIGINT, &sa, NULL);
-    sigaction(SIGTERM, &sa, NULL);
-    sigemptyset(&emptyset);
+    fprintf(stderr, "an error occured %d: %s\n", errno, strerror(errno));
+    return false;
+  }
+  loop.num_events = n;
+  for (int i = 0; i < n; i++) {
+    struct watch *w = loop.events[i].data.ptr;
+    w->revents = loop.events[i].events;
+    loop.usb_ready |= w->usb;
+  }
+  for (struct watch *w = loop.always; w != NULL; w = w->next) {
+    w->revents = w->events;
+  }
 
-    // poll
-    int r = ppoll(fds, num_pollfd, &tmo, &emptyset);
-    if (r < 0) {
-      if (errno = EINTR) {
-        // a signal (SIGINT or SIGTERM)
-        fprintf(stderr, "SIGINT or SIGTERM received: terminating\n");
+  if (loop.signals.revents) {
+    bool terminate = false;
+    struct signalfd_siginfo si;
+    while (read(loop.signals.fd, &si, sizeof(si)) == sizeof(si)) {
+      if (si.ssi_signo == SIGUSR1) {
+        loop.stats_requested = true;
       } else {
-        // an error occured
-        fprintf(stderr, "an error occured %d: %s\n", errno, strerror(errno));
+        terminate = true;
       }
-      goto exiting;
     }
-
-    if (r == 0) {
-      // timeout
-      struct timeval zero_tv = {0, 0};
-      libusb_handle_events_timeout(NULL, &zero_tv);
-      continue;
+    if (terminate) {
+      fprintf(stderr, "SIGINT or SIGTERM received: terminating\n");
+      return false;
     }
+  }
+  return true;
+}
 
-    // check which one fired
-    for (size_t i = 0; i < num_pollfd; i++) {
-      if (fds[i].fd == fd_in && fds[i].revents & POLLIN) {
-        // reading from stdin possible
-        buffer_from_stdin_len =
-            read(fd_in, buffer_from_stdin, max_packet_size);
-        if (buffer_from_stdin_len <= 0) {
-          goto exiting;
-        }
-        // fprintf(stderr, "read %ld bytes from stdin\n",
-        // buffer_from_stdin_len);
-        libusb_fill_bulk_transfer(stdin_to_AOA, device, 0x1, buffer_from_stdin,
-                                  buffer_from_stdin_len, stdin_to_aoa_cb,
-                                  &buffer_from_stdin_len, 0);
-        libusb_submit_transfer(stdin_to_AOA);
-      } else if (fds[i].fd == fd_out && fds[i].revents & POLLOUT) {
-        // writing to stdout possible
-        // fprintf(stderr, "read %ld bytes from aoa\n", buffer_from_aoain_len);
-        ssize_t b =
-            write(fd_out, buffer_from_aoain, buffer_from_aoain_len);
-        if (b != buffer_from_aoain_len) {
-          fprintf(stderr, "could not write out the complete AOA buffer to "
-                          "stdout. Exiting...\n");
-          goto exiting;
-        }
-        buffer_from_aoain_len = 0;
-        aoa_sent_already = true;
-
-        libusb_fill_bulk_transfer(AOA_to_stdout, device, 0x81,
-                                  buffer_from_aoain, max_packet_size,
-                                  aoa_to_stdout_cb, &buffer_from_aoain_len, 0);
-        libusb_submit_transfer(AOA_to_stdout);
-      } else {
-        // handle usb events
-        struct timeval zero_tv = {0, 0};
-        libusb_handle_events_timeout(NULL, &zero_tv);
-      }
+// Wait like loop_wait, up to the CLOCK_MONOTONIC deadline in ns. epoll_wait
+// only counts milliseconds, so a timerfd wakes the loop. It is armed again
+// only when the deadline moved closer, a later one is at worst an early
+// wakeup.
+static bool loop_wait_until(uint64_t deadline) {
+  if (loop.epfd < 0) {
+    loop_init();
+  }
+  if (loop.timer_due == 0 || deadline < loop.timer_due) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = deadline / 1000000000;
+    its.it_value.tv_nsec = deadline % 1000000000;
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+      its.it_value.tv_nsec = 1;  // zero would disarm it
     }
+    timerfd_settime(loop.timer.fd, TFD_TIMER_ABSTIME, &its, NULL);
+    loop.timer_due = deadline;
   }
-
-exiting:
-  if (fd_in == fd_out) {
-    close(fd_in);
+  bool r = loop_wait(-1);
+  if (loop.timer.revents) {
+    uint64_t expirations;
+    if (read(loop.timer.fd, &expirations, sizeof(expirations)) > 0) {
+      loop.timer_due = 0;
+    }
   }
+  return r;
 }
 
-#ifdef HAS_HID
-static void aoa_hid(libusb_device_handle *device, __attribute__ ((unused)) struct arguments *arguments) {
-  char *line = NULL;
-  size_t len = 0;
-  ssize_t nread = 0;
-
-
-  uint8_t hid_index = 0;
-  int r = 0;
-  
-  struct libusb_device_descriptor dev_desc;
-  libusb_get_device_descriptor(libusb_get_device(device), &dev_desc);
-  uint16_t max_packet_size = dev_desc.bMaxPacketSize0;
-//  fprintf(stderr, "wMaxPacketSize: %d\n", max_packet_size);
-
-  base64_decodestate state;
-
-  nread = getline(&line, &len, stdin);
-  ssize_t max_allowed_line_length = nread;
-  char binary_line[max_allowed_line_length + 2];  // this ensures, that there is always enough space for the decoded string,
-                                                  // even in the degenerate case of very short malicious encoded lines.
+// libusb_error_name only knows LIBUSB_ERROR_* codes, not transfer statuses.
+#define TRANSFER_STATUS_MAX (LIBUSB_TRANSFER_OVERFLOW + 1)
+static const char *transfer_status_names[TRANSFER_STATUS_MAX] = {
+    "completed", "error", "timed_out", "cancelled", "stall", "no_device",
+    "overflow"};
 
-  base64_init_decodestate(&state);
-  ssize_t binary_len = base64_decode_block(line, nread, binary_line, &state);
+static const char *transfer_status_name(enum libusb_transfer_status status) {
+  return (unsigned)status < TRANSFER_STATUS_MAX ? transfer_status_names[status]
+                                                : "unknown";
+}
 
-  if( binary_len > UINT16_MAX) {
-    free(line);
-    fprintf(stderr, "HID descriptor too big for AOA (length: %ld, max allowed size: %d)\n", binary_len, UINT16_MAX);
-    return;
-  }
+// The USB side of every mode: a real device through libusb, or a simulated
+// one (--simulate). Bulk and control transfers are struct libusb_transfer in
+// both cases, the simulation completes them on its own.
+struct aoa_transport;
 
-  libusb_control_transfer(device,
-                            LIBUSB_REQUEST_TYPE_VENDOR |
-                                LIBUSB_TRANSFER_TYPE_CONTROL |
-                                LIBUSB_ENDPOINT_OUT,
-                            54, hid_index, binary_len, (unsigned char*)binary_line, 0, 0);
+struct aoa_transport_ops {
+  int (*control)(struct aoa_transport *transport, uint8_t request_type,
+                 uint8_t request, uint16_t value, uint16_t index,
+                 unsigned char *data, uint16_t length, unsigned int timeout);
+  int (*submit)(struct aoa_transport *transport,
+                struct libusb_transfer *transfer);
+  int (*cancel)(struct aoa_transport *transport,
+                struct libusb_transfer *transfer);
+  int (*handle_events)(struct aoa_transport *transport, struct timeval *tv);
+  // make handle_events return early, from another thread
+  void (*interrupt)(struct aoa_transport *transport);
+  int (*claim)(struct aoa_transport *transport);
+  void (*release)(struct aoa_transport *transport);
+  int (*reset)(struct aoa_transport *transport);
+  void (*close)(struct aoa_transport *transport);
+  // fds to watch besides the libusb ones, may be NULL: set the interest
+  // before a round of the loop, handle what happened after it
+  void (*watch)(struct aoa_transport *transport);
+  void (*dispatch)(struct aoa_transport *transport);
+  // the AOAv2 audio streaming interface: claim it and return its
+  // isochronous IN endpoint and the largest packet on it
+  int (*claim_audio)(struct aoa_transport *transport, uint8_t *endpoint,
+                     int *packet_size);
+  void (*release_audio)(struct aoa_transport *transport);
+};
 
-  for(ssize_t offset=0; offset < binary_len; offset += max_packet_size){
-    libusb_control_transfer(device,
-                              LIBUSB_REQUEST_TYPE_VENDOR |
-                                  LIBUSB_TRANSFER_TYPE_CONTROL |
-                                  LIBUSB_ENDPOINT_OUT,
-                              56, hid_index, offset, (unsigned char*)binary_line + offset, MIN(binary_len - offset, max_packet_size), 0);
-  }
-  
-  fprintf(stderr, "registered HID device (len=%ld)\n", binary_len);
-  fflush(stderr);
+struct aoa_transport {
+  const struct aoa_transport_ops *ops;
+  libusb_device_handle *device;  // NULL when simulated
+  struct libusb_device_descriptor desc;
+  uint16_t max_packet_size;      // of the accessory bulk endpoints, once claimed
+  char name[4 * PORT_NUMBERS_LEN + 4];  // BUSNUM-PORTNUMS, for messages
+  int sys_fd;  // device node wrapped by libusb, closed after it, or -1
+  int audio_interface;  // claimed by claim_audio, or -1
+};
 
-  usleep(100000);
+static int aoa_control(struct aoa_transport *transport, uint8_t request_type,
+                       uint8_t request, uint16_t value, uint16_t index,
+                       unsigned char *data, uint16_t length,
+                       unsigned int timeout) {
+  return transport->ops->control(transport, request_type, request, value,
+                                 index, data, length, timeout);
+}
 
-  while( 0 <= (nread = getline(&line, &len, stdin))){
-    if(nread>max_allowed_line_length){
-      fprintf(stderr, "base64 encoded event size too long (length: %ld, max_allowed_line_length: %ld)\n", nread, max_allowed_line_length);
-      break;
-    }
-    base64_init_decodestate(&state);
-    binary_len = base64_decode_block(line, nread, binary_line, &state);
-    if(binary_len > max_packet_size){
-      fprintf(stderr, "event size too big for AOA (length: %ld, max_packet_size: %d)\n", binary_len, max_packet_size);
-      break;
-    }
-    r = libusb_control_transfer(device,
-                              LIBUSB_REQUEST_TYPE_VENDOR |
-                                  LIBUSB_TRANSFER_TYPE_CONTROL |
-                                  LIBUSB_ENDPOINT_OUT,
-                              57, hid_index, 0, (unsigned char*)binary_line, binary_len, 0);
+static int usb_control(struct aoa_transport *transport, uint8_t request_type,
+                       uint8_t request, uint16_t value, uint16_t index,
+                       unsigned char *data, uint16_t length,
+                       unsigned int timeout) {
+  return libusb_control_transfer(transport->device, request_type, request,
+                                 value, index, data, length, timeout);
+}
 
-     if(r<0){
-      fprintf(stderr, "error: %s\n", libusb_error_name(r));
-    }
+static int usb_submit(__attribute__ ((unused)) struct aoa_transport *transport,
+                      struct libusb_transfer *transfer) {
+  return libusb_submit_transfer(transfer);
+}
 
-  }
+static int usb_cancel(__attribute__ ((unused)) struct aoa_transport *transport,
+                      struct libusb_transfer *transfer) {
+  return libusb_cancel_transfer(transfer);
+}
 
-  libusb_control_transfer(device,
-                            LIBUSB_REQUEST_TYPE_VENDOR |
-                                LIBUSB_TRANSFER_TYPE_CONTROL |
-                                LIBUSB_ENDPOINT_OUT,
-                            55, hid_index, 0, (unsigned char*)binary_line, 0, 0);
+static int usb_handle_events(__attribute__ ((unused)) struct aoa_transport *transport,
+                             struct timeval *tv) {
+  return libusb_handle_events_timeout(NULL, tv);
+}
 
-  free(line);
+static void usb_interrupt(__attribute__ ((unused)) struct aoa_transport *transport) {
+  libusb_interrupt_event_handler(NULL);
 }
-#endif  // HAS_HID
 
-static void aoa_reset(libusb_device_handle *device,
-                      __attribute__ ((unused)) struct arguments *arguments) {
-  int r = libusb_reset_device(device);
-  if (r != 0 && r != LIBUSB_ERROR_NOT_FOUND) {
-    fprintf(stderr, "error resetting the device: %s\n", libusb_error_name(r));
+static int usb_claim(struct aoa_transport *transport) {
+  int r = libusb_set_auto_detach_kernel_driver(transport->device, 1);
+  if (r != 0) {
+    fprintf(stderr,
+            "error setting auto_detach for kernel driver for the device: %s\n",
+            libusb_error_name(r));
+    return r;
+  }
+  r = libusb_claim_interface(transport->device, 0);
+  if (r != 0) {
+    fprintf(stderr, "error claiming the interface of the device: %s\n",
+            libusb_error_name(r));
+    return r;
+  }
+
+  struct libusb_config_descriptor *config = NULL;
+  libusb_get_active_config_descriptor(libusb_get_device(transport->device),
+                                      &config);
+  transport->max_packet_size =
+      config->interface[0].altsetting[0].endpoint[0].wMaxPacketSize;
+  libusb_free_config_descriptor(config);
+  return 0;
+}
+
+static void usb_release(struct aoa_transport *transport) {
+  libusb_release_interface(transport->device, 0);
+}
+
+// The audio function of an AOAv2 device is a plain USB audio class one: the
+// PCM comes from an isochronous IN endpoint of an alternate setting of its
+// streaming interface.
+static int usb_claim_audio(struct aoa_transport *transport, uint8_t *endpoint,
+                           int *packet_size) {
+  struct libusb_config_descriptor *config = NULL;
+  int r = libusb_get_active_config_descriptor(
+      libusb_get_device(transport->device), &config);
+  if (r != 0) {
+    fprintf(stderr, "error reading the configuration of the device: %s\n",
+            libusb_error_name(r));
+    return r;
+  }
+  int interface = -1, alt_setting = 0;
+  for (int i = 0; i < config->bNumInterfaces && interface < 0; i++) {
+    for (int a = 0; a < config->interface[i].num_altsetting; a++) {
+      const struct libusb_interface_descriptor *alt =
+          &config->interface[i].altsetting[a];
+      if (alt->bInterfaceClass != LIBUSB_CLASS_AUDIO ||
+          alt->bInterfaceSubClass != 2) {  // AUDIOSTREAMING
+        continue;
+      }
+      for (int e = 0; e < alt->bNumEndpoints && interface < 0; e++) {
+        const struct libusb_endpoint_descriptor *ep = &alt->endpoint[e];
+        if ((ep->bmAttributes & 3) == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS &&
+            ep->bEndpointAddress & LIBUSB_ENDPOINT_IN) {
+          interface = alt->bInterfaceNumber;
+          alt_setting = alt->bAlternateSetting;
+          *endpoint = ep->bEndpointAddress;
+        }
+      }
+      if (interface >= 0) {
+        break;
+      }
+    }
+  }
+  libusb_free_config_descriptor(config);
+  if (interface < 0) {
+    fprintf(stderr, "the device has no audio interface, announce with --audio\n");
+    return LIBUSB_ERROR_NOT_FOUND;
+  }
+
+  // snd-usb-audio binds to it otherwise
+  libusb_set_auto_detach_kernel_driver(transport->device, 1);
+  r = libusb_claim_interface(transport->device, interface);
+  if (r != 0) {
+    fprintf(stderr, "error claiming the audio interface of the device: %s\n",
+            libusb_error_name(r));
+    return r;
+  }
+  r = libusb_set_interface_alt_setting(transport->device, interface,
+                                       alt_setting);
+  if (r != 0) {
+    fprintf(stderr, "error selecting the audio stream of the device: %s\n",
+            libusb_error_name(r));
+    libusb_release_interface(transport->device, interface);
+    return r;
+  }
+  transport->audio_interface = interface;
+  // SET_CUR of the sampling frequency; Android only has the one, so this is
+  // allowed to fail
+  unsigned char rate[3] = {AUDIO_RATE & 0xff, (AUDIO_RATE >> 8) & 0xff,
+                           AUDIO_RATE >> 16};
+  libusb_control_transfer(transport->device,
+                          LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_ENDPOINT |
+                              LIBUSB_ENDPOINT_OUT,
+                          0x01, 0x0100, *endpoint, rate, sizeof(rate), 1000);
+  *packet_size = libusb_get_max_iso_packet_size(
+      libusb_get_device(transport->device), *endpoint);
+  return 0;
+}
+
+static void usb_release_audio(struct aoa_transport *transport) {
+  if (transport->audio_interface < 0) {
+    return;
+  }
+  // alternate setting 0 has no bandwidth reserved
+  libusb_set_interface_alt_setting(transport->device,
+                                   transport->audio_interface, 0);
+  libusb_release_interface(transport->device, transport->audio_interface);
+  transport->audio_interface = -1;
+}
+
+static int usb_reset(struct aoa_transport *transport) {
+  return libusb_reset_device(transport->device);
+}
+
+static void usb_close(struct aoa_transport *transport) {
+  libusb_close(transport->device);
+  if (transport->sys_fd >= 0) {
+    close(transport->sys_fd);
+  }
+  free(transport);
+}
+
+static const struct aoa_transport_ops usb_transport_ops = {
+    .control = usb_control,
+    .submit = usb_submit,
+    .cancel = usb_cancel,
+    .handle_events = usb_handle_events,
+    .interrupt = usb_interrupt,
+    .claim = usb_claim,
+    .release = usb_release,
+    .reset = usb_reset,
+    .close = usb_close,
+    .claim_audio = usb_claim_audio,
+    .release_audio = usb_release_audio,
+};
+
+// BUSNUM-PORTNUMS, as accepted by --port
+static void port_name(libusb_device *dev, char *name, size_t len) {
+  uint8_t portnums[PORT_NUMBERS_LEN];
+  int n = libusb_get_port_numbers(dev, portnums, PORT_NUMBERS_LEN);
+  size_t off = snprintf(name, len, "%d", libusb_get_bus_number(dev));
+  for (int i = 0; i < n && off < len; i++) {
+    off += snprintf(name + off, len - off, "%c%d", i == 0 ? '-' : '.',
+                    portnums[i]);
+  }
+}
+
+static struct aoa_transport *usb_transport_new(libusb_device_handle *device) {
+  struct aoa_transport *transport = calloc(1, sizeof(struct aoa_transport));
+  if (transport == NULL) {
+    fprintf(stderr, "could not allocate the transport\n");
+    libusb_close(device);
+    return NULL;
+  }
+  transport->ops = &usb_transport_ops;
+  transport->device = device;
+  transport->sys_fd = -1;
+  transport->audio_interface = -1;
+  libusb_get_device_descriptor(libusb_get_device(device), &transport->desc);
+  port_name(libusb_get_device(device), transport->name,
+            sizeof(transport->name));
+  return transport;
+}
+
+#ifdef HAS_SYS_DEVICE
+static int sysfs_usb_attr(const char *port, const char *attr) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/%s", port, attr);
+  FILE *f = fopen(path, "r");
+  int value = -1;
+  if (f != NULL) {
+    if (fscanf(f, "%d", &value) != 1) {
+      value = -1;
+    }
+    fclose(f);
+  }
+  return value;
+}
+
+// Open the device node of --port before libusb_init, found through sysfs for
+// BUSNUM-PORTNUMS. Returns -1 if that is not possible, the device is then
+// looked for by enumerating the bus.
+static int usb_open_node(struct arguments *arguments) {
+  char node[32];
+  const char *path = arguments->devname;
+  if (path == NULL) {
+    int busnum = sysfs_usb_attr(arguments->port, "busnum");
+    int devnum = sysfs_usb_attr(arguments->port, "devnum");
+    if (busnum < 0 || devnum < 0) {
+      return -1;
+    }
+    snprintf(node, sizeof(node), "/dev/bus/usb/%03d/%03d", busnum, devnum);
+    path = node;
+  }
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd < 0 && arguments->devname != NULL) {
+    fprintf(stderr, "error opening %s: %s\n", path, strerror(errno));
+  }
+  return fd;
+}
+#endif
+
+// The device of --port: the node opened by usb_open_node handed to libusb,
+// or found by enumerating the bus.
+static struct aoa_transport *usb_transport_open(struct arguments *arguments,
+                                                int sys_fd) {
+#ifdef HAS_SYS_DEVICE
+  if (sys_fd >= 0) {
+    libusb_device_handle *device;
+    int r = libusb_wrap_sys_device(NULL, sys_fd, &device);
+    if (r != 0) {
+      fprintf(stderr, "error opening the device: %s\n", libusb_error_name(r));
+      close(sys_fd);
+      return NULL;
+    }
+    struct aoa_transport *transport = usb_transport_new(device);
+    if (transport == NULL) {
+      close(sys_fd);
+      return NULL;
+    }
+    // libusb does not know the port of a wrapped device
+    transport->sys_fd = sys_fd;
+    snprintf(transport->name, sizeof(transport->name), "%s",
+             arguments->devname != NULL ? arguments->devname : arguments->port);
+    return transport;
+  }
+#else
+  (void)sys_fd;
+#endif
+  if (arguments->busnum == -1) {
+    // only a device node was given and it did not open
+    return NULL;
+  }
+  return usb_transport_new(
+      get_usb_device((uint8_t)arguments->busnum, arguments->portnums));
+}
+
+static bool is_AOA_product(const struct libusb_device_descriptor *desc) {
+  // fprintf(stderr, "idVendor: %04x, idProduct: %04x\n", desc->idVendor, desc->idProduct);
+  return desc->idVendor == 0x18d1 &&
+         desc->idProduct >= 0x2d00 && desc->idProduct <= 0x2d05;
+}
+
+// 0x2d02 and 0x2d03 only expose audio, but no accessory interface
+static bool has_accessory_interface(const struct libusb_device_descriptor *desc) {
+  return is_AOA_product(desc) &&
+         desc->idProduct != 0x2d02 && desc->idProduct != 0x2d03;
+}
+
+// 0x2d02 to 0x2d05 were announced with --audio
+static bool has_audio_interface(const struct libusb_device_descriptor *desc) {
+  return is_AOA_product(desc) && desc->idProduct >= 0x2d02;
+}
+
+static bool is_device_in_AOA_mode(struct aoa_transport *transport) {
+  return is_AOA_product(&transport->desc);
+}
+
+// What the announce templates can refer to, gathered in-process instead of
+// from hostnamectl and ip. Hostname, OS and model are read once; the
+// addresses again after the kernel reported a change (--daemon).
+static struct {
+  bool valid;
+  bool addrs_valid;
+  char hostname[HOST_NAME_MAX + 1];
+  char os[256];
+  char model[256];
+  char addrs[256];
+  struct watch netlink;  // address changes, while running as daemon
+} host_info;
+
+// Strip trailing whitespace, which files in sysfs and procfs end with.
+static void strip(char *s) {
+  size_t n = strlen(s);
+  while (n > 0 && (s[n - 1] == '\n' || s[n - 1] == ' ')) {
+    s[--n] = 0;
+  }
+}
+
+static bool read_line(const char *path, char *buf, size_t len) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return false;
+  }
+  bool ok = fgets(buf, len, f) != NULL;
+  fclose(f);
+  if (ok) {
+    strip(buf);
+  }
+  return ok && buf[0] != 0;
+}
+
+// KEY="value" from os-release, without the quotes
+static bool os_release_value(const char *line, const char *key, char *buf,
+                             size_t len) {
+  size_t n = strlen(key);
+  if (strncmp(line, key, n) != 0 || line[n] != '=') {
+    return false;
+  }
+  line += n + 1;
+  if (*line == '"' || *line == '\'') {
+    line++;
+  }
+  snprintf(buf, len, "%s", line);
+  strip(buf);
+  n = strlen(buf);
+  if (n > 0 && (buf[n - 1] == '"' || buf[n - 1] == '\'')) {
+    buf[n - 1] = 0;
+  }
+  return true;
+}
+
+static void host_info_read_os(void) {
+  char vendor[128] = "", product[128] = "";
+  FILE *f = fopen("/etc/os-release", "r");
+  if (f == NULL) {
+    f = fopen("/usr/lib/os-release", "r");
+  }
+  if (f != NULL) {
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+      os_release_value(line, "PRETTY_NAME", host_info.os,
+                       sizeof(host_info.os));
+      os_release_value(line, "OPENWRT_DEVICE_MANUFACTURER", vendor,
+                       sizeof(vendor));
+      os_release_value(line, "OPENWRT_DEVICE_PRODUCT", product,
+                       sizeof(product));
+    }
+    fclose(f);
+  }
+
+  // like hostnamectl: DMI on PCs, the device tree on boards
+  if (vendor[0] == 0 || product[0] == 0) {
+    if (!read_line("/sys/class/dmi/id/sys_vendor", vendor, sizeof(vendor)) ||
+        !read_line("/sys/class/dmi/id/product_name", product,
+                   sizeof(product))) {
+      vendor[0] = 0;
+      read_line("/proc/device-tree/model", product, sizeof(product));
+    }
+  }
+  snprintf(host_info.model, sizeof(host_info.model), "%s%s%s", vendor,
+           vendor[0] != 0 && product[0] != 0 ? " " : "", product);
+}
+
+static bool ignored_interface(const char *name) {
+  // bridges of VMs and containers, br-lan of OpenWRT is kept
+  return strcmp(name, "lo") == 0 || strncmp(name, "virbr", 5) == 0 ||
+         strncmp(name, "docker", 6) == 0 || strncmp(name, "veth", 4) == 0;
+}
+
+// One "address<TAB>interface" line per global address, from a netlink dump.
+static void host_info_read_addrs(void) {
+  host_info.addrs[0] = 0;
+  host_info.addrs_valid = true;
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (fd < 0) {
+    fprintf(stderr, "could not open a netlink socket: %s\n", strerror(errno));
+    return;
+  }
+  struct {
+    struct nlmsghdr nh;
+    struct ifaddrmsg ifa;
+  } req;
+  memset(&req, 0, sizeof(req));
+  req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+  req.nh.nlmsg_type = RTM_GETADDR;
+  req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  req.ifa.ifa_family = AF_UNSPEC;
+  if (send(fd, &req, req.nh.nlmsg_len, 0) < 0) {
+    fprintf(stderr, "could not request the addresses: %s\n", strerror(errno));
+    close(fd);
+    return;
+  }
+
+  size_t off = 0;
+  char buf[8192];
+  bool done = false;
+  while (!done) {
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0) {
+      break;
+    }
+    for (struct nlmsghdr *nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, n);
+         nh = NLMSG_NEXT(nh, n)) {
+      if (nh->nlmsg_type == NLMSG_DONE || nh->nlmsg_type == NLMSG_ERROR) {
+        done = true;
+        break;
+      }
+      if (nh->nlmsg_type != RTM_NEWADDR) {
+        continue;
+      }
+      struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+      if (ifa->ifa_scope != RT_SCOPE_UNIVERSE) {
+        continue;
+      }
+      void *addr = NULL;
+      int len = IFA_PAYLOAD(nh);
+      for (struct rtattr *rta = IFA_RTA(ifa); RTA_OK(rta, len);
+           rta = RTA_NEXT(rta, len)) {
+        // IFA_LOCAL is the own end of point-to-point links
+        if (rta->rta_type == IFA_LOCAL ||
+            (rta->rta_type == IFA_ADDRESS && addr == NULL)) {
+          addr = RTA_DATA(rta);
+        }
+      }
+      char name[IF_NAMESIZE], text[INET6_ADDRSTRLEN];
+      if (addr == NULL || if_indextoname(ifa->ifa_index, name) == NULL ||
+          ignored_interface(name) ||
+          inet_ntop(ifa->ifa_family, addr, text, sizeof(text)) == NULL) {
+        continue;
+      }
+      if (off < sizeof(host_info.addrs)) {
+        off += snprintf(host_info.addrs + off, sizeof(host_info.addrs) - off,
+                        "%s%s\t%s", off == 0 ? "" : "\n", text, name);
+      }
+    }
+  }
+  close(fd);
+}
+
+static void host_info_update(void) {
+  if (!host_info.valid) {
+    if (gethostname(host_info.hostname, sizeof(host_info.hostname)) != 0) {
+      host_info.hostname[0] = 0;
+    }
+    host_info_read_os();
+    host_info.valid = true;
+  }
+  if (!host_info.addrs_valid) {
+    host_info_read_addrs();
+  }
+}
+
+// Keep the addresses until the kernel reports that they changed.
+static void host_info_watch(void) {
+  watch_init(&host_info.netlink);
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  NETLINK_ROUTE);
+  struct sockaddr_nl sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.nl_family = AF_NETLINK;
+  sa.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+  if (fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+    fprintf(stderr, "could not watch the addresses: %s\n", strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+  watch_set(&host_info.netlink, fd, EPOLLIN);
+}
+
+static void host_info_dispatch(void) {
+  if (host_info.netlink.revents == 0) {
+    return;
+  }
+  char buf[4096];
+  while (recv(host_info.netlink.fd, buf, sizeof(buf), 0) > 0 ||
+         errno == ENOBUFS) {
+  }
+  host_info.addrs_valid = false;
+}
+
+static void host_info_unwatch(void) {
+  int fd = host_info.netlink.fd;
+  watch_del(&host_info.netlink);
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+// Expand %hostname%, %os%, %model% and %addrs% (and %% for a percent sign)
+// of an announce string, cut to what AOA carries.
+static void announce_expand(const char *template, char *buf, size_t len) {
+  size_t off = 0;
+  buf[0] = 0;
+  for (const char *p = template; *p != 0 && off < len - 1;) {
+    const char *value = NULL;
+    size_t skip = 0;
+    if (*p == '%') {
+      static const char *const names[] = {"hostname", "os", "model", "addrs",
+                                          ""};
+      for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        size_t n = strlen(names[i]);
+        if (strncmp(p + 1, names[i], n) == 0 && p[1 + n] == '%') {
+          host_info_update();
+          const char *values[] = {host_info.hostname, host_info.os,
+                                  host_info.model, host_info.addrs, "%"};
+          value = values[i];
+          skip = n + 2;
+          break;
+        }
+      }
+    }
+    if (value == NULL) {
+      buf[off++] = *p++;
+      buf[off] = 0;
+      continue;
+    }
+    off += snprintf(buf + off, len - off, "%s", value);
+    off = MIN(off, len - 1);
+    p += skip;
+  }
+}
+
+// Announcing is a chain of asynchronous control transfers, so any number of
+// devices are announced at the same time and an unresponsive one only holds
+// up itself: each step gives up after ANNOUNCE_TIMEOUT_MS.
+#define ANNOUNCE_TIMEOUT_MS 1000
+
+enum {
+  ANNOUNCE_PROTOCOL,  // ACCESSORY_GET_PROTOCOL
+  ANNOUNCE_STRING,    // ACCESSORY_SEND_STRING, one step per string
+  ANNOUNCE_AUDIO = ANNOUNCE_STRING + 6,
+  ANNOUNCE_START,
+  ANNOUNCE_DONE,
+};
+
+struct aoa_announce {
+  struct aoa_transport *transport;
+  struct arguments *arguments;
+  struct libusb_transfer *transfer;
+  unsigned char buffer[LIBUSB_CONTROL_SETUP_SIZE + 256];
+  int step;
+  uint16_t aoa_version;
+  bool done;
+  bool ok;            // the device was asked to start accessory mode
+  uint64_t started;   // CLOCK_MONOTONIC ns
+  char port[4 * PORT_NUMBERS_LEN + 4];
+  struct aoa_announce *next;
+};
+
+static uint64_t now_ns(void);
+
+static void aoa_announce_cb(struct libusb_transfer *transfer);
+
+// The step to take after a, skipping what does not apply to the device.
+static int aoa_announce_next(struct aoa_announce *a) {
+  struct arguments *arguments = a->arguments;
+  int step = a->step + 1;
+  if (step == ANNOUNCE_STRING && (arguments->manufacturer[0] == 0 ||
+                                  arguments->model[0] == 0)) {
+    step = ANNOUNCE_AUDIO;
+  }
+  if (step == ANNOUNCE_AUDIO && !(a->aoa_version == 2 && arguments->audio)) {
+    step = ANNOUNCE_START;
+  }
+  return step;
+}
+
+static int aoa_announce_submit(struct aoa_announce *a) {
+  // in the order of the AOA string indices
+  const char *strings[] = {
+      a->arguments->manufacturer, a->arguments->model,
+      a->arguments->description,  a->arguments->version,
+      a->arguments->url,          a->arguments->serial,
+  };
+  uint8_t out = LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT;
+  unsigned char *data = a->buffer + LIBUSB_CONTROL_SETUP_SIZE;
+
+  if (a->step == ANNOUNCE_PROTOCOL) {
+    libusb_fill_control_setup(a->buffer,
+                              LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_IN,
+                              51, 0, 0, 2);
+  } else if (a->step < ANNOUNCE_AUDIO) {
+    int index = a->step - ANNOUNCE_STRING;
+    announce_expand(strings[index], (char *)data, 256);
+    libusb_fill_control_setup(a->buffer, out, 52, 0, index,
+                              strlen((char *)data) + 1);
+  } else if (a->step == ANNOUNCE_AUDIO) {
+    libusb_fill_control_setup(a->buffer, out, 58, 1, 0, 0);
+  } else {
+    libusb_fill_control_setup(a->buffer, out, 53, 0, 0, 0);
+  }
+  libusb_fill_control_transfer(a->transfer, a->transport->device, a->buffer,
+                               aoa_announce_cb, a, ANNOUNCE_TIMEOUT_MS);
+  return a->transport->ops->submit(a->transport, a->transfer);
+}
+
+static void aoa_announce_cb(struct libusb_transfer *transfer) {
+  struct aoa_announce *a = transfer->user_data;
+  enum libusb_transfer_status status = transfer->status;
+
+  if (a->step == ANNOUNCE_START) {
+    // the device may be gone before it acknowledged, it re-enumerates
+    a->ok = status == LIBUSB_TRANSFER_COMPLETED ||
+            status == LIBUSB_TRANSFER_NO_DEVICE;
+    if (!a->ok) {
+      fprintf(stderr, "%s: error starting accessory mode: %s\n", a->port,
+              transfer_status_name(status));
+    }
+    a->done = true;
+    return;
+  }
+  if (status == LIBUSB_TRANSFER_CANCELLED) {
+    a->done = true;
+    return;
+  }
+  if (status != LIBUSB_TRANSFER_COMPLETED) {
+    if (a->step == ANNOUNCE_PROTOCOL && status == LIBUSB_TRANSFER_STALL) {
+      fprintf(stderr, "%s: device does not support AOA mode (control request "
+              "was not supported by the device)\n", a->port);
+    } else {
+      fprintf(stderr, "%s: error in announce step %d: %s\n", a->port, a->step,
+              transfer_status_name(status));
+    }
+    a->done = true;
+    return;
+  }
+  if (a->step == ANNOUNCE_PROTOCOL) {
+    unsigned char *data = libusb_control_transfer_get_data(transfer);
+    a->aoa_version = transfer->actual_length < 2 ? 0 : data[0] + (data[1] << 8);
+    if (a->aoa_version != 1 && a->aoa_version != 2) {
+      fprintf(stderr, "%s: device does not support AOA mode (version returned "
+              "should be in [1, 2], but is: %d)\n", a->port, a->aoa_version);
+      a->done = true;
+      return;
+    }
+    fprintf(stderr, "%s: device supports AOAv%d\n", a->port, a->aoa_version);
+  }
+
+  a->step = aoa_announce_next(a);
+  int r = aoa_announce_submit(a);
+  if (r != 0) {
+    fprintf(stderr, "%s: error in announce step %d: %s\n", a->port, a->step,
+            libusb_error_name(r));
+    a->done = true;
+  }
+}
+
+// Start announcing to transport, which stays open until aoa_announce_free.
+static struct aoa_announce *aoa_announce_start(struct aoa_transport *transport,
+                                               struct arguments *arguments) {
+  struct aoa_announce *a = calloc(1, sizeof(struct aoa_announce));
+  if (a == NULL) {
+    fprintf(stderr, "could not allocate the announce\n");
+    return NULL;
+  }
+  a->transfer = libusb_alloc_transfer(0);
+  if (a->transfer == NULL) {
+    fprintf(stderr, "could not allocate the announce transfer\n");
+    free(a);
+    return NULL;
+  }
+  a->transport = transport;
+  a->arguments = arguments;
+  a->started = now_ns();
+  snprintf(a->port, sizeof(a->port), "%s", transport->name);
+  a->step = ANNOUNCE_PROTOCOL;
+  int r = aoa_announce_submit(a);
+  if (r != 0) {
+    fprintf(stderr, "%s: error requesting the AOA version: %s\n", a->port,
+            libusb_error_name(r));
+    a->done = true;
+  }
+  return a;
+}
+
+static void aoa_announce_free(struct aoa_announce *a) {
+  libusb_free_transfer(a->transfer);
+  free(a);
+}
+
+// Announce to a single device and wait for the outcome.
+static void aoa_announce(struct aoa_transport *transport,
+                         struct arguments *arguments) {
+  struct aoa_announce *a = aoa_announce_start(transport, arguments);
+  if (a == NULL) {
+    return;
+  }
+  while (!a->done) {
+    struct timeval tv = {1, 0};
+    if (transport->ops->handle_events(transport, &tv) < 0) {
+      break;
+    }
+  }
+  if (a->ok) {
+    fprintf(stderr, "%s: announced in %.1f ms\n", a->port,
+            (now_ns() - a->started) / 1e6);
+  }
+  aoa_announce_free(a);
+}
+
+// Byte ring between one side of the link and the other. head and tail count
+// bytes ever written and consumed, so used space is simply head - tail.
+// Only the producer moves head and only the consumer tail, each after the
+// bytes it covers, so with --threads both sides work on a ring without a lock.
+struct ring {
+  uint8_t *data;
+  size_t size;  // power of two
+  size_t head;
+  size_t tail;
+};
+
+static int ring_init(struct ring *ring, size_t min_size) {
+  ring->size = 1;
+  while (ring->size < min_size) {
+    ring->size <<= 1;
+  }
+  ring->head = 0;
+  ring->tail = 0;
+  ring->data = malloc(ring->size);
+  return ring->data == NULL ? -1 : 0;
+}
+
+static size_t ring_head(const struct ring *ring) {
+  return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+static size_t ring_used(const struct ring *ring) {
+  return ring_head(ring) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+static size_t ring_free(const struct ring *ring) {
+  return ring->size - ring_used(ring);
+}
+
+// contiguous data starting at pos (tail <= pos <= head)
+static uint8_t *ring_peek(const struct ring *ring, size_t pos, size_t *len) {
+  size_t offset = pos & (ring->size - 1);
+  *len = MIN(ring_head(ring) - pos, ring->size - offset);
+  return ring->data + offset;
+}
+
+// contiguous free space at head
+static uint8_t *ring_reserve(const struct ring *ring, size_t *len) {
+  size_t offset = ring->head & (ring->size - 1);
+  *len = MIN(ring_free(ring), ring->size - offset);
+  return ring->data + offset;
+}
+
+// copy len bytes at pos out of the ring, without consuming them
+static void ring_copy_out(const struct ring *ring, size_t pos, void *data,
+                          size_t len) {
+  uint8_t *dst = data;
+  while (len > 0) {
+    size_t offset = pos & (ring->size - 1);
+    size_t chunk = MIN(len, ring->size - offset);
+    memcpy(dst, ring->data + offset, chunk);
+    pos += chunk;
+    dst += chunk;
+    len -= chunk;
+  }
+}
+
+// copy len bytes into the ring at pos, without moving head
+static void ring_copy_in(struct ring *ring, size_t pos, const void *data,
+                         size_t len) {
+  const uint8_t *src = data;
+  while (len > 0) {
+    size_t offset = pos & (ring->size - 1);
+    size_t chunk = MIN(len, ring->size - offset);
+    memcpy(ring->data + offset, src, chunk);
+    pos += chunk;
+    src += chunk;
+    len -= chunk;
+  }
+}
+
+// hand len bytes written at head to the consumer
+static void ring_produce(struct ring *ring, size_t len) {
+  __atomic_store_n(&ring->head, ring->head + len, __ATOMIC_RELEASE);
+}
+
+// hand len bytes read at tail back to the producer
+static void ring_consume(struct ring *ring, size_t len) {
+  __atomic_store_n(&ring->tail, ring->tail + len, __ATOMIC_RELEASE);
+}
+
+static void ring_write(struct ring *ring, const void *data, size_t len) {
+  ring_copy_in(ring, ring->head, data, len);
+  ring_produce(ring, len);
+}
+
+struct aoa_link;
+
+struct aoa_xfer {
+  struct libusb_transfer *transfer;
+  struct aoa_link *link;
+  bool busy;
+  uint64_t submitted;  // ns, only kept for --capture
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// --capture: every bulk transfer of the forwarding path is appended to a ring
+// in a shared mapping of FILE, so recording costs a memcpy of up to snaplen
+// bytes and no system call. Once the ring is full, the oldest records are
+// overwritten. The file outlives a crash and is turned into pcapng by
+// --capture-export or fed to the device again by --capture-replay.
+//
+// The file starts with a header page, the ring follows. Records are 8 byte
+// aligned and never wrap, the rest of the ring is skipped with a padding
+// record (endpoint 0) instead. head and tail are positions that only grow,
+// modulo 2^32, there is a single writer per process: whoever handles the
+// transfers. They are 32 bits wide, so that also on 32-bit targets they are
+// lock-free atomics, which libatomic's per-process locks would not be for
+// the readers in other processes.
+#define CAPTURE_MAGIC "AOACAP2"
+#define CAPTURE_HEADER_SIZE 4096
+#define CAPTURE_DEFAULT_SIZE (16 * 1024 * 1024)
+#define CAPTURE_DEFAULT_SNAPLEN 256
+
+struct capture_header {
+  char magic[8];
+  uint64_t size;             // of the ring, a power of 2
+  uint32_t head, tail;
+  int64_t realtime_offset;   // CLOCK_REALTIME - CLOCK_MONOTONIC, ns
+  uint32_t snaplen;
+};
+
+struct capture_record {
+  uint32_t size;      // of the record, payload and alignment included
+  uint8_t endpoint;   // 0x81 IN, 0x01 OUT, 0: padding
+  uint8_t status;     // enum libusb_transfer_status
+  uint16_t reserved;
+  uint64_t submitted, completed;  // CLOCK_MONOTONIC, ns
+  uint32_t length;    // bytes transferred
+  uint32_t captured;  // of them following the record
+};
+
+struct capture {
+  struct capture_header *header;
+  uint8_t *data;
+};
+
+// --capture, NULL: off
+static struct capture *capture_ring;
+
+static struct capture *capture_map(int fd, uint64_t size, bool writable) {
+  int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+  // MAP_POPULATE: no page faults in the transfer callbacks
+  void *p = mmap(NULL, CAPTURE_HEADER_SIZE + size, prot,
+                 MAP_SHARED | (writable ? MAP_POPULATE : 0), fd, 0);
+  if (p == MAP_FAILED) {
+    return NULL;
+  }
+  struct capture *c = malloc(sizeof(*c));
+  if (c == NULL) {
+    munmap(p, CAPTURE_HEADER_SIZE + size);
+    return NULL;
+  }
+  c->header = p;
+  c->data = (uint8_t *)p + CAPTURE_HEADER_SIZE;
+  return c;
+}
+
+static struct capture *capture_create(const char *path, uint64_t min_size,
+                                      uint32_t snaplen) {
+  uint64_t size = 1;
+  while (size < min_size) {
+    size <<= 1;
+  }
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "could not open %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  // allocated up front, so that a full disk does not SIGBUS a callback
+  int r = posix_fallocate(fd, 0, CAPTURE_HEADER_SIZE + size);
+  if (r != 0) {
+    fprintf(stderr, "could not allocate %s: %s\n", path, strerror(r));
+    close(fd);
+    return NULL;
+  }
+  struct capture *c = capture_map(fd, size, true);
+  if (c == NULL) {
+    fprintf(stderr, "could not map %s: %s\n", path, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  close(fd);
+
+  struct timespec real;
+  clock_gettime(CLOCK_REALTIME, &real);
+  uint64_t mono = now_ns();
+  memcpy(c->header->magic, CAPTURE_MAGIC, sizeof(c->header->magic));
+  c->header->size = size;
+  c->header->head = 0;
+  c->header->tail = 0;
+  c->header->realtime_offset =
+      (int64_t)real.tv_sec * 1000000000 + real.tv_nsec - (int64_t)mono;
+  c->header->snaplen = snaplen;
+  return c;
+}
+
+static struct capture *capture_open(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "could not open %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  struct capture_header header;
+  struct stat st;
+  if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+      memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0 ||
+      fstat(fd, &st) != 0 || header.size < 8 ||
+      header.size > CAPTURE_MAX_SIZE ||
+      (header.size & (header.size - 1)) != 0 ||
+      (uint64_t)st.st_size != CAPTURE_HEADER_SIZE + header.size) {
+    fprintf(stderr, "%s is not a capture\n", path);
+    close(fd);
+    return NULL;
+  }
+  struct capture *c = capture_map(fd, header.size, false);
+  if (c == NULL) {
+    fprintf(stderr, "could not map %s: %s\n", path, strerror(errno));
+  }
+  close(fd);
+  return c;
+}
+
+static void capture_close(struct capture *c) {
+  munmap(c->header, CAPTURE_HEADER_SIZE + c->header->size);
+  free(c);
+}
+
+// Forget the oldest records until len bytes from head on are free.
+static void capture_reserve(struct capture *c, uint32_t head, uint32_t len) {
+  struct capture_header *h = c->header;
+  uint32_t tail = h->tail;
+  while ((uint32_t)(head + len - tail) > h->size) {
+    tail += ((struct capture_record *)(c->data + (tail & (h->size - 1))))->size;
+  }
+  // readers check the tail again after copying a record
+  __atomic_store_n(&h->tail, tail, __ATOMIC_RELEASE);
+}
+
+static void capture_append(struct capture *c, uint8_t endpoint,
+                           uint8_t status, uint64_t submitted,
+                           const uint8_t *data, uint32_t length) {
+  struct capture_header *h = c->header;
+  uint32_t captured = MIN(length, h->snaplen);
+  uint32_t size = (sizeof(struct capture_record) + captured + 7) & ~7u;
+  uint32_t head = h->head;
+  uint32_t offset = head & (h->size - 1);
+  if (h->size - offset < size) {
+    capture_reserve(c, head, h->size - offset);
+    struct capture_record *pad = (struct capture_record *)(c->data + offset);
+    pad->size = h->size - offset;
+    pad->endpoint = 0;
+    head += h->size - offset;
+    offset = 0;
+  }
+  capture_reserve(c, head, size);
+  struct capture_record *r = (struct capture_record *)(c->data + offset);
+  r->size = size;
+  r->endpoint = endpoint;
+  r->status = status;
+  r->reserved = 0;
+  r->submitted = submitted;
+  r->completed = now_ns();
+  r->length = length;
+  r->captured = captured;
+  memcpy(r + 1, data, captured);
+  __atomic_store_n(&h->head, head + size, __ATOMIC_RELEASE);
+}
+
+// Calls fn for each complete record from the oldest on, skipping those the
+// writer overwrote meanwhile. Returns the number of records passed to fn.
+static uint64_t capture_walk(struct capture *c,
+                             void (*fn)(const struct capture_record *, void *),
+                             void *opaque) {
+  struct capture_header *h = c->header;
+  uint32_t head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+  uint32_t pos = __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE);
+  uint32_t offset;
+  uint64_t count = 0;
+  uint8_t *copy = malloc(sizeof(struct capture_record) + h->snaplen + 8);
+  if (copy == NULL) {
+    return 0;
+  }
+  // positions wrap, they are compared by their distance
+  while ((int32_t)(head - pos) > 0) {
+    offset = pos & (h->size - 1);
+    const struct capture_record *r =
+        (const struct capture_record *)(c->data + offset);
+    uint32_t size = r->size;
+    uint8_t endpoint = r->endpoint;
+    uint32_t tail;
+    if (size < 8 || size % 8 != 0 || size > h->size - offset ||
+        (endpoint != 0 && (size < sizeof(*r) ||
+                           size > sizeof(*r) + h->snaplen + 7))) {
+      tail = __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE);
+      if ((int32_t)(tail - pos) > 0) {
+        pos = tail;
+        continue;
+      }
+      fprintf(stderr, "capture is corrupt at %" PRIu32 "\n", pos);
+      break;
+    }
+    if (endpoint != 0) {
+      memcpy(copy, r, size);
+    }
+    // still there after copying it?
+    tail = __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE);
+    if ((int32_t)(tail - pos) > 0) {
+      pos = tail;
+      continue;
+    }
+    if (endpoint != 0) {
+      fn((const struct capture_record *)copy, opaque);
+      count++;
+    }
+    pos += size;
+  }
+  free(copy);
+  return count;
+}
+
+// Counters of a link, dumped on SIGUSR1 and served by --metrics. Each one is
+// only written by one side of the link, but with --threads the USB thread
+// updates those of the transfers while the loop reads them. Relaxed atomics
+// keep the 64-bit values from tearing on 32-bit targets, where they are
+// libatomic calls (see the Makefile).
+#define STAT_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define STAT_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#define STAT_PEAK(peak, value)                                  \
+  do {                                                          \
+    size_t value_ = (value);                                    \
+    if (value_ > STAT_GET(peak)) {                              \
+      __atomic_store_n(&(peak), value_, __ATOMIC_RELAXED);      \
+    }                                                           \
+  } while (0)
+
+struct aoa_stats {
+  uint64_t in_bytes, out_bytes;          // from / to the device
+  uint64_t in_transfers, out_transfers;  // completed
+  uint64_t errors[TRANSFER_STATUS_MAX];  // failed transfers by status
+  uint64_t in_pauses;   // from_aoa ran full, reading from the device stopped
+  uint64_t out_pauses;  // to_aoa ran full, reading from fd_in stopped
+  uint64_t out_reads;   // reads from fd_in into to_aoa, per transfer coalesced
+  uint64_t blocked_ns;  // fd_out could not take everything
+  size_t from_aoa_peak, to_aoa_peak;
+};
+
+struct aoa_link {
+  struct aoa_transport *transport;
+  int num_transfers;
+  size_t buffer_size;
+  struct aoa_xfer *in;   // AOA -> from_aoa ring
+  struct aoa_xfer *out;  // to_aoa ring -> AOA, zero copy out of the ring
+  int in_busy;           // IN transfers currently submitted
+  int out_idle;          // OUT transfers not currently submitted
+  struct ring from_aoa;
+  struct ring to_aoa;
+  size_t to_aoa_submitted;  // to_aoa position handed to OUT transfers so far
+  size_t low_watermark;     // paused side resumes once the ring drains to this
+  uint64_t coalesce_ns;     // --coalesce-delay, 0: off
+  size_t coalesce_size;
+  uint64_t coalesce_deadline;  // ns, when held back data is sent, 0: none
+  bool in_paused;           // from_aoa was full, stop reading from the device
+  bool fd_in_paused;        // to_aoa was full, stop reading from fd_in
+  bool received;            // anything arrived from the device yet
+  bool failed;
+  struct aoa_stats stats;
+  // --threads: the transfers are handled by usb_thread, which pumps when the
+  // other side asks for it and tells it about completions through wake_fd
+  bool threaded;
+  pthread_t usb_thread;
+  bool stop;
+  bool pump_requested;
+  bool completed;  // since wake_fd was last written
+  int wake_fd;
+  // --keepalive: GET_STATUS, submitted by whoever handles the transfers
+  struct libusb_transfer *probe;
+  unsigned char probe_buffer[LIBUSB_CONTROL_SETUP_SIZE + 2];
+  bool probing;          // requested and not yet seen done by the session
+  bool probe_requested;  // for the USB thread
+  bool probe_done;
+  enum libusb_transfer_status probe_status;
+  struct capture *capture;  // --capture, NULL: off
+};
+
+static int aoa_link_submit(struct aoa_xfer *xfer) {
+  struct aoa_transport *transport = xfer->link->transport;
+  if (xfer->link->capture != NULL) {
+    xfer->submitted = now_ns();
+  }
+  int r = transport->ops->submit(transport, xfer->transfer);
+  if (r != 0) {
+    fprintf(stderr, "error submitting transfer: %s\n", libusb_error_name(r));
+    __atomic_store_n(&xfer->link->failed, true, __ATOMIC_RELAXED);
+    xfer->link->completed = true;
+    return r;
+  }
+  xfer->busy = true;
+  return 0;
+}
+
+// Keep as many transfers in flight as the rings allow. IN transfers are only
+// submitted while from_aoa can take a full buffer for each of them, so their
+// completions never have to wait for the other side.
+static void aoa_link_pump(struct aoa_link *link) {
+  if (link->failed) {
+    return;
+  }
+
+  if (link->in_paused && ring_used(&link->from_aoa) <= link->low_watermark) {
+    __atomic_store_n(&link->in_paused, false, __ATOMIC_RELAXED);
+  }
+  for (int i = 0; i < link->num_transfers && !link->in_paused; i++) {
+    if (link->in[i].busy) {
+      continue;
+    }
+    if (ring_free(&link->from_aoa) < (link->in_busy + 1) * link->buffer_size) {
+      __atomic_store_n(&link->in_paused, true, __ATOMIC_RELAXED);
+      if (link->threaded) {
+        // pairs with aoa_link_kick: either the other side sees in_paused, or
+        // the room it made in from_aoa meanwhile is seen here
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (ring_used(&link->from_aoa) <= link->low_watermark) {
+          __atomic_store_n(&link->in_paused, false, __ATOMIC_RELAXED);
+          // without transfers in flight no completion pumps again
+          if (link->in_busy == 0) {
+            __atomic_store_n(&link->pump_requested, true, __ATOMIC_RELAXED);
+          }
+          break;
+        }
+      }
+      STAT_ADD(link->stats.in_pauses, 1);
+      break;
+    }
+    if (aoa_link_submit(&link->in[i]) != 0) {
+      return;
+    }
+    link->in_busy++;
+  }
+
+  // --coalesce-delay: like Nagle's algorithm, small data waits while OUT
+  // transfers are in flight, until enough joined it or the delay is over
+  size_t pending = ring_head(&link->to_aoa) - link->to_aoa_submitted;
+  if (link->coalesce_ns != 0 && pending > 0 &&
+      pending < link->coalesce_size &&
+      link->out_idle < link->num_transfers) {
+    uint64_t now = now_ns();
+    if (link->coalesce_deadline == 0) {
+      link->coalesce_deadline = now + link->coalesce_ns;
+    }
+    if (now < link->coalesce_deadline) {
+      return;
+    }
+  }
+  link->coalesce_deadline = 0;
+
+  for (int i = 0; i < link->num_transfers && link->out_idle > 0; i++) {
+    if (ring_head(&link->to_aoa) == link->to_aoa_submitted) {
+      break;
+    }
+    if (link->out[i].busy) {
+      continue;
+    }
+    size_t len;
+    uint8_t *p = ring_peek(&link->to_aoa, link->to_aoa_submitted, &len);
+    len = MIN(len, link->buffer_size);
+    link->out[i].transfer->buffer = p;
+    link->out[i].transfer->length = len;
+    if (aoa_link_submit(&link->out[i]) != 0) {
+      return;
+    }
+    link->out_idle--;
+    link->to_aoa_submitted += len;
+  }
+}
+
+static void stdin_to_aoa_cb(struct libusb_transfer *transfer) {
+  struct aoa_xfer *xfer = transfer->user_data;
+  struct aoa_link *link = xfer->link;
+  xfer->busy = false;
+  link->out_idle++;
+  link->completed = true;
+  if (link->capture != NULL) {
+    capture_append(link->capture, 0x01, transfer->status, xfer->submitted,
+                   transfer->buffer, transfer->actual_length);
+  }
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+    if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+      fprintf(stderr, "transfer->status = %s\n",
+              transfer_status_name(transfer->status));
+      if (transfer->status < TRANSFER_STATUS_MAX) {
+        STAT_ADD(link->stats.errors[transfer->status], 1);
+      }
+    }
+    __atomic_store_n(&link->failed, true, __ATOMIC_RELAXED);
+    return;
+  }
+  // OUT transfers complete in submission order
+  ring_consume(&link->to_aoa, transfer->length);
+  STAT_ADD(link->stats.out_transfers, 1);
+  STAT_ADD(link->stats.out_bytes, transfer->length);
+  aoa_link_pump(link);
+}
+static void aoa_to_stdout_cb(struct libusb_transfer *transfer) {
+  struct aoa_xfer *xfer = transfer->user_data;
+  struct aoa_link *link = xfer->link;
+  xfer->busy = false;
+  link->in_busy--;
+  link->completed = true;
+  if (link->capture != NULL) {
+    capture_append(link->capture, 0x81, transfer->status, xfer->submitted,
+                   transfer->buffer, transfer->actual_length);
+  }
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+    if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+      fprintf(stderr, "transfer->status = %s\n",
+              transfer_status_name(transfer->status));
+      if (transfer->status < TRANSFER_STATUS_MAX) {
+        STAT_ADD(link->stats.errors[transfer->status], 1);
+      }
+    }
+    __atomic_store_n(&link->failed, true, __ATOMIC_RELAXED);
+    return;
+  }
+  ring_write(&link->from_aoa, transfer->buffer, transfer->actual_length);
+  __atomic_store_n(&link->received, true, __ATOMIC_RELAXED);
+  STAT_ADD(link->stats.in_transfers, 1);
+  STAT_ADD(link->stats.in_bytes, transfer->actual_length);
+  STAT_PEAK(link->stats.from_aoa_peak, ring_used(&link->from_aoa));
+  aoa_link_pump(link);
+}
+
+#define KEEPALIVE_TIMEOUT_MS 1000
+
+static void aoa_link_probe_cb(struct libusb_transfer *transfer) {
+  struct aoa_link *link = transfer->user_data;
+  link->probe_status = transfer->status;
+  link->completed = true;
+  __atomic_store_n(&link->probe_done, true, __ATOMIC_RELEASE);
+}
+
+static void aoa_link_submit_probe(struct aoa_link *link) {
+  libusb_fill_control_setup(link->probe_buffer,
+                            LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD |
+                                LIBUSB_RECIPIENT_DEVICE,
+                            LIBUSB_REQUEST_GET_STATUS, 0, 0, 2);
+  libusb_fill_control_transfer(link->probe, link->transport->device,
+                               link->probe_buffer, aoa_link_probe_cb, link,
+                               KEEPALIVE_TIMEOUT_MS);
+  if (link->transport->ops->submit(link->transport, link->probe) != 0) {
+    link->probe_status = LIBUSB_TRANSFER_ERROR;
+    link->completed = true;
+    __atomic_store_n(&link->probe_done, true, __ATOMIC_RELEASE);
+  }
+}
+
+// Check that the device still answers, the session sees the outcome in
+// probe_done.
+static void aoa_link_probe(struct aoa_link *link) {
+  link->probing = true;
+  if (!link->threaded) {
+    aoa_link_submit_probe(link);
+    return;
+  }
+  __atomic_store_n(&link->probe_requested, true, __ATOMIC_RELEASE);
+  link->transport->ops->interrupt(link->transport);
+}
+
+// --threads: handle the transfers until aoa_link_free stops it. Completions
+// are batched into one write to wake_fd per round.
+static void *aoa_link_thread(void *arg) {
+  struct aoa_link *link = arg;
+  struct aoa_transport *transport = link->transport;
+  while (!__atomic_load_n(&link->stop, __ATOMIC_ACQUIRE)) {
+    if (__atomic_exchange_n(&link->pump_requested, false, __ATOMIC_ACQUIRE) ||
+        link->coalesce_deadline != 0) {
+      aoa_link_pump(link);
+    }
+    if (__atomic_exchange_n(&link->probe_requested, false, __ATOMIC_ACQUIRE)) {
+      aoa_link_submit_probe(link);
+    }
+    if (link->completed) {
+      link->completed = false;
+      eventfd_write(link->wake_fd, 1);
+    }
+    if (__atomic_load_n(&link->pump_requested, __ATOMIC_RELAXED)) {
+      continue;
+    }
+    struct timeval tv = {1, 0};
+    if (link->coalesce_deadline != 0) {
+      uint64_t now = now_ns();
+      uint64_t wait = link->coalesce_deadline > now
+                          ? link->coalesce_deadline - now
+                          : 0;
+      tv.tv_sec = 0;
+      tv.tv_usec = (wait + 999) / 1000;
+    }
+    int r = transport->ops->handle_events(transport, &tv);
+    if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+      fprintf(stderr, "error handling USB events: %s\n", libusb_error_name(r));
+      __atomic_store_n(&link->failed, true, __ATOMIC_RELAXED);
+      eventfd_write(link->wake_fd, 1);
+      break;
+    }
+  }
+  return NULL;
+}
+
+static int aoa_link_start_thread(struct aoa_link *link) {
+  link->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (link->wake_fd < 0) {
+    fprintf(stderr, "could not create an eventfd: %s\n", strerror(errno));
+    return LIBUSB_ERROR_OTHER;
+  }
+  loop_release_usb();
+  link->threaded = true;
+  int r = pthread_create(&link->usb_thread, NULL, aoa_link_thread, link);
+  if (r != 0) {
+    fprintf(stderr, "could not start the USB thread: %s\n", strerror(r));
+    link->threaded = false;
+    close(link->wake_fd);
+    link->wake_fd = -1;
+    return LIBUSB_ERROR_OTHER;
+  }
+  return 0;
+}
+
+// The other side produced into to_aoa or consumed from from_aoa. Pump right
+// away, or with --threads have the USB thread do it, unless it is not waiting
+// for anything.
+static void aoa_link_kick(struct aoa_link *link, bool produced) {
+  if (!link->threaded) {
+    aoa_link_pump(link);
+    return;
+  }
+  if (!produced) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&link->in_paused, __ATOMIC_RELAXED) ||
+        ring_used(&link->from_aoa) > link->low_watermark) {
+      return;
+    }
+  }
+  __atomic_store_n(&link->pump_requested, true, __ATOMIC_RELEASE);
+  link->transport->ops->interrupt(link->transport);
+}
+
+static void aoa_link_init(struct aoa_link *link,
+                          struct aoa_transport *transport,
+                          struct arguments *arguments) {
+  uint16_t max_packet_size = transport->max_packet_size;
+  memset(link, 0, sizeof(*link));
+  link->transport = transport;
+  link->wake_fd = -1;
+  link->num_transfers = arguments->transfers;
+  // IN transfers larger than one packet end early on a short packet, so a
+  // multiple of the packet size loses nothing and saves completions.
+  link->buffer_size = arguments->buffer_size + max_packet_size - 1;
+  link->buffer_size -= link->buffer_size % max_packet_size;
+  link->in = calloc(link->num_transfers, sizeof(struct aoa_xfer));
+  link->out = calloc(link->num_transfers, sizeof(struct aoa_xfer));
+  // twice what can be in flight, so the device keeps going while the other
+  // side drains the first half
+  size_t ring_size = 2 * link->num_transfers * link->buffer_size;
+  if (arguments->mux) {
+    // room for a partial frame plus a complete one
+    ring_size = MAX(ring_size, 2 * (MUX_HEADER_SIZE + MUX_MAX_PAYLOAD));
+  }
+  if (link->in == NULL || link->out == NULL ||
+      ring_init(&link->from_aoa, ring_size) != 0 ||
+      ring_init(&link->to_aoa, ring_size) != 0) {
+    fprintf(stderr, "could not allocate transfers\n");
+    libusb_exit(NULL);
+    exit(EXIT_FAILURE);
+  }
+  link->low_watermark = link->from_aoa.size / 2;
+  link->coalesce_ns = arguments->coalesce_delay * 1000ull;
+  link->capture = capture_ring;
+  link->coalesce_size = arguments->coalesce_size == 0
+                            ? link->buffer_size
+                            : MIN(arguments->coalesce_size, link->buffer_size);
+
+  for (int i = 0; i < link->num_transfers; i++) {
+    link->in[i].link = link;
+    link->in[i].transfer = libusb_alloc_transfer(0);
+    link->out[i].link = link;
+    link->out[i].transfer = libusb_alloc_transfer(0);
+    uint8_t *buffer = malloc(link->buffer_size);
+    if (link->in[i].transfer == NULL || link->out[i].transfer == NULL ||
+        buffer == NULL) {
+      fprintf(stderr, "could not allocate transfers\n");
+      libusb_exit(NULL);
+      exit(EXIT_FAILURE);
+    }
+    libusb_fill_bulk_transfer(link->in[i].transfer, transport->device, 0x81, buffer,
+                              link->buffer_size, aoa_to_stdout_cb,
+                              &link->in[i], 0);
+    // buffer and length are set on submission, pointing into to_aoa
+    libusb_fill_bulk_transfer(link->out[i].transfer, transport->device, 0x1,
+                              NULL, 0,
+                              stdin_to_aoa_cb, &link->out[i], 0);
+    // a transfer that ends on a packet boundary would otherwise not complete
+    // a larger read on the Android side
+    link->out[i].transfer->flags = LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+  }
+  link->out_idle = link->num_transfers;
+  link->probe = libusb_alloc_transfer(0);
+  if (link->probe == NULL) {
+    fprintf(stderr, "could not allocate transfers\n");
+    libusb_exit(NULL);
+    exit(EXIT_FAILURE);
+  }
+}
+
+#define LINK_CANCEL_TIMEOUT_MS 5000
+
+static void aoa_link_free(struct aoa_link *link) {
+  // cancel everything still in flight and wait for the callbacks before the
+  // buffers go away
+  struct aoa_transport *transport = link->transport;
+  if (link->threaded) {
+    __atomic_store_n(&link->stop, true, __ATOMIC_RELEASE);
+    transport->ops->interrupt(transport);
+    pthread_join(link->usb_thread, NULL);
+    close(link->wake_fd);
+  }
+  link->failed = true;
+  for (int i = 0; i < link->num_transfers; i++) {
+    if (link->in[i].busy) {
+      transport->ops->cancel(transport, link->in[i].transfer);
+    }
+    if (link->out[i].busy) {
+      transport->ops->cancel(transport, link->out[i].transfer);
+    }
+  }
+  bool probe_busy = link->probing && !link->probe_done;
+  if (probe_busy) {
+    transport->ops->cancel(transport, link->probe);
+  }
+  // a device that does not even complete cancellations is not waited for
+  // forever, its buffers are leaked instead
+  uint64_t deadline = now_ns() + LINK_CANCEL_TIMEOUT_MS * 1000000ull;
+  bool busy = true;
+  while (busy) {
+    busy = probe_busy && !link->probe_done;
+    for (int i = 0; i < link->num_transfers; i++) {
+      busy |= link->in[i].busy || link->out[i].busy;
+    }
+    if (!busy) {
+      break;
+    }
+    struct timeval tv = {1, 0};
+    if (now_ns() > deadline ||
+        transport->ops->handle_events(transport, &tv) < 0) {
+      fprintf(stderr, "transfers did not finish cancelling, leaking them\n");
+      return;
+    }
+  }
+  libusb_free_transfer(link->probe);
+  for (int i = 0; i < link->num_transfers; i++) {
+    free(link->in[i].transfer->buffer);
+    libusb_free_transfer(link->in[i].transfer);
+    libusb_free_transfer(link->out[i].transfer);
+  }
+  free(link->in);
+  free(link->out);
+  free(link->from_aoa.data);
+  free(link->to_aoa.data);
+}
+
+struct mux;
+
+// A forwarding session between one AOA device and its fd_in/fd_out.
+struct aoa_session {
+  struct aoa_transport *transport;
+  struct arguments *arguments;
+  struct aoa_link link;
+  int fd_in;
+  int fd_out;
+  bool fd_in_eof;
+  struct watch watch_in, watch_out;  // watch_in only if fd_in == fd_out
+  struct watch watch_wake;           // the link's wake_fd with --threads
+  struct uring_engine *uring;        // --io-uring, instead of the watches
+  bool out_blocked;         // fd_out took less than offered, wait for EPOLLOUT
+  bool marker_pending;      // --reconnect MARKER did not fit into to_aoa yet
+  uint64_t reconnect_at;    // ns, no attempt to connect the backend before
+  unsigned reconnect_delay_ms;  // backoff after failed attempts
+  bool connecting;          // fd_out is not connected yet
+  const char *connect_port; // the backend it connects to
+  size_t connect_index;     // its address tried next, see connect_backend_start
+  int listen_fd;            // --listen, clients become the backend in turn
+  struct watch watch_listen;
+  struct mux *mux;          // with --mux instead of fd_in/fd_out
+  bool done;
+  char name[4 * PORT_NUMBERS_LEN + 4];  // in stats, the port if known
+  double started;                       // CLOCK_MONOTONIC seconds
+  uint64_t blocked_since;               // ns, fd_out took less than offered
+  // --idle-timeout, --stall-timeout and --keepalive: transfers counted at
+  // the last change and when that was seen, in ns
+  uint64_t live_transfers, live_since;
+  uint64_t stall_transfers, stall_since;
+  uint64_t probed_at;  // the device last answered --keepalive
+  struct aoa_session *next;
+};
+
+// Backends are given as PORT or HOST:PORT for tcp, by default on
+// localhost, or as unix:PATH for a unix socket, with a leading @ in the
+// abstract namespace.
+static int unix_address(const char *spec, struct sockaddr_un *addr,
+                        socklen_t *len) {
+  const char *path = spec + strlen("unix:");
+  size_t path_len = strlen(path);
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (path_len == 0 || path_len >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "invalid unix socket path: %s\n", spec);
+    return -1;
+  }
+  memcpy(addr->sun_path, path, path_len);
+  if (path[0] == '@') {
+    addr->sun_path[0] = '\0';
+  }
+  *len = offsetof(struct sockaddr_un, sun_path) + path_len +
+         (path[0] != '@');
+  return 0;
+}
+
+// Resolved tcp backends, so that every new session connects right away
+// instead of looking the host up again.
+struct backend_cache {
+  char *spec;
+  struct addrinfo *result;
+  struct backend_cache *next;
+};
+static struct backend_cache *backend_cache;
+
+static struct addrinfo *resolve_backend(const char *spec, int flags) {
+  for (struct backend_cache *c = backend_cache; c != NULL; c = c->next) {
+    if (strcmp(c->spec, spec) == 0) {
+      return c->result;
+    }
+  }
+
+  char host[256] = "localhost";
+  const char *port = spec;
+  const char *colon = strrchr(spec, ':');
+  if (colon != NULL) {
+    // HOST:PORT, [V6ADDRESS]:PORT
+    size_t len = colon - spec;
+    if (len >= 2 && spec[0] == '[' && spec[len - 1] == ']') {
+      spec++;
+      len -= 2;
+    }
+    if (len == 0 || len >= sizeof(host)) {
+      fprintf(stderr, "invalid backend: %s\n", port);
+      return NULL;
+    }
+    memcpy(host, spec, len);
+    host[len] = '\0';
+    spec = port;
+    port = colon + 1;
+  }
+
+  struct addrinfo hints;
+  struct addrinfo *result;
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = flags;
+  int s = getaddrinfo(host, port, &hints, &result);
+  if (s != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
+    return NULL;
+  }
+
+  struct backend_cache *c = calloc(1, sizeof(struct backend_cache));
+  if (c == NULL || (c->spec = strdup(spec)) == NULL) {
+    free(c);
+    freeaddrinfo(result);
+    return NULL;
+  }
+  c->result = result;
+  c->next = backend_cache;
+  backend_cache = c;
+  return result;
+}
+
+// Forget how spec resolved, e.g. because nothing answered there anymore.
+static void forget_backend(const char *spec) {
+  for (struct backend_cache **c = &backend_cache; *c != NULL;
+       c = &(*c)->next) {
+    if (strcmp((*c)->spec, spec) == 0) {
+      struct backend_cache *gone = *c;
+      *c = gone->next;
+      freeaddrinfo(gone->result);
+      free(gone->spec);
+      free(gone);
+      return;
+    }
+  }
+}
+
+static int connect_backend(const char *port) {
+  struct addrinfo *result, *rp;
+  int sfd;
+
+  if (strncmp(port, "unix:", 5) == 0) {
+    struct sockaddr_un addr;
+    socklen_t len;
+    if (unix_address(port, &addr, &len) != 0) {
+      return -1;
+    }
+    sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sfd == -1 || connect(sfd, (struct sockaddr *)&addr, len) != 0) {
+      fprintf(stderr, "Could not connect to %s: %s\n", port, strerror(errno));
+      if (sfd != -1) {
+        close(sfd);
+      }
+      return -1;
+    }
+    fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL) | O_NONBLOCK);
+    return sfd;
+  }
+
+  result = resolve_backend(port, 0);
+  if (result == NULL) {
+    return -1;
+  }
+
+  for (rp = result; rp != NULL; rp = rp->ai_next) {
+    sfd = socket(rp->ai_family, rp->ai_socktype | SOCK_CLOEXEC,
+                 rp->ai_protocol);
+
+    if (sfd == -1)
+      continue;
+    if (connect(sfd, rp->ai_addr, rp->ai_addrlen) != -1)
+      break;  // Success
+
+    close(sfd);
+  }
+  if (rp == NULL) {
+    fprintf(stderr, "Could not connect\n");
+    forget_backend(port);
+    return -1;
+  }
+
+  fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL) | O_NONBLOCK);
+  return sfd;
+}
+
+// Start connecting to port without waiting for it, with its addresses from
+// *index on. Returns the socket, with *in_progress while the connection is
+// not up yet, or -1 once none of the addresses is left.
+static int connect_backend_start(const char *port, size_t *index,
+                                 bool *in_progress) {
+  *in_progress = false;
+  if (strncmp(port, "unix:", 5) == 0) {
+    // a unix socket connects right away or not at all
+    return (*index)++ == 0 ? connect_backend(port) : -1;
+  }
+
+  struct addrinfo *rp = resolve_backend(port, 0);
+  for (size_t i = 0; rp != NULL && i < *index; i++) {
+    rp = rp->ai_next;
+  }
+  for (; rp != NULL; rp = rp->ai_next) {
+    (*index)++;
+    int sfd = socket(rp->ai_family,
+                     rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     rp->ai_protocol);
+    if (sfd == -1) {
+      continue;
+    }
+    if (connect(sfd, rp->ai_addr, rp->ai_addrlen) == 0) {
+      return sfd;
+    }
+    if (errno == EINPROGRESS) {
+      *in_progress = true;
+      return sfd;
+    }
+    close(sfd);
+  }
+  fprintf(stderr, "Could not connect to %s\n", port);
+  forget_backend(port);
+  return -1;
+}
+
+static int listen_local(const char *port) {
+  struct addrinfo hints;
+  struct addrinfo *result, *rp;
+  int s, sfd;
+
+  if (strncmp(port, "unix:", 5) == 0) {
+    struct sockaddr_un addr;
+    socklen_t len;
+    struct stat st;
+    if (unix_address(port, &addr, &len) != 0) {
+      return -1;
+    }
+    // left behind by an earlier run
+    if (addr.sun_path[0] != '\0' && stat(addr.sun_path, &st) == 0 &&
+        S_ISSOCK(st.st_mode)) {
+      unlink(addr.sun_path);
+    }
+    sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sfd == -1 || bind(sfd, (struct sockaddr *)&addr, len) != 0 ||
+        listen(sfd, 16) != 0) {
+      fprintf(stderr, "Could not listen on %s: %s\n", port, strerror(errno));
+      if (sfd != -1) {
+        close(sfd);
+      }
+      return -1;
+    }
+    return sfd;
+  }
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  s = getaddrinfo("localhost", port, &hints, &result);
+  if (s != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
+    return -1;
+  }
+
+  for (rp = result; rp != NULL; rp = rp->ai_next) {
+    sfd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK,
+                 rp->ai_protocol);
+    if (sfd == -1)
+      continue;
+    int one = 1;
+    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(sfd, rp->ai_addr, rp->ai_addrlen) == 0 && listen(sfd, 16) == 0)
+      break;  // Success
+
+    close(sfd);
+  }
+  freeaddrinfo(result);
+  if (rp == NULL) {
+    fprintf(stderr, "Could not listen on port %s: %s\n", port,
+            strerror(errno));
+    return -1;
+  }
+  return sfd;
+}
+
+// The listening socket systemd passed, see sd_listen_fds(3), or -1.
+#define SD_LISTEN_FDS_START 3
+
+static int systemd_listen_fd(void) {
+  const char *pid = getenv("LISTEN_PID");
+  const char *fds = getenv("LISTEN_FDS");
+  if (pid == NULL || fds == NULL || strtol(pid, NULL, 10) != getpid() ||
+      strtol(fds, NULL, 10) < 1) {
+    fprintf(stderr, "no socket passed by systemd\n");
+    return -1;
+  }
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+
+  int fd = SD_LISTEN_FDS_START;
+  int listening = 0;
+  socklen_t len = sizeof(listening);
+  if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) != 0 ||
+      !listening) {
+    fprintf(stderr, "the socket passed by systemd is not listening, use "
+            "Accept=no\n");
+    return -1;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+// Returns the route for a stream starting with data, ROUTE_MAX if it matches
+// none of them, or -1 while data is still a prefix of a known protocol.
+static int classify_route(const uint8_t *data, size_t len) {
+  static const struct {
+    const char *prefix;
+    enum route route;
+  } prefixes[] = {
+      {"SSH-", ROUTE_SSH},
+      {"\x16\x03", ROUTE_TLS},  // handshake record of TLS 1.x
+      {"GET ", ROUTE_HTTP},     {"HEAD ", ROUTE_HTTP},
+      {"POST ", ROUTE_HTTP},    {"PUT ", ROUTE_HTTP},
+      {"DELETE ", ROUTE_HTTP},  {"OPTIONS ", ROUTE_HTTP},
+      {"PATCH ", ROUTE_HTTP},   {"CONNECT ", ROUTE_HTTP},
+      {"TRACE ", ROUTE_HTTP},
+  };
+  bool need_more = false;
+
+  for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+    size_t prefix_len = strlen(prefixes[i].prefix);
+    if (memcmp(data, prefixes[i].prefix, MIN(len, prefix_len)) != 0) {
+      continue;
+    }
+    if (len >= prefix_len) {
+      return prefixes[i].route;
+    }
+    need_more = true;
+  }
+  return need_more ? -1 : ROUTE_MAX;
+}
+
+struct mux_channel {
+  uint16_t id;
+  uint8_t priority;
+  const char *route;  // requested route, peer side only
+  int fd;
+  struct ring to_fd;  // received DATA, bounded by the credit we granted
+  uint32_t credit;    // bytes we may still send on this channel
+  uint32_t ungranted; // bytes written to fd, not granted back yet
+  bool open;          // DATA may flow
+  bool send_open;     // MUX_OPEN (request or acknowledgement) still to be sent
+  bool fd_eof;        // nothing more to read from fd
+  bool sent_close;
+  bool peer_closed;
+  bool shut_wr;
+  bool write_failed;
+  bool out_blocked;   // fd took less than offered, wait for EPOLLOUT
+  bool connecting;    // fd is not connected to the backend yet
+  const char *port;   // the backend, peer side only
+  size_t connect_index;  // its address tried next, see connect_backend_start
+  struct watch watch;
+  struct mux_channel *next;
+};
+
+struct mux_listener {
+  int fd;
+  const char *route;
+  uint8_t priority;
+  struct watch watch;
+};
+
+struct mux {
+  struct arguments *arguments;
+  struct ring *rx;             // frames from the other side
+  struct ring *tx;             // frames to the other side
+  size_t tx_bulk_limit;        // priority 0 channels only fill tx up to this
+  struct mux_channel *channels;  // sorted by descending priority
+  bool peer;                   // phone side, opens channels for listeners
+  struct mux_listener listeners[MUX_MAX_LISTENERS];
+  size_t num_listeners;
+  uint16_t next_id;
+  bool failed;
+};
+
+static bool mux_emit(struct mux *mux, uint8_t type, uint8_t priority,
+                     uint16_t channel, const void *payload, uint32_t len) {
+  if (ring_free(mux->tx) < MUX_HEADER_SIZE + len) {
+    return false;
+  }
+  uint8_t header[MUX_HEADER_SIZE] = {
+      type,      priority,  channel >> 8, channel & 0xff,
+      len >> 24, len >> 16, len >> 8,     len & 0xff};
+  ring_write(mux->tx, header, MUX_HEADER_SIZE);
+  ring_write(mux->tx, payload, len);
+  return true;
+}
+
+static struct mux_channel *mux_channel_find(struct mux *mux, uint16_t id) {
+  for (struct mux_channel *ch = mux->channels; ch != NULL; ch = ch->next) {
+    if (ch->id == id) {
+      return ch;
+    }
+  }
+  return NULL;
+}
+
+static struct mux_channel *mux_channel_new(struct mux *mux, uint16_t id,
+                                           uint8_t priority, int fd) {
+  struct mux_channel *ch = calloc(1, sizeof(struct mux_channel));
+  if (ch == NULL || ring_init(&ch->to_fd, MUX_WINDOW) != 0) {
+    free(ch);
+    return NULL;
+  }
+  ch->id = id;
+  ch->priority = priority;
+  ch->fd = fd;
+  watch_init(&ch->watch);
+
+  struct mux_channel **p = &mux->channels;
+  while (*p != NULL && (*p)->priority >= priority) {
+    p = &(*p)->next;
+  }
+  ch->next = *p;
+  *p = ch;
+  return ch;
+}
+
+static void mux_channel_free(struct mux_channel *ch) {
+  watch_del(&ch->watch);
+  if (ch->fd >= 0) {
+    close(ch->fd);
+  }
+  free(ch->to_fd.data);
+  free(ch);
+}
+
+static const char *mux_backend(struct arguments *arguments, const char *name) {
+  if (strlen(name) == 0) {
+    return strlen(arguments->connect) > 0 ? arguments->connect : NULL;
+  }
+  for (int i = 0; i < ROUTE_MAX; i++) {
+    if (strcmp(name, route_names[i]) == 0) {
+      return arguments->routes[i];
+    }
+  }
+  return NULL;
+}
+
+// Connect ch to the next address of its backend, in the background. The
+// acknowledgement goes out once it is up, MUX_CLOSE once none is left.
+static void mux_channel_connect(struct mux_channel *ch) {
+  bool in_progress;
+  ch->fd = connect_backend_start(ch->port, &ch->connect_index, &in_progress);
+  if (ch->fd < 0) {
+    ch->fd_eof = true;
+    return;
+  }
+  ch->connecting = in_progress;
+  if (!ch->connecting) {
+    ch->open = true;
+    ch->send_open = true;
+    ch->credit = MUX_WINDOW;
+  }
+}
+
+// fd became writable while connecting: connected, or on to the next address.
+static void mux_channel_connected(struct mux_channel *ch) {
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if (getsockopt(ch->fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0) {
+    error = errno;
+  }
+  ch->connecting = false;
+  if (error == 0) {
+    ch->open = true;
+    ch->send_open = true;
+    ch->credit = MUX_WINDOW;
+    return;
+  }
+  watch_del(&ch->watch);
+  close(ch->fd);
+  ch->fd = -1;
+  mux_channel_connect(ch);
+}
+
+static void mux_handle_open(struct mux *mux, uint16_t id, uint8_t priority,
+                            size_t pos, uint32_t len) {
+  struct mux_channel *ch = mux_channel_find(mux, id);
+  if (mux->peer) {
+    // acknowledgement of our own request
+    if (ch != NULL && !ch->open) {
+      ch->open = true;
+      ch->credit = MUX_WINDOW;
+    }
+    return;
+  }
+  if (ch != NULL) {
+    fprintf(stderr, "mux: channel %d opened twice\n", id);
+    mux->failed = true;
+    return;
+  }
+
+  char name[16];
+  if (len >= sizeof(name)) {
+    len = sizeof(name) - 1;
+  }
+  ring_copy_out(mux->rx, pos, name, len);
+  name[len] = 0;
+
+  const char *port = mux_backend(mux->arguments, name);
+  ch = mux_channel_new(mux, id, priority, -1);
+  if (ch == NULL) {
+    mux->failed = true;
+    return;
+  }
+  if (port == NULL) {
+    fprintf(stderr, "mux: no backend for route \"%s\"\n", name);
+    // refused, MUX_CLOSE goes out instead of the acknowledgement
+    ch->fd_eof = true;
+    return;
+  }
+  // without blocking the other channels meanwhile
+  ch->port = port;
+  mux_channel_connect(ch);
+}
+
+// handle all complete frames in rx
+static void mux_receive(struct mux *mux) {
+  while (!mux->failed && ring_used(mux->rx) >= MUX_HEADER_SIZE) {
+    uint8_t header[MUX_HEADER_SIZE];
+    ring_copy_out(mux->rx, mux->rx->tail, header, MUX_HEADER_SIZE);
+    uint8_t type = header[0];
+    uint8_t priority = header[1];
+    uint16_t id = header[2] << 8 | header[3];
+    uint32_t len = (uint32_t)header[4] << 24 | header[5] << 16 |
+                   header[6] << 8 | header[7];
+    size_t frame_len = MUX_HEADER_SIZE + len;
+    if (len > MUX_MAX_PAYLOAD) {
+      fprintf(stderr, "mux: frame too long (%u)\n", len);
+      mux->failed = true;
+      return;
+    }
+    if (ring_used(mux->rx) < frame_len) {
+      return;
+    }
+    size_t pos = mux->rx->tail + MUX_HEADER_SIZE;
+    struct mux_channel *ch = mux_channel_find(mux, id);
+
+    switch (type) {
+    case MUX_OPEN:
+      mux_handle_open(mux, id, priority, pos, len);
+      break;
+    case MUX_DATA:
+      if (ch == NULL || ch->peer_closed) {
+        break;
+      }
+      if (ch->write_failed) {
+        // nobody to deliver to, hand the credit straight back
+        ch->ungranted += len;
+        break;
+      }
+      if (len > ring_free(&ch->to_fd)) {
+        fprintf(stderr, "mux: channel %d exceeded its window\n", id);
+        mux->failed = true;
+        return;
+      }
+      while (len > 0) {
+        size_t chunk;
+        uint8_t *p = ring_peek(mux->rx, pos, &chunk);
+        chunk = MIN(chunk, len);
+        ring_write(&ch->to_fd, p, chunk);
+        pos += chunk;
+        len -= chunk;
+      }
+      break;
+    case MUX_CLOSE:
+      if (ch != NULL) {
+        ch->peer_closed = true;
+        if (!ch->open) {
+          // refused open
+          ch->fd_eof = true;
+        }
+      }
+      break;
+    case MUX_WINDOW_UPDATE:
+      if (ch != NULL && len == 4) {
+        uint8_t b[4];
+        ring_copy_out(mux->rx, pos, b, 4);
+        uint32_t increment = (uint32_t)b[0] << 24 | b[1] << 16 | b[2] << 8 |
+                             b[3];
+        if (increment > MUX_WINDOW - ch->credit) {
+          fprintf(stderr, "mux: channel %d granted more than its window\n",
+                  id);
+          mux->failed = true;
+          return;
+        }
+        ch->credit += increment;
+      }
+      break;
+    default:
+      fprintf(stderr, "mux: unknown frame type %d\n", type);
+      mux->failed = true;
+      return;
+    }
+    ring_consume(mux->rx, frame_len);
+  }
+}
+
+// queue pending control frames and free finished channels
+static void mux_send_control(struct mux *mux) {
+  struct mux_channel **p = &mux->channels;
+  while (*p != NULL) {
+    struct mux_channel *ch = *p;
+    if (ch->send_open) {
+      const char *route = ch->route != NULL ? ch->route : "";
+      if (!mux_emit(mux, MUX_OPEN, ch->priority, ch->id, route,
+                    strlen(route))) {
+        return;
+      }
+      ch->send_open = false;
+    }
+    if (ch->ungranted >= MUX_WINDOW / 4) {
+      uint8_t increment[4] = {ch->ungranted >> 24, ch->ungranted >> 16,
+                              ch->ungranted >> 8, ch->ungranted & 0xff};
+      if (!mux_emit(mux, MUX_WINDOW_UPDATE, ch->priority, ch->id, increment,
+                    4)) {
+        return;
+      }
+      ch->ungranted = 0;
+    }
+    if (ch->fd_eof && !ch->sent_close) {
+      if (!mux_emit(mux, MUX_CLOSE, ch->priority, ch->id, NULL, 0)) {
+        return;
+      }
+      ch->sent_close = true;
+    }
+    if (ch->peer_closed && ch->fd >= 0 && !ch->shut_wr &&
+        ring_used(&ch->to_fd) == 0) {
+      shutdown(ch->fd, SHUT_WR);
+      ch->shut_wr = true;
+    }
+
+    if (ch->sent_close && ch->peer_closed &&
+        (ring_used(&ch->to_fd) == 0 || ch->write_failed)) {
+      *p = ch->next;
+      mux_channel_free(ch);
+      continue;
+    }
+    p = &ch->next;
+  }
+}
+
+static void mux_watch(struct mux *mux) {
+  for (size_t i = 0; i < mux->num_listeners; i++) {
+    watch_set(&mux->listeners[i].watch, mux->listeners[i].fd, EPOLLIN);
+  }
+  for (struct mux_channel *ch = mux->channels; ch != NULL; ch = ch->next) {
+    if (ch->fd < 0) {
+      continue;
+    }
+    if (ch->connecting) {
+      watch_set(&ch->watch, ch->fd, EPOLLOUT);
+      continue;
+    }
+    uint32_t events = 0;
+    size_t limit = ch->priority > 0 ? mux->tx->size : mux->tx_bulk_limit;
+    if (ch->open && !ch->fd_eof && ch->credit > 0 &&
+        ring_used(mux->tx) + MUX_HEADER_SIZE < limit) {
+      events |= EPOLLIN;
+    }
+    if (ch->out_blocked && ring_used(&ch->to_fd) > 0 && !ch->write_failed) {
+      events |= EPOLLOUT;
+    }
+    watch_set(&ch->watch, ch->fd, events);
+  }
+}
+
+static void mux_channel_read(struct mux *mux, struct mux_channel *ch) {
+  struct ring *tx = mux->tx;
+  size_t limit = ch->priority > 0 ? tx->size : mux->tx_bulk_limit;
+  if (ring_used(tx) + MUX_HEADER_SIZE >= limit ||
+      ring_free(tx) <= MUX_HEADER_SIZE) {
+    return;
+  }
+
+  // read the payload straight behind a header, which is filled in before
+  // both are handed to the link
+  size_t header_pos = tx->head;
+  size_t offset = (header_pos + MUX_HEADER_SIZE) & (tx->size - 1);
+  size_t len = MIN(ring_free(tx) - MUX_HEADER_SIZE, tx->size - offset);
+  len = MIN(MIN(len, ch->credit), MUX_MAX_PAYLOAD);
+  ssize_t b = read(ch->fd, tx->data + offset, len);
+  if (b <= 0) {
+    if (b == 0 || (errno != EAGAIN && errno != EINTR)) {
+      ch->fd_eof = true;
+    }
+    return;
+  }
+  ch->credit -= b;
+  uint8_t header[MUX_HEADER_SIZE] = {
+      MUX_DATA, ch->priority, ch->id >> 8, ch->id & 0xff,
+      b >> 24,  b >> 16,      b >> 8,      b & 0xff};
+  ring_copy_in(tx, header_pos, header, MUX_HEADER_SIZE);
+  ring_produce(tx, MUX_HEADER_SIZE + b);
+}
+
+static void mux_channel_write(struct mux_channel *ch) {
+  size_t len;
+  uint8_t *p = ring_peek(&ch->to_fd, ch->to_fd.tail, &len);
+  ssize_t b = write(ch->fd, p, len);
+  if (b < 0) {
+    if (errno != EAGAIN && errno != EINTR) {
+      ch->write_failed = true;
+      ch->fd_eof = true;
+      ch->ungranted += ring_used(&ch->to_fd);
+      ring_consume(&ch->to_fd, ring_used(&ch->to_fd));
+    }
+    ch->out_blocked = true;
+    return;
+  }
+  ring_consume(&ch->to_fd, b);
+  ch->ungranted += b;
+  ch->out_blocked = (size_t)b < len;
+}
+
+static void mux_accept(struct mux *mux, struct mux_listener *listener) {
+  int fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK);
+  if (fd < 0) {
+    return;
+  }
+  while (mux_channel_find(mux, mux->next_id) != NULL) {
+    mux->next_id++;
+  }
+  struct mux_channel *ch =
+      mux_channel_new(mux, mux->next_id++, listener->priority, fd);
+  if (ch == NULL) {
+    close(fd);
+    return;
+  }
+  ch->route = listener->route;
+  ch->send_open = true;
+}
+
+// socket I/O for all channels, then the frames that arrived meanwhile
+static void mux_dispatch(struct mux *mux) {
+  for (size_t i = 0; i < mux->num_listeners; i++) {
+    if (mux->listeners[i].watch.revents & EPOLLIN) {
+      mux_accept(mux, &mux->listeners[i]);
+    }
+  }
+  // channels are sorted by priority, so interactive ones go first into tx
+  for (struct mux_channel *ch = mux->channels; ch != NULL; ch = ch->next) {
+    uint32_t revents = ch->watch.revents;
+    if (ch->connecting) {
+      if (revents & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+        mux_channel_connected(ch);
+      }
+      continue;
+    }
+    // written right away, EPOLLOUT is only waited for once fd fell behind
+    if (ring_used(&ch->to_fd) > 0 && !ch->write_failed &&
+        (!ch->out_blocked || revents & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+      mux_channel_write(ch);
+    }
+    if (ch->watch.events & EPOLLIN &&
+        revents & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+      mux_channel_read(mux, ch);
+    }
+  }
+  mux_receive(mux);
+  mux_send_control(mux);
+}
+
+static void mux_free(struct mux *mux) {
+  while (mux->channels != NULL) {
+    struct mux_channel *ch = mux->channels;
+    mux->channels = ch->next;
+    mux_channel_free(ch);
+  }
+  for (size_t i = 0; i < mux->num_listeners; i++) {
+    watch_del(&mux->listeners[i].watch);
+    close(mux->listeners[i].fd);
+  }
+}
+
+// A simulated accessory for testing and benchmarking without a phone (see
+// --simulate). Transfers are completed from a timerfd as if they crossed a
+// bus of sim_bandwidth bytes per second that both directions share, each one
+// sim_latency after its last byte. What the host sends goes to the phone side
+// application, which echos it back or is a local tcp connection. Announced
+// with --audio, it also plays a test tone on an isochronous endpoint.
+#define SIM_AUDIO_ENDPOINT 0x82
+#define SIM_AUDIO_PACKET_SIZE 192
+
+struct sim_xfer {
+  struct libusb_transfer *transfer;
+  uint64_t due;   // CLOCK_MONOTONIC ns, 0 while an IN transfer waits for data
+  size_t length;  // bytes an IN transfer got from from_phone
+  struct sim_xfer *next;
+};
+
+struct sim_queue {
+  struct sim_xfer *head;
+  struct sim_xfer **tail;
+};
+
+struct sim_device {
+  struct aoa_transport transport;  // first, the ops get a pointer to it
+  struct arguments *arguments;
+  uint16_t initial_product;
+  int timer_fd;
+  int wake_fd;    // eventfd to interrupt sim_handle_events
+  int listen_fd;  // --sim-app PORT until the app connected
+  int app_fd;     // -1 for the echo app
+  bool app_eof;
+  bool unplugged;
+  struct ring to_phone;    // OUT data the app did not take yet
+  struct ring from_phone;  // app data not yet handed to IN transfers
+  size_t from_phone_claimed;  // part of from_phone promised to IN transfers
+  struct sim_queue out;       // OUT transfers, in order
+  struct sim_queue in;        // IN transfers, in order
+  struct sim_queue ready;     // control and cancelled transfers
+  struct sim_queue iso;       // audio transfers, in order
+  uint64_t bus_free;          // when the bus is idle again
+  bool audio;
+  bool audio_claimed;
+  uint64_t audio_next;     // start of the first 1 ms frame not yet queued for
+  uint64_t audio_packets;  // sent so far
+  uint64_t audio_frames;
+  char strings[6][256];  // what the host sent with AOA_SEND_STRING
+  unsigned long hid_events;
+  struct watch watch_timer, watch_listen, watch_app;
+};
+
+// Occupy the bus for length bytes and return when they are through.
+static uint64_t sim_bus(struct sim_device *sim, size_t length) {
+  uint64_t now = now_ns();
+  if (sim->bus_free < now) {
+    sim->bus_free = now;
+  }
+  sim->bus_free += length * 1000000000ull / sim->arguments->sim_bandwidth;
+  return sim->bus_free + sim->arguments->sim_latency * 1000;
+}
+
+static void sim_push(struct sim_queue *queue, struct sim_xfer *xfer) {
+  xfer->next = NULL;
+  *queue->tail = xfer;
+  queue->tail = &xfer->next;
+}
+
+static struct sim_xfer *sim_pop(struct sim_queue *queue) {
+  struct sim_xfer *xfer = queue->head;
+  queue->head = xfer->next;
+  if (queue->head == NULL) {
+    queue->tail = &queue->head;
+  }
+  return xfer;
+}
+
+static bool sim_unlink(struct sim_queue *queue, struct sim_xfer *xfer) {
+  for (struct sim_xfer **p = &queue->head; *p != NULL; p = &(*p)->next) {
+    if (*p == xfer) {
+      *p = xfer->next;
+      if (*p == NULL) {
+        queue->tail = p;
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+// The callback may submit or cancel transfers, so the queues have to be
+// consistent before it runs.
+static void sim_complete(struct sim_xfer *xfer,
+                         enum libusb_transfer_status status, size_t length) {
+  struct libusb_transfer *transfer = xfer->transfer;
+  free(xfer);
+  transfer->status = status;
+  transfer->actual_length = length;
+  transfer->callback(transfer);
+}
+
+static bool sim_in_accessory_mode(struct sim_device *sim) {
+  return is_AOA_product(&sim->transport.desc) &&
+         has_accessory_interface(&sim->transport.desc);
+}
+
+// Control requests as a phone answers them: the AOA ones and GET_STATUS.
+// Returns the bytes transferred or a libusb error.
+static int sim_setup(struct sim_device *sim, uint8_t request_type,
+                     uint8_t request, uint16_t value, uint16_t index,
+                     unsigned char *data, uint16_t length) {
+  bool in = request_type & LIBUSB_ENDPOINT_IN;
+  if (sim->unplugged) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+  if ((request_type & 0x60) == LIBUSB_REQUEST_TYPE_STANDARD && in &&
+      request == LIBUSB_REQUEST_GET_STATUS) {
+    memset(data, 0, MIN(length, 2));
+    return MIN(length, 2);
+  }
+  if ((request_type & 0x60) != LIBUSB_REQUEST_TYPE_VENDOR) {
+    return LIBUSB_ERROR_PIPE;
+  }
+
+  switch (request) {
+  case 51:  // ACCESSORY_GET_PROTOCOL
+    if (!in || length < 2) {
+      return LIBUSB_ERROR_PIPE;
+    }
+    data[0] = 2;
+    data[1] = 0;
+    return 2;
+  case 52:  // ACCESSORY_SEND_STRING
+    if (in || index >= 6) {
+      return LIBUSB_ERROR_PIPE;
+    }
+    memset(sim->strings[index], 0, sizeof(sim->strings[index]));
+    memcpy(sim->strings[index], data,
+           MIN(length, sizeof(sim->strings[index]) - 1));
+    return length;
+  case 53:  // ACCESSORY_START
+    if (in) {
+      return LIBUSB_ERROR_PIPE;
+    }
+    sim->transport.desc.idVendor = 0x18d1;
+    sim->transport.desc.idProduct = sim->audio ? 0x2d04 : 0x2d00;
+    fprintf(stderr, "simulated device: accessory mode for %s %s\n",
+            sim->strings[0], sim->strings[1]);
+    return 0;
+  case 54:  // ACCESSORY_REGISTER_HID
+  case 55:  // ACCESSORY_UNREGISTER_HID
+  case 56:  // ACCESSORY_SET_HID_REPORT_DESC
+    return in ? LIBUSB_ERROR_PIPE : length;
+  case 57:  // ACCESSORY_SEND_HID_EVENT
+    if (in) {
+      return LIBUSB_ERROR_PIPE;
+    }
+    sim->hid_events++;
+    return length;
+  case 58:  // ACCESSORY_SET_AUDIO_MODE
+    if (in) {
+      return LIBUSB_ERROR_PIPE;
+    }
+    sim->audio = value != 0;
+    return 0;
+  default:
+    return LIBUSB_ERROR_PIPE;
+  }
+}
+
+// A 441 Hz triangle wave, each 1 ms packet with the frames that fall into it
+// at 44.1 kHz.
+static void sim_audio_fill(struct sim_device *sim,
+                           struct libusb_transfer *transfer) {
+  uint8_t *p = transfer->buffer;
+  for (int i = 0; i < transfer->num_iso_packets; i++) {
+    struct libusb_iso_packet_descriptor *desc = &transfer->iso_packet_desc[i];
+    uint64_t n = sim->audio_packets++;
+    size_t frames = (n + 1) * AUDIO_RATE / 1000 - n * AUDIO_RATE / 1000;
+    frames = MIN(frames, desc->length / AUDIO_FRAME_SIZE);
+    for (size_t f = 0; f < frames; f++) {
+      int phase = sim->audio_frames++ % 100;
+      uint16_t v = (phase < 50 ? phase : 100 - phase) * 640 - 16000;
+      p[4 * f] = p[4 * f + 2] = v & 0xff;
+      p[4 * f + 1] = p[4 * f + 3] = v >> 8;
+    }
+    desc->actual_length = frames * AUDIO_FRAME_SIZE;
+    desc->status = LIBUSB_TRANSFER_COMPLETED;
+    p += desc->length;
+  }
+}
+
+// Move data between the rings and the phone side application.
+static void sim_app(struct sim_device *sim) {
+  if (sim->app_fd < 0 && sim->listen_fd < 0) {
+    // echo
+    while (ring_used(&sim->to_phone) > 0 && ring_free(&sim->from_phone) > 0) {
+      size_t len = ring_used(&sim->to_phone);
+      const uint8_t *data = ring_peek(&sim->to_phone, sim->to_phone.tail, &len);
+      len = MIN(len, ring_free(&sim->from_phone));
+      ring_write(&sim->from_phone, data, len);
+      ring_consume(&sim->to_phone, len);
+    }
+    return;
+  }
+  if (sim->app_fd < 0) {
+    return;
+  }
+
+  while (ring_used(&sim->to_phone) > 0) {
+    size_t len = ring_used(&sim->to_phone);
+    const uint8_t *data = ring_peek(&sim->to_phone, sim->to_phone.tail, &len);
+    ssize_t n = write(sim->app_fd, data, len);
+    if (n <= 0) {
+      break;
+    }
+    ring_consume(&sim->to_phone, n);
+  }
+  while (!sim->app_eof && ring_free(&sim->from_phone) > 0) {
+    size_t len = ring_free(&sim->from_phone);
+    uint8_t *data = ring_reserve(&sim->from_phone, &len);
+    ssize_t n = read(sim->app_fd, data, len);
+    if (n == 0) {
+      // the app closed the accessory, like unplugging once the rest is out
+      sim->app_eof = true;
+    }
+    if (n <= 0) {
+      break;
+    }
+    ring_produce(&sim->from_phone, n);
+  }
+}
+
+// IN transfers go on the bus once there is data for them; they end short with
+// whatever the app wrote until then
+static void sim_schedule_in(struct sim_device *sim) {
+  for (struct sim_xfer *xfer = sim->in.head; xfer != NULL; xfer = xfer->next) {
+    size_t available = ring_used(&sim->from_phone) - sim->from_phone_claimed;
+    if (xfer->due != 0) {
+      continue;
+    }
+    if (available == 0) {
+      break;
+    }
+    xfer->length = MIN(available, (size_t)xfer->transfer->length);
+    xfer->due = sim_bus(sim, xfer->length);
+    sim->from_phone_claimed += xfer->length;
+  }
+}
+
+static void sim_arm(struct sim_device *sim) {
+  uint64_t due = 0;
+  if (sim->ready.head != NULL) {
+    due = 1;  // in the past, fires right away
+  }
+  if (sim->out.head != NULL && ring_free(&sim->to_phone) >=
+                                   (size_t)sim->out.head->transfer->length) {
+    due = due == 0 ? sim->out.head->due : MIN(due, sim->out.head->due);
+  }
+  if (sim->in.head != NULL && sim->in.head->due != 0) {
+    due = due == 0 ? sim->in.head->due : MIN(due, sim->in.head->due);
+  }
+  if (sim->iso.head != NULL) {
+    due = due == 0 ? sim->iso.head->due : MIN(due, sim->iso.head->due);
+  }
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = due / 1000000000;
+  its.it_value.tv_nsec = due % 1000000000;
+  timerfd_settime(sim->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// Complete everything that is due and schedule what became possible.
+static void sim_process(struct sim_device *sim) {
+  uint64_t expirations;
+  if (read(sim->timer_fd, &expirations, sizeof(expirations)) < 0 &&
+      errno != EAGAIN) {
+    fprintf(stderr, "error reading the simulation timer: %s\n",
+            strerror(errno));
+  }
+
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    uint64_t now = now_ns();
+    sim_app(sim);
+
+    if (sim->app_eof && ring_used(&sim->from_phone) == 0) {
+      sim->unplugged = true;
+    }
+    if (sim->unplugged) {
+      while (sim->out.head != NULL) {
+        sim_complete(sim_pop(&sim->out), LIBUSB_TRANSFER_NO_DEVICE, 0);
+      }
+      while (sim->in.head != NULL) {
+        sim_complete(sim_pop(&sim->in), LIBUSB_TRANSFER_NO_DEVICE, 0);
+      }
+      while (sim->iso.head != NULL) {
+        sim_complete(sim_pop(&sim->iso), LIBUSB_TRANSFER_NO_DEVICE, 0);
+      }
+    }
+
+    if (sim->ready.head != NULL) {
+      struct sim_xfer *xfer = sim_pop(&sim->ready);
+      struct libusb_transfer *transfer = xfer->transfer;
+      if (xfer->due == 0) {
+        sim_complete(xfer, LIBUSB_TRANSFER_CANCELLED, 0);
+      } else {
+        struct libusb_control_setup *setup =
+            libusb_control_transfer_get_setup(transfer);
+        int r = sim_setup(sim, setup->bmRequestType, setup->bRequest,
+                          libusb_le16_to_cpu(setup->wValue),
+                          libusb_le16_to_cpu(setup->wIndex),
+                          libusb_control_transfer_get_data(transfer),
+                          libusb_le16_to_cpu(setup->wLength));
+        if (r == LIBUSB_ERROR_NO_DEVICE) {
+          sim_complete(xfer, LIBUSB_TRANSFER_NO_DEVICE, 0);
+        } else if (r < 0) {
+          sim_complete(xfer, LIBUSB_TRANSFER_STALL, 0);
+        } else {
+          sim_complete(xfer, LIBUSB_TRANSFER_COMPLETED,
+                       LIBUSB_CONTROL_SETUP_SIZE + r);
+        }
+      }
+      progress = true;
+      continue;
+    }
+
+    // an OUT transfer that is through waits (NAKed) until the app made room
+    struct sim_xfer *xfer = sim->out.head;
+    if (xfer != NULL && xfer->due <= now &&
+        ring_free(&sim->to_phone) >= (size_t)xfer->transfer->length) {
+      size_t length = xfer->transfer->length;
+      ring_write(&sim->to_phone, xfer->transfer->buffer, length);
+      sim_complete(sim_pop(&sim->out), LIBUSB_TRANSFER_COMPLETED, length);
+      progress = true;
+      continue;
+    }
+
+    xfer = sim->iso.head;
+    if (xfer != NULL && xfer->due <= now) {
+      struct libusb_transfer *transfer = xfer->transfer;
+      sim_audio_fill(sim, transfer);
+      sim_complete(sim_pop(&sim->iso), LIBUSB_TRANSFER_COMPLETED,
+                   transfer->length);
+      progress = true;
+      continue;
+    }
+
+    sim_schedule_in(sim);
+    xfer = sim->in.head;
+    if (xfer != NULL && xfer->due != 0 && xfer->due <= now) {
+      struct libusb_transfer *transfer = xfer->transfer;
+      size_t length = xfer->length;
+      ring_copy_out(&sim->from_phone, sim->from_phone.tail, transfer->buffer,
+                    length);
+      ring_consume(&sim->from_phone, length);
+      sim->from_phone_claimed -= length;
+      sim_complete(sim_pop(&sim->in), LIBUSB_TRANSFER_COMPLETED, length);
+      progress = true;
+    }
+  }
+  sim_arm(sim);
+}
+
+static int sim_control(struct aoa_transport *transport, uint8_t request_type,
+                       uint8_t request, uint16_t value, uint16_t index,
+                       unsigned char *data, uint16_t length,
+                       __attribute__ ((unused)) unsigned int timeout) {
+  struct sim_device *sim = (struct sim_device *)transport;
+  usleep(sim->arguments->sim_latency);
+  return sim_setup(sim, request_type, request, value, index, data, length);
+}
+
+static int sim_submit(struct aoa_transport *transport,
+                      struct libusb_transfer *transfer) {
+  struct sim_device *sim = (struct sim_device *)transport;
+  if (sim->unplugged) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+  struct sim_xfer *xfer = calloc(1, sizeof(struct sim_xfer));
+  if (xfer == NULL) {
+    return LIBUSB_ERROR_NO_MEM;
+  }
+  xfer->transfer = transfer;
+
+  if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+    struct libusb_control_setup *setup =
+        libusb_control_transfer_get_setup(transfer);
+    xfer->due = sim_bus(sim, LIBUSB_CONTROL_SETUP_SIZE +
+                                 libusb_le16_to_cpu(setup->wLength));
+    sim_push(&sim->ready, xfer);
+  } else if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+    if (!sim->audio_claimed || transfer->endpoint != SIM_AUDIO_ENDPOINT) {
+      free(xfer);
+      return LIBUSB_ERROR_NOT_SUPPORTED;
+    }
+    // one packet per 1 ms frame, following those already queued; frames
+    // without a transfer waiting are lost, as on a real bus
+    sim->audio_next = MAX(sim->audio_next, now_ns());
+    sim->audio_next += transfer->num_iso_packets * 1000000ull;
+    xfer->due = sim->audio_next + sim->arguments->sim_latency * 1000;
+    sim_push(&sim->iso, xfer);
+  } else if (transfer->type != LIBUSB_TRANSFER_TYPE_BULK ||
+             !sim_in_accessory_mode(sim)) {
+    free(xfer);
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+  } else if (transfer->endpoint & LIBUSB_ENDPOINT_IN) {
+    sim_push(&sim->in, xfer);
+    // the app may have written while no IN transfer was waiting
+    sim_schedule_in(sim);
+  } else {
+    xfer->due = sim_bus(sim, transfer->length);
+    sim_push(&sim->out, xfer);
+  }
+  sim_arm(sim);
+  return 0;
+}
+
+static int sim_cancel(struct aoa_transport *transport,
+                      struct libusb_transfer *transfer) {
+  struct sim_device *sim = (struct sim_device *)transport;
+  struct sim_queue *queues[] = {&sim->out, &sim->in, &sim->ready, &sim->iso};
+  for (size_t i = 0; i < sizeof(queues) / sizeof(queues[0]); i++) {
+    for (struct sim_xfer *xfer = queues[i]->head; xfer != NULL;
+         xfer = xfer->next) {
+      if (xfer->transfer != transfer) {
+        continue;
+      }
+      sim_unlink(queues[i], xfer);
+      if (queues[i] == &sim->in && xfer->due != 0) {
+        // the data stays for the next IN transfer
+        sim->from_phone_claimed -= xfer->length;
+      }
+      xfer->due = 0;
+      sim_push(&sim->ready, xfer);
+      sim_arm(sim);
+      return 0;
+    }
+  }
+  return LIBUSB_ERROR_NOT_FOUND;
+}
+
+static void sim_accept(struct sim_device *sim) {
+  int fd = accept4(sim->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+  if (fd >= 0) {
+    watch_del(&sim->watch_listen);
+    close(sim->listen_fd);
+    sim->listen_fd = -1;
+    sim->app_fd = fd;
+  }
+}
+
+// Outside of the event loop (the USB thread of --threads, or waiting for
+// cancelled transfers), wait for the same fds sim_watch would.
+static int sim_handle_events(struct aoa_transport *transport,
+                             struct timeval *tv) {
+  struct sim_device *sim = (struct sim_device *)transport;
+  struct pollfd fds[3] = {{sim->timer_fd, POLLIN, 0},
+                          {sim->wake_fd, POLLIN, 0},
+                          {sim->listen_fd, POLLIN, 0}};
+  if (sim->app_fd >= 0) {
+    fds[2].fd = sim->app_fd;
+    fds[2].events = 0;
+    if (!sim->app_eof && ring_free(&sim->from_phone) > 0) {
+      fds[2].events |= POLLIN;
+    }
+    if (ring_used(&sim->to_phone) > 0) {
+      fds[2].events |= POLLOUT;
+    }
+  }
+  int r = poll(fds, 3, tv->tv_sec * 1000 + tv->tv_usec / 1000);
+  if (r < 0 && errno != EINTR) {
+    return LIBUSB_ERROR_IO;
+  }
+  if (fds[1].revents) {
+    eventfd_t interrupts;
+    eventfd_read(sim->wake_fd, &interrupts);
+  }
+  if (sim->listen_fd >= 0 && fds[2].revents) {
+    sim_accept(sim);
+  }
+  sim_process(sim);
+  return 0;
+}
+
+static void sim_interrupt(struct aoa_transport *transport) {
+  struct sim_device *sim = (struct sim_device *)transport;
+  eventfd_write(sim->wake_fd, 1);
+}
+
+static int sim_claim(struct aoa_transport *transport) {
+  struct sim_device *sim = (struct sim_device *)transport;
+  if (!sim_in_accessory_mode(sim)) {
+    fprintf(stderr, "error claiming the interface of the device: %s\n",
+            libusb_error_name(LIBUSB_ERROR_NOT_FOUND));
+    return LIBUSB_ERROR_NOT_FOUND;
+  }
+  transport->max_packet_size = sim->arguments->sim_packet_size;
+  return 0;
+}
+
+static void sim_release(__attribute__ ((unused)) struct aoa_transport *transport) {}
+
+static int sim_claim_audio(struct aoa_transport *transport, uint8_t *endpoint,
+                           int *packet_size) {
+  struct sim_device *sim = (struct sim_device *)transport;
+  if (!has_audio_interface(&transport->desc)) {
+    fprintf(stderr, "the device has no audio interface, announce with --audio\n");
+    return LIBUSB_ERROR_NOT_FOUND;
+  }
+  sim->audio_claimed = true;
+  *endpoint = SIM_AUDIO_ENDPOINT;
+  *packet_size = SIM_AUDIO_PACKET_SIZE;
+  return 0;
+}
+
+static void sim_release_audio(struct aoa_transport *transport) {
+  struct sim_device *sim = (struct sim_device *)transport;
+  sim->audio_claimed = false;
+}
+
+static int sim_reset(struct aoa_transport *transport) {
+  struct sim_device *sim = (struct sim_device *)transport;
+  transport->desc.idProduct = sim->initial_product;
+  sim->audio = false;
+  memset(sim->strings, 0, sizeof(sim->strings));
+  return 0;
+}
+
+static void sim_close(struct aoa_transport *transport) {
+  struct sim_device *sim = (struct sim_device *)transport;
+  struct sim_queue *queues[] = {&sim->out, &sim->in, &sim->ready, &sim->iso};
+  for (size_t i = 0; i < sizeof(queues) / sizeof(queues[0]); i++) {
+    while (queues[i]->head != NULL) {
+      free(sim_pop(queues[i]));
+    }
+  }
+  watch_del(&sim->watch_timer);
+  watch_del(&sim->watch_listen);
+  watch_del(&sim->watch_app);
+  if (sim->timer_fd >= 0) {
+    close(sim->timer_fd);
+  }
+  if (sim->wake_fd >= 0) {
+    close(sim->wake_fd);
+  }
+  if (sim->listen_fd >= 0) {
+    close(sim->listen_fd);
+  }
+  if (sim->app_fd >= 0) {
+    close(sim->app_fd);
+  }
+  if (sim->hid_events > 0) {
+    fprintf(stderr, "simulated device: received %lu HID events\n",
+            sim->hid_events);
+  }
+  free(sim->to_phone.data);
+  free(sim->from_phone.data);
+  free(sim);
+}
+
+static void sim_watch(struct aoa_transport *transport) {
+  struct sim_device *sim = (struct sim_device *)transport;
+  watch_set(&sim->watch_timer, sim->timer_fd, EPOLLIN);
+  if (sim->listen_fd >= 0) {
+    watch_set(&sim->watch_listen, sim->listen_fd, EPOLLIN);
+  }
+  if (sim->app_fd >= 0) {
+    uint32_t events = 0;
+    if (!sim->app_eof && ring_free(&sim->from_phone) > 0) {
+      events |= EPOLLIN;
+    }
+    if (ring_used(&sim->to_phone) > 0) {
+      events |= EPOLLOUT;
+    }
+    watch_set(&sim->watch_app, sim->app_fd, events);
+  }
+}
+
+static void sim_dispatch(struct aoa_transport *transport) {
+  struct sim_device *sim = (struct sim_device *)transport;
+  if (sim->watch_listen.revents) {
+    sim_accept(sim);
+  }
+  if (sim->watch_timer.revents || sim->watch_app.revents) {
+    sim_process(sim);
+  }
+}
+
+static const struct aoa_transport_ops sim_transport_ops = {
+    .control = sim_control,
+    .submit = sim_submit,
+    .cancel = sim_cancel,
+    .handle_events = sim_handle_events,
+    .interrupt = sim_interrupt,
+    .claim = sim_claim,
+    .release = sim_release,
+    .reset = sim_reset,
+    .close = sim_close,
+    .watch = sim_watch,
+    .dispatch = sim_dispatch,
+    .claim_audio = sim_claim_audio,
+    .release_audio = sim_release_audio,
+};
+
+static struct aoa_transport *sim_transport_new(struct arguments *arguments) {
+  struct sim_device *sim = calloc(1, sizeof(struct sim_device));
+  if (sim == NULL) {
+    fprintf(stderr, "could not allocate the simulated device\n");
+    return NULL;
+  }
+  sim->transport.ops = &sim_transport_ops;
+  snprintf(sim->transport.name, sizeof(sim->transport.name), "simulated");
+  sim->transport.sys_fd = -1;
+  sim->arguments = arguments;
+  sim->listen_fd = -1;
+  sim->app_fd = -1;
+  watch_init(&sim->watch_timer);
+  watch_init(&sim->watch_listen);
+  watch_init(&sim->watch_app);
+  sim->out.tail = &sim->out.head;
+  sim->in.tail = &sim->in.head;
+  sim->ready.tail = &sim->ready.head;
+  sim->iso.tail = &sim->iso.head;
+
+  // starts out like a phone in MTP mode when there is something to announce
+  sim->initial_product = arguments->announce ? 0x4ee1
+                         : arguments->audio  ? 0x2d04
+                                             : 0x2d00;
+  struct libusb_device_descriptor *desc = &sim->transport.desc;
+  desc->bLength = LIBUSB_DT_DEVICE_SIZE;
+  desc->bDescriptorType = LIBUSB_DT_DEVICE;
+  desc->bcdUSB = 0x0200;
+  desc->bMaxPacketSize0 = 64;
+  desc->idVendor = 0x18d1;
+  desc->idProduct = sim->initial_product;
+  desc->bNumConfigurations = 1;
+
+  // an OUT transfer has to fit into to_phone to ever complete
+  size_t ring_size = 2 * (arguments->buffer_size + arguments->sim_packet_size);
+  sim->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  sim->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (sim->timer_fd < 0 || sim->wake_fd < 0 || ring_init(&sim->to_phone, ring_size) != 0 ||
+      ring_init(&sim->from_phone, ring_size) != 0) {
+    fprintf(stderr, "could not set up the simulated device\n");
+    sim_close(&sim->transport);
+    return NULL;
+  }
+  if (strcmp(arguments->sim_app, "echo") != 0) {
+    sim->listen_fd = listen_local(arguments->sim_app);
+    if (sim->listen_fd < 0) {
+      sim_close(&sim->transport);
+      return NULL;
+    }
+  }
+  return &sim->transport;
+}
+
+// The backend connection broke: the end of the session, or with --reconnect
+// of the connection only, as if it was closed.
+static void aoa_session_backend_failed(struct aoa_session *session) {
+  if (session->arguments->reconnect) {
+    session->fd_in_eof = true;
+  } else {
+    session->done = true;
+  }
+}
+
+static bool aoa_session_wants_input(struct aoa_session *session) {
+  struct aoa_link *link = &session->link;
+  return (__atomic_load_n(&link->received, __ATOMIC_RELAXED) ||
+          !session->arguments->wait) &&
+         !session->fd_in_eof && !link->fd_in_paused;
+}
+
+// read() from fd_in into to_aoa returned b
+static void aoa_session_read_done(struct aoa_session *session, ssize_t b) {
+  struct aoa_link *link = &session->link;
+  if (b == 0) {
+    session->fd_in_eof = true;
+  } else if (b < 0) {
+    if (errno != EAGAIN && errno != EINTR) {
+      fprintf(stderr, "error reading: %s\n", strerror(errno));
+      aoa_session_backend_failed(session);
+    }
+  } else {
+    // fprintf(stderr, "read %ld bytes from stdin\n", b);
+    ring_produce(&link->to_aoa, b);
+    STAT_ADD(link->stats.out_reads, 1);
+    STAT_PEAK(link->stats.to_aoa_peak, ring_used(&link->to_aoa));
+    if (ring_free(&link->to_aoa) == 0) {
+      link->fd_in_paused = true;
+      STAT_ADD(link->stats.out_pauses, 1);
+    }
+    aoa_link_kick(link, true);
+  }
+}
+
+// write() of len bytes out of from_aoa to fd_out returned b
+static void aoa_session_write_done(struct aoa_session *session, ssize_t b,
+                                   size_t len) {
+  struct aoa_link *link = &session->link;
+  if (b < 0) {
+    if (errno != EAGAIN && errno != EINTR) {
+      fprintf(stderr, "could not write out the AOA buffer to stdout (%s). "
+                      "Exiting...\n", strerror(errno));
+      aoa_session_backend_failed(session);
+    }
+  } else {
+    ring_consume(&link->from_aoa, b);
+    aoa_link_kick(link, false);
+  }
+  // the clock is only read when fd_out falls behind or catches up
+  if (b < (ssize_t)len && session->blocked_since == 0) {
+    session->blocked_since = now_ns();
+  } else if (b == (ssize_t)len && session->blocked_since != 0) {
+    STAT_ADD(link->stats.blocked_ns, now_ns() - session->blocked_since);
+    session->blocked_since = 0;
+  }
+}
+
+#ifdef HAS_URING
+// --io-uring: the local side of a session as io_uring requests instead of
+// epoll readiness and read()/write(). The link rings are registered buffers,
+// so the kernel reads straight into to_aoa and writes straight out of
+// from_aoa. One read and one write are in flight, each as large as the ring
+// allows. What a round queued is submitted right before the wait, and the
+// ring fd is in the epoll set, so that one wait covers libusb's fds as well.
+enum { URING_READ = 1, URING_WRITE, URING_CANCEL };
+
+struct uring_engine {
+  struct io_uring ring;
+  struct watch watch;
+  bool fixed;  // the link rings are registered
+  bool reading, writing;
+  size_t write_len;
+  int fd_in, fd_out;  // made blocking already
+  int fd_in_flags, fd_out_flags;  // to restore, -1: left as they were
+};
+
+static struct uring_engine *uring_new(struct aoa_link *link) {
+  struct uring_engine *u = calloc(1, sizeof(struct uring_engine));
+  if (u == NULL) {
+    return NULL;
+  }
+  int r = io_uring_queue_init(8, &u->ring, 0);
+  if (r < 0) {
+    fprintf(stderr, "io_uring not available, using epoll: %s\n",
+            strerror(-r));
+    free(u);
+    return NULL;
+  }
+  struct iovec iov[2] = {{link->to_aoa.data, link->to_aoa.size},
+                         {link->from_aoa.data, link->from_aoa.size}};
+  // the pinned pages count against RLIMIT_MEMLOCK, plain requests do without
+  u->fixed = io_uring_register_buffers(&u->ring, iov, 2) == 0;
+  watch_init(&u->watch);
+  u->fd_in = -1;
+  u->fd_out = -1;
+  u->fd_in_flags = -1;
+  u->fd_out_flags = -1;
+  return u;
+}
+
+// io_uring fails requests on O_NONBLOCK fds with EAGAIN instead of waiting.
+// fd may be the inherited stdin or stdout, whose file description the shell
+// shares, so uring_free restores *flags.
+static int uring_blocking(int fd, int *flags) {
+  *flags = fcntl(fd, F_GETFL);
+  if (*flags >= 0 && *flags & O_NONBLOCK) {
+    fcntl(fd, F_SETFL, *flags & ~O_NONBLOCK);
+  } else {
+    *flags = -1;
+  }
+  return fd;
+}
+
+static void uring_watch(struct aoa_session *session) {
+  struct uring_engine *u = session->uring;
+  struct aoa_link *link = &session->link;
+  bool queued = false;
+  if (!session->done && session->fd_out >= 0) {
+    if (session->fd_in != u->fd_in) {
+      u->fd_in = uring_blocking(session->fd_in, &u->fd_in_flags);
+    }
+    if (session->fd_out != u->fd_out) {
+      u->fd_out = uring_blocking(session->fd_out, &u->fd_out_flags);
+    }
+    struct io_uring_sqe *sqe;
+    if (!u->reading && aoa_session_wants_input(session) &&
+        (sqe = io_uring_get_sqe(&u->ring)) != NULL) {
+      size_t len;
+      uint8_t *p = ring_reserve(&link->to_aoa, &len);
+      if (u->fixed) {
+        io_uring_prep_read_fixed(sqe, session->fd_in, p, len, -1, 0);
+      } else {
+        io_uring_prep_read(sqe, session->fd_in, p, len, -1);
+      }
+      sqe->user_data = URING_READ;
+      u->reading = true;
+      queued = true;
+    }
+    if (!u->writing && ring_used(&link->from_aoa) > 0 &&
+        (sqe = io_uring_get_sqe(&u->ring)) != NULL) {
+      uint8_t *p = ring_peek(&link->from_aoa, link->from_aoa.tail,
+                             &u->write_len);
+      if (u->fixed) {
+        io_uring_prep_write_fixed(sqe, session->fd_out, p, u->write_len, -1,
+                                  1);
+      } else {
+        io_uring_prep_write(sqe, session->fd_out, p, u->write_len, -1);
+      }
+      sqe->user_data = URING_WRITE;
+      u->writing = true;
+      queued = true;
+    }
+  }
+  if (queued) {
+    io_uring_submit(&u->ring);
+  }
+  watch_set(&u->watch, u->ring.ring_fd, EPOLLIN);
+}
+
+static void uring_complete(struct aoa_session *session,
+                           struct io_uring_cqe *cqe) {
+  struct uring_engine *u = session->uring;
+  ssize_t b = cqe->res;
+  if (b < 0) {
+    errno = -b;
+    b = -1;
+  }
+  if (cqe->user_data == URING_READ) {
+    u->reading = false;
+    aoa_session_read_done(session, b);
+  } else if (cqe->user_data == URING_WRITE) {
+    u->writing = false;
+    aoa_session_write_done(session, b, u->write_len);
+  }
+}
+
+static void uring_dispatch(struct aoa_session *session) {
+  struct uring_engine *u = session->uring;
+  struct io_uring_cqe *cqe;
+  while (io_uring_peek_cqe(&u->ring, &cqe) == 0) {
+    uring_complete(session, cqe);
+    io_uring_cqe_seen(&u->ring, cqe);
+  }
+}
+
+// The kernel must be done with the rings before they are freed.
+static void uring_free(struct aoa_session *session) {
+  struct uring_engine *u = session->uring;
+  struct io_uring_sqe *sqe;
+  if (u->reading && (sqe = io_uring_get_sqe(&u->ring)) != NULL) {
+    io_uring_prep_cancel(sqe, (void *)URING_READ, 0);
+    sqe->user_data = URING_CANCEL;
+  }
+  if (u->writing && (sqe = io_uring_get_sqe(&u->ring)) != NULL) {
+    io_uring_prep_cancel(sqe, (void *)URING_WRITE, 0);
+    sqe->user_data = URING_CANCEL;
+  }
+  io_uring_submit(&u->ring);
+  while (u->reading || u->writing) {
+    struct io_uring_cqe *cqe;
+    if (io_uring_wait_cqe(&u->ring, &cqe) != 0) {
+      break;
+    }
+    if (cqe->user_data == URING_READ) {
+      u->reading = false;
+    } else if (cqe->user_data == URING_WRITE) {
+      u->writing = false;
+    }
+    io_uring_cqe_seen(&u->ring, cqe);
+  }
+  if (u->fd_in_flags >= 0 && u->fd_in == session->fd_in) {
+    fcntl(u->fd_in, F_SETFL, u->fd_in_flags);
+  }
+  if (u->fd_out_flags >= 0 && u->fd_out == session->fd_out) {
+    fcntl(u->fd_out, F_SETFL, u->fd_out_flags);
+  }
+  watch_del(&u->watch);
+  io_uring_queue_exit(&u->ring);
+  free(u);
+  session->uring = NULL;
+}
+#endif  // HAS_URING
+
+static int aoa_session_start(struct aoa_session *session,
+                             struct aoa_transport *transport,
+                             struct arguments *arguments, int fd_in,
+                             int fd_out) {
+  int r = transport->ops->claim(transport);
+  if (r != 0) {
+    return r;
+  }
+
+  memset(session, 0, sizeof(*session));
+  session->transport = transport;
+  session->arguments = arguments;
+  session->fd_in = fd_in;
+  session->fd_out = fd_out;
+  session->listen_fd = -1;
+  watch_init(&session->watch_in);
+  watch_init(&session->watch_out);
+  watch_init(&session->watch_wake);
+  watch_init(&session->watch_listen);
+  session->started = now_ns() / 1e9;
+  session->live_since = now_ns();
+  session->stall_since = session->live_since;
+  snprintf(session->name, sizeof(session->name), "%s", transport->name);
+  aoa_link_init(&session->link, transport, arguments);
+  if (arguments->mux) {
+    session->mux = calloc(1, sizeof(struct mux));
+    if (session->mux == NULL) {
+      aoa_link_free(&session->link);
+      return LIBUSB_ERROR_NO_MEM;
+    }
+    session->mux->arguments = arguments;
+    session->mux->rx = &session->link.from_aoa;
+    session->mux->tx = &session->link.to_aoa;
+    // bulk channels keep about two transfers queued, so interactive frames
+    // never wait long behind them
+    session->mux->tx_bulk_limit = 2 * session->link.buffer_size;
+  }
+  aoa_link_pump(&session->link);
+  if (arguments->threads) {
+    r = aoa_link_start_thread(&session->link);
+    if (r != 0) {
+      if (session->mux != NULL) {
+        mux_free(session->mux);
+        free(session->mux);
+      }
+      aoa_link_free(&session->link);
+      transport->ops->release(transport);
+      return r;
+    }
+  }
+#ifdef HAS_URING
+  if (arguments->io_uring) {
+    // falls back to epoll if io_uring is not available
+    session->uring = uring_new(&session->link);
+  }
+#endif
+  return 0;
+}
+
+static void aoa_session_close(struct aoa_session *session) {
+  if (session->mux != NULL) {
+    mux_free(session->mux);
+    free(session->mux);
+  }
+  watch_del(&session->watch_wake);
+#ifdef HAS_URING
+  if (session->uring != NULL) {
+    uring_free(session);
+  }
+#endif
+  aoa_link_free(&session->link);
+  session->transport->ops->release(session->transport);
+  watch_del(&session->watch_in);
+  watch_del(&session->watch_out);
+  watch_del(&session->watch_listen);
+  if (session->fd_in >= 0 && session->fd_in == session->fd_out) {
+    close(session->fd_in);
+  }
+}
+
+// Connect the session to the backend on port. With --reconnect a failure is
+// retried later, backing off up to RECONNECT_MAX_DELAY_MS.
+#define RECONNECT_MAX_DELAY_MS 10000
+
+// Connect to the next address of the backend, in the background, e.g. after
+// the last one refused.
+static void aoa_session_connect_next(struct aoa_session *session) {
+  bool in_progress;
+  int sfd = connect_backend_start(session->connect_port,
+                                  &session->connect_index, &in_progress);
+  if (sfd < 0) {
+    if (!session->arguments->reconnect) {
+      session->done = true;
+      return;
+    }
+    session->reconnect_delay_ms =
+        session->reconnect_delay_ms == 0
+            ? 100
+            : MIN(2 * session->reconnect_delay_ms, RECONNECT_MAX_DELAY_MS);
+    session->reconnect_at = now_ns() + session->reconnect_delay_ms * 1000000ull;
+    return;
+  }
+  session->connecting = in_progress;
+#ifdef HAS_URING
+  // its reads and writes wait for the connection themselves
+  if (session->uring != NULL) {
+    session->connecting = false;
+  }
+#endif
+  if (!session->connecting) {
+    session->reconnect_delay_ms = 0;
+    session->reconnect_at = 0;
+  }
+  session->fd_in = sfd;
+  session->fd_out = sfd;
+}
+
+static void aoa_session_connect(struct aoa_session *session,
+                                const char *port) {
+  if (now_ns() < session->reconnect_at) {
+    return;
+  }
+  session->connect_port = port;
+  session->connect_index = 0;
+  aoa_session_connect_next(session);
+}
+
+// fd_out became writable while connecting: connected, or on to the next
+// address.
+static void aoa_session_connected(struct aoa_session *session) {
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if (getsockopt(session->fd_out, SOL_SOCKET, SO_ERROR, &error, &len) != 0) {
+    error = errno;
+  }
+  session->connecting = false;
+  if (error == 0) {
+    session->reconnect_delay_ms = 0;
+    session->reconnect_at = 0;
+    return;
+  }
+  watch_del(&session->watch_in);
+  close(session->fd_in);
+  session->fd_in = -1;
+  session->fd_out = -1;
+  aoa_session_connect_next(session);
+}
+
+// --reconnect: the backend is gone, but the device stays claimed. What it
+// sent for the old connection is dropped, the next data it sends opens a
+// new one. What the backend sent still goes out to the device, the marker
+// after it.
+static void aoa_session_disconnect(struct aoa_session *session) {
+  struct aoa_link *link = &session->link;
+  watch_del(&session->watch_in);
+  watch_del(&session->watch_out);
+  close(session->fd_in);
+#ifdef HAS_URING
+  // the next connection may get the same number, made blocking again
+  if (session->uring != NULL) {
+    session->uring->fd_in = -1;
+    session->uring->fd_out = -1;
+    session->uring->fd_in_flags = -1;
+    session->uring->fd_out_flags = -1;
+  }
+#endif
+  session->fd_in = -1;
+  session->fd_out = -1;
+  session->fd_in_eof = false;
+  session->out_blocked = false;
+  if (session->blocked_since != 0) {
+    STAT_ADD(link->stats.blocked_ns, now_ns() - session->blocked_since);
+    session->blocked_since = 0;
+  }
+  ring_consume(&link->from_aoa, ring_used(&link->from_aoa));
+  aoa_link_kick(link, false);
+  session->marker_pending = session->arguments->reconnect_marker != NULL;
+  if (session->listen_fd >= 0) {
+    fprintf(stderr, "%s: client closed, waiting for the next one\n",
+            session->name);
+  } else {
+    fprintf(stderr, "%s: backend closed, connecting again on the next data\n",
+            session->name);
+  }
+}
+
+// --listen: the next client becomes the backend of the session.
+static void aoa_session_accept(struct aoa_session *session) {
+  int fd = accept4(session->listen_fd, NULL, NULL,
+                   SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0) {
+    if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+      perror("accept");
+      session->done = true;
+    }
+    return;
+  }
+  session->fd_in = fd;
+  session->fd_out = fd;
+  fprintf(stderr, "%s: client connected\n", session->name);
+}
+
+// Pick the backend by the first bytes the device sent. They stay in from_aoa
+// and go out to the backend like everything after them.
+static void aoa_session_route(struct aoa_session *session) {
+  struct arguments *arguments = session->arguments;
+  struct ring *ring = &session->link.from_aoa;
+  uint8_t first[8];
+  size_t len = 0;
+
+  while (len < sizeof(first) && len < ring_used(ring)) {
+    size_t chunk;
+    uint8_t *p = ring_peek(ring, ring->tail + len, &chunk);
+    chunk = MIN(chunk, sizeof(first) - len);
+    memcpy(first + len, p, chunk);
+    len += chunk;
+  }
+
+  int route = classify_route(first, len);
+  if (route < 0) {
+    return;
+  }
+  const char *port = arguments->connect;
+  if (route < ROUTE_MAX && arguments->routes[route] != NULL) {
+    port = arguments->routes[route];
+  }
+  if (strlen(port) == 0) {
+    fprintf(stderr, "no backend for %s traffic\n",
+            route < ROUTE_MAX ? route_names[route] : "unknown");
+    session->done = true;
+    return;
+  }
+
+  aoa_session_connect(session, port);
+}
+
+// set the interest of this session for the next round
+static void aoa_session_watch(struct aoa_session *session) {
+  struct aoa_link *link = &session->link;
+  if (link->threaded) {
+    watch_set(&session->watch_wake, link->wake_fd, EPOLLIN);
+  }
+  if (session->mux != NULL && !session->done) {
+    mux_watch(session->mux);
+    return;
+  }
+
+  if (link->fd_in_paused && ring_used(&link->to_aoa) <= link->low_watermark) {
+    link->fd_in_paused = false;
+  }
+#ifdef HAS_URING
+  if (session->uring != NULL) {
+    uring_watch(session);
+    return;
+  }
+#endif
+  if (session->listen_fd >= 0) {
+    watch_set(&session->watch_listen, session->listen_fd,
+              session->fd_out < 0 && !session->done ? EPOLLIN : 0);
+  }
+  uint32_t in = 0, out = 0;
+  // fd_out < 0: not routed to a backend yet
+  if (!session->done && session->connecting) {
+    out = EPOLLOUT;
+  } else if (!session->done && session->fd_out >= 0) {
+    if (aoa_session_wants_input(session)) {
+      in = EPOLLIN;
+    }
+    if (session->out_blocked && ring_used(&link->from_aoa) > 0) {
+      out = EPOLLOUT;
+    }
+  }
+  if (session->fd_in == session->fd_out) {
+    watch_set(&session->watch_in, session->fd_in, in | out);
+  } else {
+    watch_set(&session->watch_in, session->fd_in, in);
+    watch_set(&session->watch_out, session->fd_out, out);
+  }
+}
+
+static void aoa_session_dispatch(struct aoa_session *session) {
+  struct aoa_link *link = &session->link;
+  struct watch *watch_out = session->fd_out == session->fd_in
+                                ? &session->watch_in
+                                : &session->watch_out;
+
+  if (session->watch_wake.revents) {
+    eventfd_t completions;
+    eventfd_read(link->wake_fd, &completions);
+  }
+
+  if (session->mux != NULL) {
+    size_t head = link->to_aoa.head;
+    mux_dispatch(session->mux);
+    aoa_link_kick(link, link->to_aoa.head != head);
+    if (__atomic_load_n(&link->failed, __ATOMIC_RELAXED) ||
+        session->mux->failed) {
+      session->done = true;
+    }
+    return;
+  }
+
+  if (session->connecting &&
+      watch_out->revents & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+    aoa_session_connected(session);
+  }
+  if (session->listen_fd >= 0) {
+    if (session->fd_out < 0 && session->watch_listen.revents) {
+      aoa_session_accept(session);
+    }
+  } else if (session->fd_out < 0 && ring_used(&link->from_aoa) > 0) {
+    if (session->arguments->route) {
+      aoa_session_route(session);
+    } else {
+      aoa_session_connect(session, session->arguments->connect);
+    }
+  }
+
+#ifdef HAS_URING
+  if (session->uring != NULL) {
+    uring_dispatch(session);
+  } else
+#endif
+  {
+    if (session->watch_in.events & EPOLLIN &&
+        session->watch_in.revents & (EPOLLIN | EPOLLHUP | EPOLLERR) &&
+        !link->fd_in_paused) {
+      // reading from stdin possible
+      size_t len;
+      uint8_t *p = ring_reserve(&link->to_aoa, &len);
+      aoa_session_read_done(session, read(session->fd_in, p, len));
+    }
+
+    // written right away, EPOLLOUT is only waited for once fd_out fell behind
+    if (session->fd_out >= 0 && !session->connecting &&
+        ring_used(&link->from_aoa) > 0 &&
+        (!session->out_blocked ||
+         watch_out->revents & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+      size_t len;
+      uint8_t *p = ring_peek(&link->from_aoa, link->from_aoa.tail, &len);
+      ssize_t b = write(session->fd_out, p, len);
+      aoa_session_write_done(session, b, len);
+      session->out_blocked = b < (ssize_t)len;
+    }
+  }
+
+  if (__atomic_load_n(&link->failed, __ATOMIC_RELAXED)) {
+    session->done = true;
+  }
+  if (session->fd_in_eof &&
+      (session->arguments->reconnect || session->listen_fd >= 0)) {
+    aoa_session_disconnect(session);
+  } else if (session->fd_in_eof && ring_used(&link->to_aoa) == 0) {
+    // everything read from fd_in made it to the device
+    session->done = true;
+  }
+  if (session->marker_pending) {
+    const char *marker = session->arguments->reconnect_marker;
+    size_t len = strlen(marker);
+    if (ring_free(&link->to_aoa) >= len) {
+      ring_write(&link->to_aoa, marker, len);
+      session->marker_pending = false;
+      aoa_link_kick(link, true);
+    }
+  }
+}
+
+// When the session has something to do without any fd becoming ready: a
+// backend to connect again with --reconnect, data held back by
+// --coalesce-delay, or a timeout to check.
+static uint64_t aoa_session_deadline(struct aoa_session *session) {
+  struct arguments *arguments = session->arguments;
+  struct aoa_link *link = &session->link;
+  uint64_t deadline = UINT64_MAX;
+  if (link->coalesce_deadline != 0 && !link->threaded) {
+    deadline = link->coalesce_deadline;
+  }
+  if (session->fd_out < 0 && session->reconnect_at != 0 &&
+      ring_used(&link->from_aoa) > 0) {
+    deadline = MIN(deadline, session->reconnect_at);
+  }
+  if (arguments->idle_timeout != 0) {
+    deadline = MIN(deadline, session->live_since +
+                                 arguments->idle_timeout * 1000000000ull);
+  }
+  if (arguments->keepalive != 0 && !link->probing) {
+    deadline = MIN(deadline, MAX(session->live_since, session->probed_at) +
+                                 arguments->keepalive * 1000000000ull);
+  }
+  if (arguments->stall_timeout != 0 && ring_used(&link->to_aoa) > 0) {
+    deadline = MIN(deadline, session->stall_since +
+                                 arguments->stall_timeout * 1000000000ull);
+  }
+  return deadline;
+}
+
+// --idle-timeout, --stall-timeout and --keepalive, after a round of the loop.
+// The transfer counters tell whether the link moved since the last round.
+static void aoa_session_liveness(struct aoa_session *session, uint64_t now) {
+  struct arguments *arguments = session->arguments;
+  struct aoa_link *link = &session->link;
+  uint64_t in = STAT_GET(link->stats.in_transfers);
+  uint64_t out = STAT_GET(link->stats.out_transfers);
+
+  if (in + out != session->live_transfers) {
+    session->live_transfers = in + out;
+    session->live_since = now;
+  }
+  if (out != session->stall_transfers || ring_used(&link->to_aoa) == 0) {
+    session->stall_transfers = out;
+    session->stall_since = now;
+  }
+  if (link->probing && __atomic_load_n(&link->probe_done, __ATOMIC_ACQUIRE)) {
+    link->probing = false;
+    link->probe_done = false;
+    if (link->probe_status != LIBUSB_TRANSFER_COMPLETED) {
+      fprintf(stderr, "%s: device did not answer the keepalive: %s\n",
+              session->name, transfer_status_name(link->probe_status));
+      session->done = true;
+      return;
+    }
+    session->probed_at = now;
+  }
+
+  if (arguments->stall_timeout != 0 &&
+      now - session->stall_since >=
+          arguments->stall_timeout * 1000000000ull) {
+    fprintf(stderr, "%s: no transfer to the device completed for %lus, "
+            "closing\n", session->name, arguments->stall_timeout);
+    session->done = true;
+  } else if (arguments->idle_timeout != 0 &&
+             now - session->live_since >=
+                 arguments->idle_timeout * 1000000000ull) {
+    fprintf(stderr, "%s: idle for %lus, closing\n", session->name,
+            arguments->idle_timeout);
+    session->done = true;
+  } else if (arguments->keepalive != 0 && !link->probing &&
+             now - MAX(session->live_since, session->probed_at) >=
+                 arguments->keepalive * 1000000000ull) {
+    aoa_link_probe(link);
+  }
+}
+
+// --metrics: a unix socket answering every connection with the counters in
+// the Prometheus text format, behind a minimal HTTP/1.0 header so that e.g.
+// curl --unix-socket works as well as plain socat. A response the client
+// does not take right away is sent from the loop as it becomes writable, so
+// a slow scraper does not hold up forwarding. When all slots are taken, a
+// new client takes over the next one in turn.
+#define METRICS_MAX_CLIENTS 4
+
+struct metrics_client {
+  int fd;
+  struct watch watch;
+  char *response;  // header and body, NULL: slot free
+  size_t len, sent;
+};
+
+static struct {
+  int fd;
+  struct watch watch;
+  const char *path;
+  struct metrics_client clients[METRICS_MAX_CLIENTS];
+  unsigned next_client;  // taken over when all are busy
+} metrics = {.fd = -1, .watch = {.fd = -1}};
+
+static int metrics_listen(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "metrics socket path is too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    fprintf(stderr, "could not create the metrics socket: %s\n",
+            strerror(errno));
+    return -1;
+  }
+  // a stale socket of an earlier run
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, 4) != 0) {
+    fprintf(stderr, "could not listen on %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  metrics.fd = fd;
+  metrics.path = path;
+  for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+    watch_init(&metrics.clients[i].watch);
+  }
+  watch_set(&metrics.watch, fd, EPOLLIN);
+  return 0;
+}
+
+static void metrics_client_close(struct metrics_client *c) {
+  watch_del(&c->watch);
+  close(c->fd);
+  free(c->response);
+  c->response = NULL;
+}
+
+// Send what the client takes now, the rest once it is writable again.
+static void metrics_client_send(struct metrics_client *c) {
+  while (c->sent < c->len) {
+    ssize_t n = write(c->fd, c->response + c->sent, c->len - c->sent);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && errno == EAGAIN) {
+      watch_set(&c->watch, c->fd, EPOLLOUT);
+      return;
+    }
+    if (n <= 0) {
+      break;
+    }
+    c->sent += n;
+  }
+  metrics_client_close(c);
+}
+
+static void metrics_close(void) {
+  for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+    if (metrics.clients[i].response != NULL) {
+      metrics_client_close(&metrics.clients[i]);
+    }
+  }
+  if (metrics.fd >= 0) {
+    watch_del(&metrics.watch);
+    close(metrics.fd);
+    unlink(metrics.path);
+    metrics.fd = -1;
+  }
+}
+
+// A copy of stats, for printing while they are updated.
+static void aoa_stats_get(struct aoa_stats *stats, struct aoa_stats *copy) {
+  copy->in_bytes = STAT_GET(stats->in_bytes);
+  copy->out_bytes = STAT_GET(stats->out_bytes);
+  copy->in_transfers = STAT_GET(stats->in_transfers);
+  copy->out_transfers = STAT_GET(stats->out_transfers);
+  for (int i = 0; i < TRANSFER_STATUS_MAX; i++) {
+    copy->errors[i] = STAT_GET(stats->errors[i]);
+  }
+  copy->in_pauses = STAT_GET(stats->in_pauses);
+  copy->out_pauses = STAT_GET(stats->out_pauses);
+  copy->out_reads = STAT_GET(stats->out_reads);
+  copy->blocked_ns = STAT_GET(stats->blocked_ns);
+  copy->from_aoa_peak = STAT_GET(stats->from_aoa_peak);
+  copy->to_aoa_peak = STAT_GET(stats->to_aoa_peak);
+}
+
+static void aoa_stats_dump(FILE *f, struct aoa_session *sessions) {
+  double now = now_ns() / 1e9;
+  for (struct aoa_session *s = sessions; s != NULL; s = s->next) {
+    struct aoa_link *link = &s->link;
+    struct aoa_stats copy;
+    aoa_stats_get(&link->stats, &copy);
+    struct aoa_stats *st = &copy;
+    fprintf(f,
+            "%s: up %.0fs, from device %" PRIu64 " bytes in %" PRIu64
+            " transfers, to device %" PRIu64 " bytes in %" PRIu64
+            " transfers\n",
+            s->name, now - s->started, st->in_bytes, st->in_transfers,
+            st->out_bytes, st->out_transfers);
+    fprintf(f, "%s: failed transfers:", s->name);
+    for (int i = 0; i < TRANSFER_STATUS_MAX; i++) {
+      if (i != LIBUSB_TRANSFER_COMPLETED && i != LIBUSB_TRANSFER_CANCELLED) {
+        fprintf(f, " %s %" PRIu64, transfer_status_names[i], st->errors[i]);
+      }
+    }
+    fprintf(f, "\n");
+    fprintf(f,
+            "%s: from_aoa %zu/%zu (peak %zu, full %" PRIu64
+            " times), to_aoa %zu/%zu (peak %zu, full %" PRIu64
+            " times), output blocked %.3fs\n",
+            s->name, ring_used(&link->from_aoa), link->from_aoa.size,
+            st->from_aoa_peak, st->in_pauses, ring_used(&link->to_aoa),
+            link->to_aoa.size, st->to_aoa_peak, st->out_pauses,
+            st->blocked_ns / 1e9);
+    if (link->coalesce_ns != 0) {
+      fprintf(f, "%s: coalesced %" PRIu64 " reads into %" PRIu64
+              " transfers (%.2f per transfer)\n", s->name, st->out_reads,
+              st->out_transfers,
+              st->out_transfers == 0 ? 0.0
+                                     : (double)st->out_reads /
+                                           st->out_transfers);
+    }
+  }
+}
+
+static void aoa_stats_prometheus(FILE *f, struct aoa_session *sessions) {
+  double now = now_ns() / 1e9;
+  size_t num_sessions = 0;
+  for (struct aoa_session *s = sessions; s != NULL; s = s->next) {
+    num_sessions++;
+  }
+
+#define METRIC(name, type, help) \
+  fprintf(f, "# HELP aoa_proxy_" name " " help "\n# TYPE aoa_proxy_" name \
+             " " type "\n")
+  METRIC("sessions", "gauge", "Forwarding sessions.");
+  fprintf(f, "aoa_proxy_sessions %zu\n", num_sessions);
+
+  METRIC("session_uptime_seconds", "gauge", "Time since the session started.");
+  for (struct aoa_session *s = sessions; s != NULL; s = s->next) {
+    fprintf(f, "aoa_proxy_session_uptime_seconds{session=\"%s\"} %.3f\n",
+            s->name, now - s->started);
+  }
+
+  METRIC("bytes_total", "counter", "Bytes carried by completed transfers.");
+  for (struct aoa_session *s = sessions; s != NULL; s = s->next) {
+    fprintf(f,
+            "aoa_proxy_bytes_total{session=\"%s\",direction=\"from_device\"} "
+            "%" PRIu64 "\n"
+            "aoa_proxy_bytes_total{session=\"%s\",direction=\"to_device\"} "
+            "%" PRIu64 "\n",
+            s->name, STAT_GET(s->link.stats.in_bytes), s->name,
+            STAT_GET(s->link.stats.out_bytes));
+  }
+
+  METRIC("transfers_total", "counter", "Completed bulk transfers.");
+  for (struct aoa_session *s = sessions; s != NULL; s = s->next) {
+    fprintf(f,
+            "aoa_proxy_transfers_total{session=\"%s\",direction=\"from_device\"} "
+            "%" PRIu64 "\n"
+            "aoa_proxy_transfers_total{session=\"%s\",direction=\"to_device\"} "
+            "%" PRIu64 "\n",
+            s->name, STAT_GET(s->link.stats.in_transfers), s->name,
+            STAT_GET(s->link.stats.out_transfers));
+  }
+
+  METRIC("local_reads_total", "counter",
+         "Reads from the local side into the ring towards the device; per "
+         "transfer to the device, the coalescing ratio.");
+  for (struct aoa_session *s = sessions; s != NULL; s = s->next) {
+    fprintf(f, "aoa_proxy_local_reads_total{session=\"%s\"} %" PRIu64 "\n",
+            s->name, STAT_GET(s->link.stats.out_reads));
+  }
+
+  METRIC("transfer_errors_total", "counter",
+         "Failed bulk transfers by libusb transfer status.");
+  for (struct aoa_session *s = sessions; s != NULL; s = s->next) {
+    for (int i = 0; i < TRANSFER_STATUS_MAX; i++) {
+      if (i != LIBUSB_TRANSFER_COMPLETED && i != LIBUSB_TRANSFER_CANCELLED) {
+        fprintf(f,
+                "aoa_proxy_transfer_errors_total{session=\"%s\",status=\"%s\"} "
+                "%" PRIu64 "\n",
+                s->name, transfer_status_names[i],
+                STAT_GET(s->link.stats.errors[i]));
+      }
+    }
+  }
+
+  METRIC("ring_full_total", "counter",
+         "Times a ring ran full and its producer was paused.");
+  for (struct aoa_session *s = sessions; s != NULL; s = s->next) {
+    fprintf(f,
+            "aoa_proxy_ring_full_total{session=\"%s\",ring=\"from_device\"} "
+            "%" PRIu64 "\n"
+            "aoa_proxy_ring_full_total{session=\"%s\",ring=\"to_device\"} "
+            "%" PRIu64 "\n",
+            s->name, STAT_GET(s->link.stats.in_pauses), s->name,
+            STAT_GET(s->link.stats.out_pauses));
+  }
+
+  METRIC("ring_used_bytes", "gauge", "Bytes currently buffered in a ring.");
+  for (struct aoa_session *s = sessions; s != NULL; s = s->next) {
+    fprintf(f,
+            "aoa_proxy_ring_used_bytes{session=\"%s\",ring=\"from_device\"} "
+            "%zu\n"
+            "aoa_proxy_ring_used_bytes{session=\"%s\",ring=\"to_device\"} "
+            "%zu\n",
+            s->name, ring_used(&s->link.from_aoa), s->name,
+            ring_used(&s->link.to_aoa));
+  }
+
+  METRIC("ring_peak_bytes", "gauge", "Most bytes ever buffered in a ring.");
+  for (struct aoa_session *s = sessions; s != NULL; s = s->next) {
+    fprintf(f,
+            "aoa_proxy_ring_peak_bytes{session=\"%s\",ring=\"from_device\"} "
+            "%zu\n"
+            "aoa_proxy_ring_peak_bytes{session=\"%s\",ring=\"to_device\"} "
+            "%zu\n",
+            s->name, STAT_GET(s->link.stats.from_aoa_peak), s->name,
+            STAT_GET(s->link.stats.to_aoa_peak));
+  }
+
+  METRIC("ring_size_bytes", "gauge", "Capacity of a ring.");
+  for (struct aoa_session *s = sessions; s != NULL; s = s->next) {
+    fprintf(f,
+            "aoa_proxy_ring_size_bytes{session=\"%s\",ring=\"from_device\"} "
+            "%zu\n"
+            "aoa_proxy_ring_size_bytes{session=\"%s\",ring=\"to_device\"} "
+            "%zu\n",
+            s->name, s->link.from_aoa.size, s->name, s->link.to_aoa.size);
+  }
+
+  METRIC("output_blocked_seconds_total", "counter",
+         "Time the local side did not take all data offered to it.");
+  for (struct aoa_session *s = sessions; s != NULL; s = s->next) {
+    fprintf(f,
+            "aoa_proxy_output_blocked_seconds_total{session=\"%s\"} %.6f\n",
+            s->name, STAT_GET(s->link.stats.blocked_ns) / 1e9);
+  }
+#undef METRIC
+}
+
+static void metrics_accept(struct aoa_session *sessions) {
+  int fd = accept4(metrics.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  char *body = NULL;
+  size_t len = 0;
+  FILE *f = open_memstream(&body, &len);
+  if (f == NULL) {
+    close(fd);
+    return;
+  }
+  aoa_stats_prometheus(f, sessions);
+  fclose(f);
+
+  struct metrics_client *c = NULL;
+  for (int i = 0; i < METRICS_MAX_CLIENTS && c == NULL; i++) {
+    if (metrics.clients[i].response == NULL) {
+      c = &metrics.clients[i];
+    }
+  }
+  if (c == NULL) {
+    c = &metrics.clients[metrics.next_client];
+    metrics.next_client = (metrics.next_client + 1) % METRICS_MAX_CLIENTS;
+    metrics_client_close(c);
+  }
+  int n = asprintf(&c->response,
+                   "HTTP/1.0 200 OK\r\n"
+                   "Content-Type: text/plain; version=0.0.4\r\n"
+                   "Content-Length: %zu\r\n\r\n%s",
+                   len, body);
+  free(body);
+  if (n < 0) {
+    c->response = NULL;
+    close(fd);
+    return;
+  }
+  c->fd = fd;
+  c->len = n;
+  c->sent = 0;
+  metrics_client_send(c);
+}
+
+static void metrics_dispatch(struct aoa_session *sessions) {
+  if (metrics.watch.revents) {
+    metrics_accept(sessions);
+  }
+  for (int i = 0; i < METRICS_MAX_CLIENTS; i++) {
+    struct metrics_client *c = &metrics.clients[i];
+    if (c->response != NULL && c->watch.revents) {
+      metrics_client_send(c);
+    }
+  }
+}
+
+// Wait for and dispatch one round of USB and session events.
+// Returns false once SIGINT or SIGTERM was received.
+static bool aoa_poll_once(struct aoa_session *sessions) {
+  for (struct aoa_session *s = sessions; s != NULL; s = s->next) {
+    struct aoa_transport *t = s->transport;
+    if (t->ops->watch != NULL && !s->link.threaded) {
+      t->ops->watch(t);
+    }
+    aoa_session_watch(s);
+  }
+
+  uint64_t now = now_ns();
+  uint64_t deadline = now + 1000000000ull;
+  struct timeval tv;
+  if (!loop.usb_threaded && libusb_get_next_timeout(NULL, &tv) == 1) {
+    deadline = MIN(deadline, now + tv.tv_sec * 1000000000ull +
+                                 tv.tv_usec * 1000ull);
+  }
+  for (struct aoa_session *s = sessions; s != NULL; s = s->next) {
+    deadline = MIN(deadline, aoa_session_deadline(s));
+  }
+  if (!loop_wait_until(deadline)) {
+    return false;
+  }
+  if (loop.stats_requested) {
+    loop.stats_requested = false;
+    aoa_stats_dump(stderr, sessions);
+  }
+
+  // handle usb events first, completions make room in the rings
+  if (!loop.usb_threaded && (loop.usb_ready || loop.num_events == 0)) {
+    struct timeval zero_tv = {0, 0};
+    libusb_handle_events_timeout(NULL, &zero_tv);
+  }
+  for (struct aoa_session *s = sessions; s != NULL; s = s->next) {
+    struct aoa_transport *t = s->transport;
+    if (t->ops->dispatch != NULL && !s->link.threaded) {
+      t->ops->dispatch(t);
+    }
+    if (s->link.coalesce_deadline != 0 && !s->link.threaded) {
+      aoa_link_pump(&s->link);
+    }
+  }
+
+  now = now_ns();
+  for (struct aoa_session *s = sessions; s != NULL; s = s->next) {
+    if (!s->done) {
+      aoa_session_dispatch(s);
+    }
+    if (!s->done) {
+      aoa_session_liveness(s, now);
+    }
+  }
+  if (metrics.fd >= 0) {
+    metrics_dispatch(sessions);
+  }
+  return true;
+}
+
+// Both ends of --mux in one process. Connections to the --mux-loopback ports
+// are opened as channels by a peer that behaves like the phone, carried
+// through a pair of rings instead of the AOA link and forwarded to the
+// backends like in a real session.
+static void mux_loopback(struct arguments *arguments) {
+  struct ring to_proxy, to_peer;
+  struct mux peer, proxy;
+
+  if (ring_init(&to_proxy, 4 * MUX_WINDOW) != 0 ||
+      ring_init(&to_peer, 4 * MUX_WINDOW) != 0) {
+    fprintf(stderr, "could not allocate the loopback link\n");
+    exit(EXIT_FAILURE);
+  }
+  memset(&peer, 0, sizeof(peer));
+  peer.arguments = arguments;
+  peer.rx = &to_peer;
+  peer.tx = &to_proxy;
+  peer.tx_bulk_limit = MUX_WINDOW;
+  peer.peer = true;
+  memset(&proxy, 0, sizeof(proxy));
+  proxy.arguments = arguments;
+  proxy.rx = &to_proxy;
+  proxy.tx = &to_peer;
+  proxy.tx_bulk_limit = MUX_WINDOW;
+
+  for (size_t i = 0; i < arguments->num_mux_loopback; i++) {
+    int fd = listen_local(arguments->mux_loopback[i].port);
+    if (fd < 0) {
+      exit(EXIT_FAILURE);
+    }
+    watch_init(&peer.listeners[i].watch);
+    peer.listeners[i].fd = fd;
+    peer.listeners[i].route = arguments->mux_loopback[i].route;
+    peer.listeners[i].priority = arguments->mux_loopback[i].priority;
+    peer.num_listeners++;
+  }
+
+  // a vanished reader shows up as EPIPE from write()
+  signal(SIGPIPE, SIG_IGN);
+
+  while (!peer.failed && !proxy.failed) {
+    mux_watch(&peer);
+    mux_watch(&proxy);
+    // frames the proxy just queued are picked up by the peer without waiting
+    if (!loop_wait(ring_used(&to_peer) > 0 ? 0 : 1000)) {
+      break;
+    }
+    mux_dispatch(&peer);
+    mux_dispatch(&proxy);
+  }
+
+  mux_free(&peer);
+  mux_free(&proxy);
+  free(to_proxy.data);
+  free(to_peer.data);
+}
+
+static void aoa_cat(struct aoa_transport *transport,
+                    struct arguments *arguments) {
+  int fd_in = STDIN_FILENO;
+  int fd_out = STDOUT_FILENO;
+
+  // a vanished reader shows up as EPIPE from write()
+  signal(SIGPIPE, SIG_IGN);
+
+  int listen_fd = -1;
+  if (arguments->listen != NULL) {
+    listen_fd = strcmp(arguments->listen, "systemd") == 0
+                    ? systemd_listen_fd()
+                    : listen_local(arguments->listen);
+    if (listen_fd < 0) {
+      libusb_exit(NULL);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (arguments->route || arguments->mux || listen_fd >= 0 ||
+      (arguments->wait && strlen(arguments->connect) > 0)) {
+    // connected once the first bytes arrived, per channel or by a client
+    fd_in = -1;
+    fd_out = -1;
+  } else if (strlen(arguments->connect)>0)
+  {
+    int sfd = connect_backend(arguments->connect);
+    if (sfd < 0) {
+      libusb_exit(NULL);
+      exit(EXIT_FAILURE);
+    }
+
+    // sfd contains the open socket file descriptor
+    fd_in = sfd;
+    fd_out = sfd;
+  }
+
+  struct aoa_session session;
+  if (aoa_session_start(&session, transport, arguments, fd_in, fd_out) != 0) {
+    libusb_exit(NULL);
+    exit(EXIT_FAILURE);
+  }
+
+  session.listen_fd = listen_fd;
+
+  while (!session.done && aoa_poll_once(&session)) {
+  }
+
+  aoa_session_close(&session);
+  if (listen_fd >= 0) {
+    close(listen_fd);
+    if (strncmp(arguments->listen, "unix:", 5) == 0 &&
+        arguments->listen[5] != '@') {
+      unlink(arguments->listen + 5);
+    }
+  }
+}
+
+// --bench: push data through the forwarding path to an app that echos it
+// back, the simulated one or a phone. Each phase runs a session like aoa_cat
+// with a socketpair in place of stdio, the other end is driven by a child
+// process so that its work does not count as CPU time of the proxy.
+#define BENCH_PATTERN_SIZE (1024 * 1024)
+#define BENCH_READ_SIZE (64 * 1024)
+#define BENCH_TIMEOUT_MS 10000
+
+// What the driver measured, passed back through a pipe.
+struct bench_result {
+  bool failed;
+  uint64_t bytes;
+  double to_device_secs;    // until the proxy took the last byte
+  double from_device_secs;  // until the last byte came back
+  uint64_t errors;          // bytes that came back different
+  double p50, p99, p999;    // round trip in usec
+};
+
+static double bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench_cpu(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+         ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void bench_fill(uint8_t *pattern, enum bench_pattern kind) {
+  uint32_t x = 2463534242u;
+  for (size_t i = 0; i < BENCH_PATTERN_SIZE; i++) {
+    switch (kind) {
+    case BENCH_ZERO:
+      pattern[i] = 0;
+      break;
+    case BENCH_COUNTER:
+      pattern[i] = i;
+      break;
+    default:
+      // xorshift32
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      pattern[i] = x;
+      break;
+    }
+  }
+}
+
+// Compare what came back at stream position pos with what was sent there.
+static uint64_t bench_verify(const uint8_t *pattern, uint64_t pos,
+                             const uint8_t *data, size_t len) {
+  uint64_t errors = 0;
+  while (len > 0) {
+    size_t off = pos % BENCH_PATTERN_SIZE;
+    size_t n = MIN(len, BENCH_PATTERN_SIZE - off);
+    if (memcmp(pattern + off, data, n) != 0) {
+      for (size_t i = 0; i < n; i++) {
+        errors += pattern[off + i] != data[i];
+      }
+    }
+    pos += n;
+    data += n;
+    len -= n;
+  }
+  return errors;
+}
+
+static bool bench_wait(int fd, short events) {
+  struct pollfd p = {fd, events, 0};
+  int r;
+  do {
+    r = poll(&p, 1, BENCH_TIMEOUT_MS);
+  } while (r < 0 && errno == EINTR);
+  if (r == 0) {
+    fprintf(stderr, "bench: nothing came back for %d ms, is the app echoing?\n",
+            BENCH_TIMEOUT_MS);
+  }
+  return r > 0;
+}
+
+static void bench_throughput(int fd, struct arguments *arguments,
+                             const uint8_t *pattern, struct bench_result *res) {
+  uint64_t total = arguments->bench_size;
+  uint64_t sent = 0;
+  uint8_t *buffer = malloc(BENCH_READ_SIZE);
+  if (buffer == NULL) {
+    res->failed = true;
+    return;
+  }
+
+  double start = bench_now();
+  res->to_device_secs = 0;
+  while (res->bytes < total) {
+    struct pollfd p = {fd, POLLIN | (sent < total ? POLLOUT : 0), 0};
+    int r = poll(&p, 1, BENCH_TIMEOUT_MS);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      fprintf(stderr, "bench: nothing came back for %d ms, is the app echoing?\n",
+              BENCH_TIMEOUT_MS);
+      res->failed = true;
+      break;
+    }
+    if (sent < total && p.revents & POLLOUT) {
+      size_t off = sent % BENCH_PATTERN_SIZE;
+      ssize_t n = write(fd, pattern + off,
+                        MIN(BENCH_PATTERN_SIZE - off, total - sent));
+      if (n > 0) {
+        sent += n;
+        if (sent == total) {
+          res->to_device_secs = bench_now() - start;
+        }
+      }
+    }
+    if (p.revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t n = read(fd, buffer, MIN(BENCH_READ_SIZE, total - res->bytes));
+      if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        fprintf(stderr, "bench: the proxy closed the connection\n");
+        res->failed = true;
+        break;
+      }
+      if (n > 0) {
+        res->errors += bench_verify(pattern, res->bytes, buffer, n);
+        res->bytes += n;
+      }
+    }
+  }
+  res->from_device_secs = bench_now() - start;
+  free(buffer);
+}
+
+static int bench_compare(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void bench_latency(int fd, struct arguments *arguments,
+                          const uint8_t *pattern, struct bench_result *res) {
+  size_t rounds = arguments->bench_rounds;
+  size_t size = arguments->bench_message;
+  double *samples = malloc(rounds * sizeof(double));
+  uint8_t *buffer = malloc(size);
+  if (samples == NULL || buffer == NULL) {
+    free(samples);
+    free(buffer);
+    res->failed = true;
+    return;
+  }
+
+  uint64_t pos = 0;
+  size_t i;
+  for (i = 0; i < rounds && !res->failed; i++) {
+    double start = bench_now();
+    for (size_t done = 0; done < size && !res->failed;) {
+      size_t off = (pos + done) % BENCH_PATTERN_SIZE;
+      ssize_t n = write(fd, pattern + off,
+                        MIN(size - done, BENCH_PATTERN_SIZE - off));
+      if (n > 0) {
+        done += n;
+      } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+        res->failed = true;
+      } else {
+        res->failed = !bench_wait(fd, POLLOUT);
+      }
+    }
+    for (size_t done = 0; done < size && !res->failed;) {
+      ssize_t n = read(fd, buffer + done, size - done);
+      if (n > 0) {
+        done += n;
+      } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        fprintf(stderr, "bench: the proxy closed the connection\n");
+        res->failed = true;
+      } else {
+        res->failed = !bench_wait(fd, POLLIN);
+      }
+    }
+    samples[i] = (bench_now() - start) * 1e6;
+    res->errors += bench_verify(pattern, pos, buffer, size);
+    res->bytes += size;
+    pos += size;
+  }
+
+  if (!res->failed) {
+    qsort(samples, rounds, sizeof(double), bench_compare);
+    res->p50 = samples[(rounds - 1) * 500 / 1000];
+    res->p99 = samples[(rounds - 1) * 990 / 1000];
+    res->p999 = samples[(rounds - 1) * 999 / 1000];
+  }
+  free(samples);
+  free(buffer);
+}
+
+// What a driven session did, from its start until it ended.
+struct driven_session {
+  double secs, cpu_secs;
+  uint64_t in_transfers, out_transfers;
+};
+
+// Run a session like aoa_cat with a socketpair in place of stdio, while
+// drive(fd, opaque, result) works the other end in a child process, so that
+// its work does not count as CPU time of the proxy. The child passes
+// result_len bytes of result back through a pipe, result is zeroed before.
+// Returns false if the session failed or the child did not report back.
+static bool run_driven_session(struct aoa_transport *transport,
+                               struct arguments *arguments, const char *name,
+                               void (*drive)(int, void *, void *),
+                               void *opaque, void *result, size_t result_len,
+                               struct driven_session *run) {
+  int sv[2], result_pipe[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+    fprintf(stderr, "%s: socketpair: %s\n", name, strerror(errno));
+    return false;
+  }
+  if (pipe(result_pipe) != 0) {
+    fprintf(stderr, "%s: pipe: %s\n", name, strerror(errno));
+    close(sv[0]);
+    close(sv[1]);
+    return false;
+  }
+  fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+  fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) | O_NONBLOCK);
+  // a dead driver shows up as EPIPE from write()
+  signal(SIGPIPE, SIG_IGN);
+
+  memset(result, 0, result_len);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "%s: fork: %s\n", name, strerror(errno));
+    close(sv[0]);
+    close(sv[1]);
+    close(result_pipe[0]);
+    close(result_pipe[1]);
+    return false;
+  }
+  if (pid == 0) {
+    close(sv[0]);
+    close(result_pipe[0]);
+    drive(sv[1], opaque, result);
+    if (write(result_pipe[1], result, result_len) != (ssize_t)result_len) {
+      _exit(EXIT_FAILURE);
+    }
+    _exit(EXIT_SUCCESS);
+  }
+  close(sv[1]);
+  close(result_pipe[1]);
+
+  double start = bench_now();
+  double cpu = bench_cpu();
+  struct aoa_session session;
+  bool ok = aoa_session_start(&session, transport, arguments, sv[0], sv[0]) == 0;
+  if (ok) {
+    // ends once the driver is done and closed its end
+    while (!session.done && aoa_poll_once(&session)) {
+    }
+    if (run != NULL) {
+      run->secs = bench_now() - start;
+      run->cpu_secs = bench_cpu() - cpu;
+      run->in_transfers = STAT_GET(session.link.stats.in_transfers);
+      run->out_transfers = STAT_GET(session.link.stats.out_transfers);
+    }
+    aoa_session_close(&session);
+  } else {
+    close(sv[0]);
+  }
+
+  if (read(result_pipe[0], result, result_len) != (ssize_t)result_len) {
+    ok = false;
+  }
+  close(result_pipe[0]);
+  waitpid(pid, NULL, 0);
+  return ok;
+}
+
+struct bench_driver {
+  struct arguments *arguments;
+  const uint8_t *pattern;
+  bool latency;
+};
+
+static void bench_drive(int fd, void *opaque, void *result) {
+  struct bench_driver *driver = opaque;
+  if (driver->latency) {
+    bench_latency(fd, driver->arguments, driver->pattern, result);
+  } else {
+    bench_throughput(fd, driver->arguments, driver->pattern, result);
+  }
+}
+
+// Run one phase. Returns false if the session or the driver failed.
+static bool bench_run(struct aoa_transport *transport,
+                      struct arguments *arguments, const uint8_t *pattern,
+                      bool latency, struct bench_result *res,
+                      struct driven_session *phase) {
+  struct bench_driver driver = {arguments, pattern, latency};
+  bool ok = run_driven_session(transport, arguments, "bench", bench_drive,
+                               &driver, res, sizeof(*res), phase);
+  return ok && !res->failed;
+}
+
+// Returns false if a phase failed or the echo did not match.
+static bool aoa_bench(struct aoa_transport *transport,
+                      struct arguments *arguments) {
+  uint8_t *pattern = malloc(BENCH_PATTERN_SIZE);
+  if (pattern == NULL) {
+    fprintf(stderr, "could not allocate the bench pattern\n");
+    return false;
+  }
+  bench_fill(pattern, arguments->bench_pattern);
+
+  // a dead driver shows up as EPIPE from write()
+  signal(SIGPIPE, SIG_IGN);
+
+  struct bench_result tp, lat;
+  struct driven_session tp_phase, lat_phase;
+  memset(&tp_phase, 0, sizeof(tp_phase));
+  memset(&lat_phase, 0, sizeof(lat_phase));
+  bool ok = bench_run(transport, arguments, pattern, false, &tp, &tp_phase) &&
+            bench_run(transport, arguments, pattern, true, &lat, &lat_phase);
+  free(pattern);
+  if (!ok) {
+    return false;
+  }
+
+  double mb = tp.bytes / 1e6;
+  double to_mbps = mb / tp.to_device_secs;
+  double from_mbps = mb / tp.from_device_secs;
+  double to_tps = tp_phase.out_transfers / tp_phase.secs;
+  double from_tps = tp_phase.in_transfers / tp_phase.secs;
+  // both directions are handled by the same loop, so the CPU time is per MB
+  // carried in either direction
+  double cpu_ms_per_mb = tp_phase.cpu_secs * 1000 / (2 * mb);
+  uint64_t errors = tp.errors + lat.errors;
+
+  if (arguments->json) {
+    printf("{\"device\":\"%s\",\"transfers\":%d,\"buffer_size\":%zu,"
+           "\"pattern\":\"%s\",\"errors\":%" PRIu64 ",\n"
+           " \"throughput\":{\"bytes\":%" PRIu64 ",\"cpu_ms_per_mb\":%.3f,\n"
+           "  \"to_device\":{\"mb_per_s\":%.2f,\"transfers_per_s\":%.0f},\n"
+           "  \"from_device\":{\"mb_per_s\":%.2f,\"transfers_per_s\":%.0f}},\n"
+           " \"latency\":{\"message_size\":%zu,\"rounds\":%zu,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,"
+           "\"cpu_ms\":%.3f}}\n",
+           arguments->simulate ? "simulated" : "usb", arguments->transfers,
+           arguments->buffer_size,
+           bench_pattern_names[arguments->bench_pattern], errors, tp.bytes,
+           cpu_ms_per_mb, to_mbps, to_tps, from_mbps, from_tps,
+           arguments->bench_message, arguments->bench_rounds, lat.p50,
+           lat.p99, lat.p999, lat_phase.cpu_secs * 1000);
+  } else {
+    printf("throughput: %" PRIu64 " bytes of %s, %d transfers of %zu bytes\n"
+           "  to device:   %8.2f MB/s %8.0f transfers/s\n"
+           "  from device: %8.2f MB/s %8.0f transfers/s\n"
+           "  cpu:         %8.3f ms/MB\n"
+           "latency: %zu round trips of %zu bytes\n"
+           "  p50 %.1f us, p99 %.1f us, p999 %.1f us\n"
+           "errors: %" PRIu64 "\n",
+           tp.bytes, bench_pattern_names[arguments->bench_pattern],
+           arguments->transfers, arguments->buffer_size, to_mbps, to_tps,
+           from_mbps, from_tps, cpu_ms_per_mb, arguments->bench_rounds,
+           arguments->bench_message, lat.p50, lat.p99, lat.p999, errors);
+  }
+  fflush(stdout);
+  return errors == 0;
+}
+
+// --capture-export: pcapng with one usbmon interface. Each record becomes a
+// submission and a completion packet like usbmon reports them, the data goes
+// with the submission for OUT and with the completion for IN.
+#define LINKTYPE_USB_LINUX_MMAPPED 220
+
+// struct mon_bin_hdr of the kernel, in host byte order
+struct usbmon_packet {
+  uint64_t id;
+  uint8_t type;       // 'S'ubmission or 'C'ompletion
+  uint8_t xfer_type;  // 3: bulk
+  uint8_t epnum;
+  uint8_t devnum;
+  uint16_t busnum;
+  char flag_setup;
+  char flag_data;
+  int64_t ts_sec;
+  int32_t ts_usec;
+  int32_t status;
+  uint32_t length;
+  uint32_t len_cap;
+  uint8_t setup[8];
+  int32_t interval;
+  int32_t start_frame;
+  uint32_t xfer_flags;
+  uint32_t ndesc;
+};
+
+struct capture_export {
+  FILE *out;
+  int64_t realtime_offset;
+  uint64_t id;
+};
+
+static int32_t capture_errno(uint8_t status) {
+  switch (status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    return 0;
+  case LIBUSB_TRANSFER_TIMED_OUT:
+    return -ETIMEDOUT;
+  case LIBUSB_TRANSFER_CANCELLED:
+    return -ENOENT;
+  case LIBUSB_TRANSFER_STALL:
+    return -EPIPE;
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    return -ENODEV;
+  case LIBUSB_TRANSFER_OVERFLOW:
+    return -EOVERFLOW;
+  default:
+    return -EPROTO;
+  }
+}
+
+// An Enhanced Packet Block at monotonic time ns.
+static void capture_export_packet(struct capture_export *e, uint64_t ns,
+                                  struct usbmon_packet *packet,
+                                  const uint8_t *data) {
+  uint64_t us = (ns + e->realtime_offset) / 1000;
+  packet->ts_sec = us / 1000000;
+  packet->ts_usec = us % 1000000;
+  uint32_t captured = sizeof(*packet) + packet->len_cap;
+  uint32_t padded = (captured + 3) & ~3u;
+  uint32_t block[7] = {6, 32 + padded, 0, us >> 32, (uint32_t)us, captured,
+                       sizeof(*packet) +
+                           (packet->len_cap > 0 ? packet->length : 0)};
+  static const uint8_t zero[4];
+  fwrite(block, sizeof(block), 1, e->out);
+  fwrite(packet, sizeof(*packet), 1, e->out);
+  fwrite(data, packet->len_cap, 1, e->out);
+  fwrite(zero, padded - captured, 1, e->out);
+  fwrite(&block[1], sizeof(uint32_t), 1, e->out);
+}
+
+static void capture_export_record(const struct capture_record *r,
+                                  void *opaque) {
+  struct capture_export *e = opaque;
+  bool in = r->endpoint & 0x80;
+  struct usbmon_packet packet;
+  memset(&packet, 0, sizeof(packet));
+  packet.id = e->id++;
+  packet.xfer_type = 3;
+  packet.epnum = r->endpoint;
+  packet.flag_setup = '-';
+
+  packet.type = 'S';
+  packet.status = -EINPROGRESS;
+  packet.length = in ? 0 : r->length;
+  packet.len_cap = in ? 0 : r->captured;
+  packet.flag_data = in ? '<' : 0;
+  capture_export_packet(e, r->submitted, &packet, (const uint8_t *)(r + 1));
+
+  packet.type = 'C';
+  packet.status = capture_errno(r->status);
+  packet.length = r->length;
+  packet.len_cap = in ? r->captured : 0;
+  packet.flag_data = in ? 0 : '>';
+  capture_export_packet(e, r->completed, &packet, (const uint8_t *)(r + 1));
+}
+
+static bool capture_export(struct arguments *arguments) {
+  struct capture *c = capture_open(arguments->capture);
+  if (c == NULL) {
+    return false;
+  }
+  FILE *out = fopen(arguments->capture_export, "wbe");
+  if (out == NULL) {
+    fprintf(stderr, "could not open %s: %s\n", arguments->capture_export,
+            strerror(errno));
+    capture_close(c);
+    return false;
+  }
+
+  // Section Header Block: byte order magic, version 1.0, unknown length
+  uint32_t shb[3] = {0x0a0d0d0a, 28, 0x1a2b3c4d};
+  uint16_t version[2] = {1, 0};
+  uint32_t shb_end[3] = {UINT32_MAX, UINT32_MAX, 28};
+  // Interface Description Block
+  uint32_t idb[2] = {1, 20};
+  uint16_t linktype[2] = {LINKTYPE_USB_LINUX_MMAPPED, 0};
+  uint32_t idb_end[2] = {sizeof(struct usbmon_packet) + c->header->snaplen,
+                         20};
+  fwrite(shb, sizeof(shb), 1, out);
+  fwrite(version, sizeof(version), 1, out);
+  fwrite(shb_end, sizeof(shb_end), 1, out);
+  fwrite(idb, sizeof(idb), 1, out);
+  fwrite(linktype, sizeof(linktype), 1, out);
+  fwrite(idb_end, sizeof(idb_end), 1, out);
+
+  struct capture_export e = {out, c->header->realtime_offset, 0};
+  uint64_t count = capture_walk(c, capture_export_record, &e);
+  capture_close(c);
+  if (ferror(out) | (fclose(out) != 0)) {
+    fprintf(stderr, "could not write %s: %s\n", arguments->capture_export,
+            strerror(errno));
+    return false;
+  }
+  fprintf(stderr, "exported %" PRIu64 " transfers to %s\n", count,
+          arguments->capture_export);
+  return true;
+}
+
+// --capture-replay: like --bench, a child process drives the other end of a
+// socketpair. It writes what the recording sent to the device at the
+// recorded times, relative to the first record, and notes when as many bytes
+// came back as the recording had received with each IN transfer.
+#define CAPTURE_REPLAY_LINGER_MS 2000
+
+struct capture_replay_out {
+  uint64_t at;  // ns after the first record
+  uint32_t length;
+  size_t offset;  // in data, captured bytes then zeros up to length
+};
+
+struct capture_replay_in {
+  uint64_t at;
+  uint64_t until;  // bytes received with this transfer and the ones before
+};
+
+struct capture_replay {
+  bool started;
+  uint64_t first;
+  struct capture_replay_out *out;
+  size_t num_out, max_out;
+  struct capture_replay_in *in;
+  size_t num_in, max_in;
+  uint8_t *data;
+  size_t data_len, data_size;
+  uint64_t out_bytes, in_bytes;
+  bool failed;
+};
+
+struct capture_replay_result {
+  bool failed;
+  uint64_t out_transfers, out_bytes;
+  double send_mean_us, send_max_us;  // behind the recorded schedule
+  uint64_t in_transfers, in_bytes;   // of the recorded ones that came back
+  double in_mean_us, in_max_us;      // later than recorded, < 0: earlier
+  double secs;
+};
+
+static void capture_replay_record(const struct capture_record *r,
+                                  void *opaque) {
+  struct capture_replay *rp = opaque;
+  if (rp->failed || r->status != LIBUSB_TRANSFER_COMPLETED || r->length == 0) {
+    return;
+  }
+  bool in = r->endpoint & 0x80;
+  uint64_t at = in ? r->completed : r->submitted;
+  if (!rp->started) {
+    rp->started = true;
+    rp->first = at;
+  }
+  // an OUT transfer submitted before the IN transfer before it completed
+  at = at > rp->first ? at - rp->first : 0;
+
+  if (in) {
+    if (rp->num_in == rp->max_in) {
+      rp->max_in = MAX(64, 2 * rp->max_in);
+      void *p = realloc(rp->in, rp->max_in * sizeof(*rp->in));
+      if (p == NULL) {
+        rp->failed = true;
+        return;
+      }
+      rp->in = p;
+    }
+    rp->in_bytes += r->length;
+    rp->in[rp->num_in++] = (struct capture_replay_in){at, rp->in_bytes};
+    return;
+  }
+
+  if (rp->num_out == rp->max_out) {
+    rp->max_out = MAX(64, 2 * rp->max_out);
+    void *p = realloc(rp->out, rp->max_out * sizeof(*rp->out));
+    if (p == NULL) {
+      rp->failed = true;
+      return;
+    }
+    rp->out = p;
+  }
+  if (rp->data_size - rp->data_len < r->length) {
+    rp->data_size = MAX(2 * rp->data_size, rp->data_len + r->length);
+    void *p = realloc(rp->data, rp->data_size);
+    if (p == NULL) {
+      rp->failed = true;
+      return;
+    }
+    rp->data = p;
+  }
+  memcpy(rp->data + rp->data_len, r + 1, r->captured);
+  memset(rp->data + rp->data_len + r->captured, 0, r->length - r->captured);
+  rp->out[rp->num_out++] =
+      (struct capture_replay_out){at, r->length, rp->data_len};
+  rp->data_len += r->length;
+  rp->out_bytes += r->length;
+}
+
+static void capture_replay_drive(int fd, void *opaque, void *result) {
+  const struct capture_replay *rp = opaque;
+  struct capture_replay_result *res = result;
+  uint8_t *buffer = malloc(BENCH_READ_SIZE);
+  if (buffer == NULL) {
+    res->failed = true;
+    return;
+  }
+  double send_sum = 0, in_sum = 0;
+  size_t next = 0, in_next = 0;
+  size_t written = 0;  // of out[next]
+  uint64_t received = 0;
+  uint64_t start = now_ns();
+  uint64_t progress = start;
+  while (next < rp->num_out || received < rp->in_bytes) {
+    uint64_t now = now_ns();
+    bool due = next < rp->num_out && now - start >= rp->out[next].at;
+    uint64_t timeout_ns;
+    if (due) {
+      timeout_ns = BENCH_TIMEOUT_MS * 1000000ull;
+    } else if (next < rp->num_out) {
+      timeout_ns = start + rp->out[next].at - now;
+    } else if (now - progress < CAPTURE_REPLAY_LINGER_MS * 1000000ull) {
+      timeout_ns = progress + CAPTURE_REPLAY_LINGER_MS * 1000000ull - now;
+    } else {
+      fprintf(stderr, "replay: %" PRIu64 " of %" PRIu64 " bytes did not come "
+              "back within %d ms\n", rp->in_bytes - received, rp->in_bytes,
+              CAPTURE_REPLAY_LINGER_MS);
+      break;
+    }
+    struct pollfd p = {fd, POLLIN | (due ? POLLOUT : 0), 0};
+    struct timespec ts = {timeout_ns / 1000000000, timeout_ns % 1000000000};
+    int r = ppoll(&p, 1, &ts, NULL);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r < 0 || (r == 0 && due)) {
+      fprintf(stderr, "replay: the proxy took nothing for %d ms\n",
+              BENCH_TIMEOUT_MS);
+      res->failed = true;
+      break;
+    }
+    now = now_ns();
+    if (due && p.revents & POLLOUT) {
+      const struct capture_replay_out *o = &rp->out[next];
+      if (written == 0) {
+        double late = (now - start - o->at) / 1e3;
+        send_sum += late;
+        res->send_max_us = MAX(res->send_max_us, late);
+      }
+      ssize_t n = write(fd, rp->data + o->offset + written, o->length - written);
+      if (n > 0) {
+        written += n;
+        progress = now;
+        if (written == o->length) {
+          res->out_transfers++;
+          res->out_bytes += o->length;
+          next++;
+          written = 0;
+        }
+      }
+    }
+    if (p.revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t n = read(fd, buffer, BENCH_READ_SIZE);
+      if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        fprintf(stderr, "replay: the proxy closed the connection\n");
+        res->failed = true;
+        break;
+      }
+      if (n > 0) {
+        received += n;
+        progress = now;
+        for (; in_next < rp->num_in && rp->in[in_next].until <= received;
+             in_next++) {
+          double late = ((double)(now - start) - rp->in[in_next].at) / 1e3;
+          in_sum += late;
+          res->in_max_us = in_next == 0 ? late : MAX(res->in_max_us, late);
+          res->in_transfers++;
+        }
+      }
+    }
+  }
+  res->secs = (now_ns() - start) / 1e9;
+  res->in_bytes = received;
+  if (res->out_transfers > 0) {
+    res->send_mean_us = send_sum / res->out_transfers;
+  }
+  if (res->in_transfers > 0) {
+    res->in_mean_us = in_sum / res->in_transfers;
+  }
+  free(buffer);
+}
+
+// Returns false if the recording could not be read or the session failed.
+static bool aoa_capture_replay(struct aoa_transport *transport,
+                               struct arguments *arguments) {
+  struct capture *c = capture_open(arguments->capture_replay);
+  if (c == NULL) {
+    return false;
+  }
+  struct capture_replay rp;
+  memset(&rp, 0, sizeof(rp));
+  capture_walk(c, capture_replay_record, &rp);
+  capture_close(c);
+  if (rp.failed) {
+    fprintf(stderr, "could not allocate the replay\n");
+    free(rp.out);
+    free(rp.in);
+    free(rp.data);
+    return false;
+  }
+
+  struct capture_replay_result res;
+  bool ok = run_driven_session(transport, arguments, "replay",
+                               capture_replay_drive, &rp, &res, sizeof(res),
+                               NULL);
+
+  printf("replay: %" PRIu64 " of %zu transfers, %" PRIu64 " of %" PRIu64
+         " bytes to the device in %.3f s\n"
+         "  behind schedule: mean %.1f us, max %.1f us\n"
+         "from device: %" PRIu64 " of %zu transfers, %" PRIu64 " of %" PRIu64
+         " bytes\n"
+         "  later than recorded: mean %.1f us, max %.1f us\n",
+         res.out_transfers, rp.num_out, res.out_bytes, rp.out_bytes, res.secs,
+         res.send_mean_us, res.send_max_us, res.in_transfers, rp.num_in,
+         res.in_bytes, rp.in_bytes, res.in_mean_us, res.in_max_us);
+  fflush(stdout);
+  free(rp.out);
+  free(rp.in);
+  free(rp.data);
+  return ok && !res.failed;
+}
+
+static int base64_value(unsigned char c) {
+  if (c >= 'A' && c <= 'Z') {
+    return c - 'A';
+  }
+  if (c >= 'a' && c <= 'z') {
+    return c - 'a' + 26;
+  }
+  if (c >= '0' && c <= '9') {
+    return c - '0' + 52;
+  }
+  // the URL safe alphabet as well
+  if (c == '+' || c == '-') {
+    return 62;
+  }
+  if (c == '/' || c == '_') {
+    return 63;
+  }
+  return -1;
+}
+
+// Decode base64 with or without padding, skipping whitespace. out needs room
+// for len / 4 * 3 + 2 bytes. Returns the decoded length, or -1 for anything
+// that is not base64.
+static ssize_t base64_decode(const char *in, size_t len, uint8_t *out) {
+  uint32_t bits = 0;
+  int num_bits = 0;
+  size_t n = 0;
+  for (size_t i = 0; i < len && in[i] != '='; i++) {
+    unsigned char c = in[i];
+    if (c == '\n' || c == '\r' || c == ' ' || c == '\t') {
+      continue;
+    }
+    int value = base64_value(c);
+    if (value < 0) {
+      return -1;
+    }
+    bits = bits << 6 | value;
+    num_bits += 6;
+    if (num_bits >= 8) {
+      num_bits -= 8;
+      out[n++] = bits >> num_bits;
+    }
+  }
+  return n;
+}
+
+// The largest HID descriptor AOA can carry, and so the largest frame on stdin
+#define HID_MAX_FRAME UINT16_MAX
+// a base64 line of that, plus what was read after it
+#define HID_INPUT_SIZE (2 * HID_MAX_FRAME)
+
+// stdin of --hid, read without stdio so that the event loop can wait for it.
+// buf holds HID_INPUT_SIZE bytes and a terminating NUL after what was read.
+struct hid_input {
+  char *buf;
+  size_t start, end;
+  bool eof;
+};
+
+// Read what stdin has, once it is readable.
+static void hid_input_read(struct hid_input *in) {
+  if (in->start > 0) {
+    memmove(in->buf, in->buf + in->start, in->end - in->start);
+    in->end -= in->start;
+    in->start = 0;
+  }
+  ssize_t b = read(STDIN_FILENO, in->buf + in->end, HID_INPUT_SIZE - in->end);
+  if (b > 0) {
+    in->end += b;
+  } else if (b == 0 || (errno != EAGAIN && errno != EINTR)) {
+    in->eof = true;
+  }
+  in->buf[in->end] = '\0';
+}
+
+// Take the next line out of the input, with its newline if there is one.
+// Returns 1 with it in line and length, 0 if it did not arrive completely
+// yet, and -1 at the end of the input or if it is too long.
+static int hid_input_line(struct hid_input *in, char **line, size_t *length) {
+  char *p = in->buf + in->start;
+  size_t available = in->end - in->start;
+  char *newline = memchr(p, '\n', available);
+  if (newline == NULL && !in->eof) {
+    if (available == HID_INPUT_SIZE) {
+      fprintf(stderr, "HID input line too long\n");
+      return -1;
+    }
+    return 0;
+  }
+  *length = newline != NULL ? (size_t)(newline - p) + 1 : available;
+  if (*length == 0) {
+    return -1;
+  }
+  *line = p;
+  in->start += *length;
+  return 1;
+}
+
+// Take the next frame of --hid out of the input, the descriptor first and
+// the events after it: a base64 encoded line, or with --hid-binary a little
+// endian u16 length followed by that many bytes. Returns 1 with the frame in
+// frame and length, 0 if it did not arrive completely yet, and -1 at the end
+// of the input or on malformed input.
+static int hid_next_frame(struct arguments *arguments, struct hid_input *in,
+                          uint8_t *frame, size_t *length) {
+  char *p = in->buf + in->start;
+  size_t available = in->end - in->start;
+
+  if (arguments->hid_binary) {
+    if (available < 2 ||
+        available < 2 + (size_t)((uint8_t)p[0] | (uint8_t)p[1] << 8)) {
+      if (in->eof && available > 0) {
+        fprintf(stderr, "HID frame cut short\n");
+      }
+      return in->eof ? -1 : 0;
+    }
+    *length = (uint8_t)p[0] | (uint8_t)p[1] << 8;
+    memcpy(frame, p + 2, *length);
+    in->start += 2 + *length;
+    return 1;
+  }
+
+  size_t line;
+  int r = hid_input_line(in, &p, &line);
+  if (r <= 0) {
+    return r;
+  }
+  if (line / 4 * 3 + 2 > HID_MAX_FRAME) {
+    fprintf(stderr, "base64 encoded HID frame too long (length: %zu)\n", line);
+    return -1;
+  }
+  ssize_t n = base64_decode(p, line, frame);
+  if (n < 0) {
+    fprintf(stderr, "HID frame is not base64: %.*s\n", (int)line, p);
+    return -1;
+  }
+  *length = n;
+  return 1;
+}
+
+// Where the relative input fields, e.g. mouse movements, are in the reports
+// of a HID descriptor. Two queued reports that differ only in those are
+// merged into one by adding them up.
+#define HID_MAX_REPORT 64
+#define HID_MAX_FIELDS 32
+
+struct hid_field {
+  uint8_t report_id;
+  uint16_t offset;  // bits from the start of the report, after its id
+  uint8_t size;     // bits, at most 32
+  uint8_t count;
+};
+
+struct hid_layout {
+  bool report_ids;  // reports start with their id
+  struct hid_field fields[HID_MAX_FIELDS];
+  size_t num_fields;
+};
+
+static void hid_parse_descriptor(const uint8_t *desc, size_t len,
+                                 struct hid_layout *layout) {
+  uint16_t offsets[256] = {0};  // per report id
+  uint32_t report_size = 0, report_count = 0;
+  uint8_t report_id = 0;
+  memset(layout, 0, sizeof(*layout));
+
+  for (size_t i = 0; i < len;) {
+    uint8_t prefix = desc[i];
+    if (prefix == 0xfe) {
+      // long item, not used for anything defined
+      i += 3 + (i + 1 < len ? desc[i + 1] : 0);
+      continue;
+    }
+    size_t size = prefix & 3;
+    size = size == 3 ? 4 : size;
+    uint32_t data = 0;
+    for (size_t b = 0; b < size && i + 1 + b < len; b++) {
+      data |= (uint32_t)desc[i + 1 + b] << (8 * b);
+    }
+    i += 1 + size;
+
+    switch (prefix & 0xfc) {
+    case 0x74:  // Report Size
+      report_size = data;
+      break;
+    case 0x94:  // Report Count
+      report_count = data;
+      break;
+    case 0x84:  // Report ID
+      report_id = data;
+      layout->report_ids = true;
+      break;
+    case 0x80:  // Input
+      // variable, relative and not constant
+      if ((data & 0x07) == 0x06 && report_size > 0 && report_size <= 32 &&
+          report_count > 0 && report_count <= UINT8_MAX &&
+          layout->num_fields < HID_MAX_FIELDS) {
+        struct hid_field *f = &layout->fields[layout->num_fields++];
+        f->report_id = report_id;
+        f->offset = offsets[report_id];
+        f->size = report_size;
+        f->count = report_count;
+      }
+      offsets[report_id] += report_size * report_count;
+      break;
+    }
+  }
+}
+
+static int32_t hid_get_bits(const uint8_t *report, size_t offset,
+                            size_t size) {
+  uint32_t value = 0;
+  for (size_t b = 0; b < size; b++) {
+    size_t bit = offset + b;
+    value |= (uint32_t)(report[bit / 8] >> (bit % 8) & 1) << b;
+  }
+  // sign extend
+  if (size < 32 && value & (1u << (size - 1))) {
+    value |= ~0u << size;
+  }
+  return (int32_t)value;
+}
+
+static void hid_set_bits(uint8_t *report, size_t offset, size_t size,
+                         int32_t value) {
+  for (size_t b = 0; b < size; b++) {
+    size_t bit = offset + b;
+    report[bit / 8] &= ~(1 << (bit % 8));
+    report[bit / 8] |= ((uint32_t)value >> b & 1) << (bit % 8);
+  }
+}
+
+// Add report b onto the queued report a, if they only differ in relative
+// fields. Sums are clamped to the field width, what did not fit stays in b.
+// Returns whether b was absorbed completely.
+static bool hid_merge(const struct hid_layout *layout, uint8_t *a, uint8_t *b,
+                      size_t len) {
+  uint8_t id = layout->report_ids ? b[0] : 0;
+  size_t start = layout->report_ids ? 8 : 0;
+  uint8_t mask[HID_MAX_REPORT] = {0};
+  if (len > HID_MAX_REPORT) {
+    return false;
+  }
+  bool relative = false;
+  for (size_t i = 0; i < layout->num_fields; i++) {
+    const struct hid_field *f = &layout->fields[i];
+    if (f->report_id != id) {
+      continue;
+    }
+    size_t end = start + f->offset + (size_t)f->size * f->count;
+    for (size_t bit = start + f->offset; bit < end && bit < 8 * len; bit++) {
+      mask[bit / 8] |= 1 << (bit % 8);
+    }
+    relative = true;
+  }
+  if (!relative) {
+    // nothing to add up, only an identical report could be dropped, and that
+    // may be a key pressed twice
+    return false;
+  }
+  for (size_t i = 0; i < len; i++) {
+    if ((a[i] & ~mask[i]) != (b[i] & ~mask[i])) {
+      return false;
+    }
+  }
+  bool absorbed = true;
+  for (size_t i = 0; i < layout->num_fields; i++) {
+    const struct hid_field *f = &layout->fields[i];
+    if (f->report_id != id) {
+      continue;
+    }
+    for (size_t n = 0; n < f->count; n++) {
+      size_t offset = start + f->offset + n * f->size;
+      if (offset + f->size > 8 * len) {
+        break;
+      }
+      int64_t sum = (int64_t)hid_get_bits(a, offset, f->size) +
+                    hid_get_bits(b, offset, f->size);
+      int64_t max = ((int64_t)1 << (f->size - 1)) - 1;
+      int64_t clamped = MAX(MIN(sum, max), -max - 1);
+      hid_set_bits(a, offset, f->size, clamped);
+      hid_set_bits(b, offset, f->size, sum - clamped);
+      absorbed = absorbed && sum == clamped;
+    }
+  }
+  return absorbed;
+}
+
+// Events are sent as asynchronous control transfers, HID_TRANSFERS of them
+// in flight. Whatever arrives meanwhile waits in a queue of HID_QUEUE and is
+// merged into the last queued event where possible, so a pointer stream
+// catches up instead of lagging behind. --hid-rate paces them instead, and
+// --hid-replay sends each at the time given with it.
+#define HID_TRANSFERS 4
+#define HID_QUEUE 64
+#define HID_TIMEOUT_MS 1000
+#define HID_LATENCY_BUCKETS 24
+// devices registered at once, each with its own index
+#define HID_MAX_DEVICES 8
+// the device ignores events right after registering, until it set up the
+// input device
+#define HID_SETTLE_MS 100
+
+struct hid_event {
+  uint64_t stamp;  // ns, when its input happened
+  uint64_t due;    // ns, when to send it, or 0 as soon as possible
+  uint8_t index;   // of the HID device
+  uint8_t length;
+  uint8_t report[HID_MAX_REPORT];
+};
+
+struct hid_xfer {
+  struct hid_pipeline *hid;
+  struct libusb_transfer *transfer;
+  unsigned char buffer[LIBUSB_CONTROL_SETUP_SIZE + HID_MAX_REPORT];
+  uint64_t stamp;
+  bool busy;
+};
+
+struct hid_pipeline {
+  struct aoa_transport *transport;
+  struct hid_layout layouts[HID_MAX_DEVICES];
+  bool registered[HID_MAX_DEVICES];
+  uint64_t ready_at;  // ns, when the device takes events
+  size_t max_report;
+  struct hid_event queue[HID_QUEUE];
+  size_t queue_head, queue_len;
+  struct hid_xfer xfers[HID_TRANSFERS];
+  int busy;
+  bool gone;  // the device went away
+  // --hid-rate, and how late events went out: after their slot, or their due
+  // time with --hid-replay
+  uint64_t period_ns;
+  uint64_t next_slot;  // ns
+  uint64_t jitter_sum_ns, jitter_max_ns;
+  uint64_t jitter_hist[101];  // 10us buckets, the last one for the rest
+  // from the input to the device acknowledging it, buckets up to 2^i us
+  uint64_t latency_hist[HID_LATENCY_BUCKETS];
+  uint64_t latency_max_ns;
+  uint64_t events, sent, merged, dropped, failed;
+};
+
+static void hid_event_cb(struct libusb_transfer *transfer) {
+  struct hid_xfer *xfer = transfer->user_data;
+  struct hid_pipeline *hid = xfer->hid;
+  xfer->busy = false;
+  hid->busy--;
+  if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+    uint64_t now = now_ns();
+    uint64_t latency = now > xfer->stamp ? now - xfer->stamp : 0;
+    size_t bucket = 0;
+    while (bucket < HID_LATENCY_BUCKETS - 1 &&
+           latency >= 1000ull << bucket) {
+      bucket++;
+    }
+    hid->latency_hist[bucket]++;
+    hid->latency_max_ns = MAX(hid->latency_max_ns, latency);
+    hid->sent++;
+    return;
+  }
+  hid->failed++;
+  if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+    hid->gone = true;
+  } else if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+    fprintf(stderr, "error sending a HID event: %s\n",
+            transfer_status_name(transfer->status));
+  }
+}
+
+// Queue an event, merged into the last queued one if it can. A merged event
+// keeps the older stamp; events due at a given time are never merged. What
+// did not fit into the last one is queued after it. Returns false, and counts
+// it as dropped, if that found the queue full.
+static bool hid_enqueue(struct hid_pipeline *hid, const struct hid_event *event) {
+  struct hid_event rest = *event;
+  hid->events++;
+  if (hid->queue_len > 0 && event->due == 0) {
+    struct hid_event *last =
+        &hid->queue[(hid->queue_head + hid->queue_len - 1) % HID_QUEUE];
+    if (last->index == event->index && last->due == 0 &&
+        last->length == event->length &&
+        hid_merge(&hid->layouts[event->index], last->report, rest.report,
+                  event->length)) {
+      hid->merged++;
+      return true;
+    }
+  }
+  if (hid->queue_len == HID_QUEUE) {
+    hid->dropped++;
+    return false;
+  }
+  hid->queue[(hid->queue_head + hid->queue_len) % HID_QUEUE] = rest;
+  hid->queue_len++;
+  return true;
+}
+
+static void hid_record_late(struct hid_pipeline *hid, uint64_t late) {
+  hid->jitter_sum_ns += late;
+  hid->jitter_max_ns = MAX(hid->jitter_max_ns, late);
+  hid->jitter_hist[MIN(late / 10000, 100)]++;
+}
+
+// Send queued events while transfers, the device and the schedule allow.
+static void hid_submit(struct hid_pipeline *hid, uint64_t now) {
+  if (now < hid->ready_at) {
+    return;
+  }
+  for (int i = 0; i < HID_TRANSFERS && hid->queue_len > 0 && !hid->gone; i++) {
+    struct hid_xfer *xfer = &hid->xfers[i];
+    if (xfer->busy) {
+      continue;
+    }
+    struct hid_event *e = &hid->queue[hid->queue_head];
+    if (e->due != 0) {
+      if (now < e->due) {
+        return;
+      }
+      hid_record_late(hid, now - e->due);
+    } else if (hid->period_ns != 0) {
+      if (now < hid->next_slot) {
+        return;
+      }
+      hid_record_late(hid, now - hid->next_slot);
+      // a fixed schedule, unless it fell behind by more than a period
+      hid->next_slot += hid->period_ns;
+      if (hid->next_slot < now) {
+        hid->next_slot = now + hid->period_ns;
+      }
+    }
+    libusb_fill_control_setup(xfer->buffer,
+                              LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_ENDPOINT_OUT,
+                              57, e->index, 0, e->length);
+    memcpy(xfer->buffer + LIBUSB_CONTROL_SETUP_SIZE, e->report, e->length);
+    xfer->stamp = e->stamp;
+    libusb_fill_control_transfer(xfer->transfer, hid->transport->device,
+                                 xfer->buffer, hid_event_cb, xfer,
+                                 HID_TIMEOUT_MS);
+    int r = hid->transport->ops->submit(hid->transport, xfer->transfer);
+    if (r != 0) {
+      fprintf(stderr, "error sending a HID event: %s\n", libusb_error_name(r));
+      hid->gone = r == LIBUSB_ERROR_NO_DEVICE;
+      hid->failed++;
+    } else {
+      xfer->busy = true;
+      hid->busy++;
+    }
+    hid->queue_head = (hid->queue_head + 1) % HID_QUEUE;
+    hid->queue_len--;
+  }
+}
+
+static void hid_print_stats(struct hid_pipeline *hid) {
+  fprintf(stderr, "HID: %" PRIu64 " events read, %" PRIu64 " sent, %" PRIu64
+          " merged, %" PRIu64 " dropped, %" PRIu64 " failed\n", hid->events,
+          hid->sent, hid->merged, hid->dropped, hid->failed);
+  if (hid->sent > 0) {
+    fprintf(stderr, "HID: latency from input to the device, max %.1f us\n",
+            hid->latency_max_ns / 1e3);
+    for (size_t i = 0; i < HID_LATENCY_BUCKETS; i++) {
+      if (hid->latency_hist[i] == 0) {
+        continue;
+      }
+      fprintf(stderr, "  %s %8llu us: %10" PRIu64 " %5.1f%%\n",
+              i < HID_LATENCY_BUCKETS - 1 ? "<" : ">=",
+              1ull << MIN(i, HID_LATENCY_BUCKETS - 2), hid->latency_hist[i],
+              100.0 * hid->latency_hist[i] / hid->sent);
+    }
+  }
+  uint64_t paced = 0;
+  for (size_t i = 0; i <= 100; i++) {
+    paced += hid->jitter_hist[i];
+  }
+  if (paced == 0) {
+    return;
+  }
+  uint64_t seen = 0;
+  size_t p99 = 0;
+  while (p99 < 100 &&
+         (seen += hid->jitter_hist[p99]) < (paced * 99 + 99) / 100) {
+    p99++;
+  }
+  fprintf(stderr, "HID: %s mean %.1f us, p99 < %zu us, max %.1f us\n",
+          hid->period_ns != 0 ? "pacing jitter" : "replay drift",
+          hid->jitter_sum_ns / 1e3 / paced, (p99 + 1) * 10,
+          hid->jitter_max_ns / 1e3);
+}
+
+// Register the report descriptor with the device, as requests 54 and 56.
+static int hid_register(struct aoa_transport *transport, uint8_t hid_index,
+                        uint8_t *desc, size_t len) {
+  uint16_t max_packet_size = transport->desc.bMaxPacketSize0;
+  int r = aoa_control(transport,
+                      LIBUSB_REQUEST_TYPE_VENDOR |
+                          LIBUSB_TRANSFER_TYPE_CONTROL |
+                          LIBUSB_ENDPOINT_OUT,
+                      54, hid_index, len, desc, 0, HID_TIMEOUT_MS);
+
+  for (size_t offset = 0; r >= 0 && offset < len; offset += max_packet_size) {
+    r = aoa_control(transport,
+                    LIBUSB_REQUEST_TYPE_VENDOR |
+                        LIBUSB_TRANSFER_TYPE_CONTROL |
+                        LIBUSB_ENDPOINT_OUT,
+                    56, hid_index, offset, desc + offset,
+                    MIN(len - offset, max_packet_size), HID_TIMEOUT_MS);
+  }
+  return r < 0 ? r : 0;
+}
+
+static struct hid_pipeline *hid_pipeline_new(struct aoa_transport *transport,
+                                             struct arguments *arguments) {
+  struct hid_pipeline *hid = calloc(1, sizeof(struct hid_pipeline));
+  if (hid == NULL) {
+    fprintf(stderr, "could not allocate the HID buffers\n");
+    return NULL;
+  }
+  hid->transport = transport;
+  hid->max_report = MIN(transport->desc.bMaxPacketSize0, HID_MAX_REPORT);
+  for (int i = 0; i < HID_TRANSFERS; i++) {
+    hid->xfers[i].hid = hid;
+    hid->xfers[i].transfer = libusb_alloc_transfer(0);
+    if (hid->xfers[i].transfer == NULL) {
+      fprintf(stderr, "could not allocate transfers\n");
+      libusb_exit(NULL);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (arguments->hid_rate != 0) {
+    hid->period_ns = 1000000000ull / arguments->hid_rate;
+  }
+  return hid;
+}
+
+// Register a HID device with the next index. Its events are held back until
+// the device had time to set it up, but not the input.
+static int hid_pipeline_add(struct hid_pipeline *hid, uint8_t *desc,
+                            size_t len) {
+  size_t index = 0;
+  while (index < HID_MAX_DEVICES && hid->registered[index]) {
+    index++;
+  }
+  if (index == HID_MAX_DEVICES) {
+    fprintf(stderr, "at most %d HID devices\n", HID_MAX_DEVICES);
+    return -1;
+  }
+  int r = hid_register(hid->transport, index, desc, len);
+  if (r < 0) {
+    fprintf(stderr, "error registering the HID device: %s\n",
+            libusb_error_name(r));
+    return -1;
+  }
+  hid->registered[index] = true;
+  hid_parse_descriptor(desc, len, &hid->layouts[index]);
+  hid->ready_at = now_ns() + HID_SETTLE_MS * 1000000ull;
+  hid->next_slot = hid->ready_at;
+  return index;
+}
+
+// Where the events come from: stdin or an input device.
+struct hid_source {
+  int fd;
+  bool eof;  // and everything read is queued
+  // Read what is there if readable, and queue what fits. false on errors.
+  bool (*fill)(struct hid_source *source, struct hid_pipeline *hid,
+               bool readable);
+};
+
+// Send what the sources produce until they end, the device goes away or
+// SIGINT.
+static void hid_run(struct hid_pipeline *hid, struct hid_source **sources,
+                    size_t num_sources) {
+  struct aoa_transport *transport = hid->transport;
+  struct watch watch_sources[HID_MAX_DEVICES];
+  bool readable[HID_MAX_DEVICES] = {false};
+  for (size_t i = 0; i < num_sources; i++) {
+    watch_init(&watch_sources[i]);
+  }
+
+  while (!hid->gone) {
+    bool failed = false, eof = true;
+    for (size_t i = 0; i < num_sources; i++) {
+      failed |= !sources[i]->fill(sources[i], hid, readable[i]);
+      eof &= sources[i]->eof;
+    }
+    if (failed || (eof && hid->queue_len == 0 && hid->busy == 0)) {
+      break;
+    }
+    uint64_t now = now_ns();
+    hid_submit(hid, now);
+
+    if (transport->ops->watch != NULL) {
+      transport->ops->watch(transport);
+    }
+    for (size_t i = 0; i < num_sources; i++) {
+      watch_set(&watch_sources[i], sources[i]->fd,
+                sources[i]->eof || hid->queue_len == HID_QUEUE ? 0 : EPOLLIN);
+    }
+    uint64_t deadline = now + 1000000000ull;
+    struct timeval tv;
+    if (libusb_get_next_timeout(NULL, &tv) == 1) {
+      deadline = MIN(deadline, now + tv.tv_sec * 1000000000ull +
+                                   tv.tv_usec * 1000ull);
+    }
+    if (hid->queue_len > 0 && hid->busy < HID_TRANSFERS) {
+      struct hid_event *e = &hid->queue[hid->queue_head];
+      if (now < hid->ready_at) {
+        deadline = MIN(deadline, hid->ready_at);
+      } else if (e->due != 0) {
+        deadline = MIN(deadline, e->due);
+      } else if (hid->period_ns != 0) {
+        deadline = MIN(deadline, hid->next_slot);
+      }
+    }
+    if (!loop_wait_until(deadline)) {
+      break;
+    }
+    if (loop.usb_ready || loop.num_events == 0) {
+      struct timeval zero_tv = {0, 0};
+      libusb_handle_events_timeout(NULL, &zero_tv);
+    }
+    if (transport->ops->dispatch != NULL) {
+      transport->ops->dispatch(transport);
+    }
+    for (size_t i = 0; i < num_sources; i++) {
+      readable[i] = watch_sources[i].revents != 0;
+    }
+  }
+  for (size_t i = 0; i < num_sources; i++) {
+    watch_del(&watch_sources[i]);
+  }
+
+  // cancel what is still in flight, e.g. after SIGINT
+  for (int i = 0; i < HID_TRANSFERS; i++) {
+    if (hid->xfers[i].busy) {
+      transport->ops->cancel(transport, hid->xfers[i].transfer);
+    }
+  }
+  while (hid->busy > 0) {
+    struct timeval tv = {1, 0};
+    if (transport->ops->handle_events(transport, &tv) < 0) {
+      break;
+    }
+  }
+  hid_print_stats(hid);
+
+  for (size_t i = 0; i < HID_MAX_DEVICES && !hid->gone; i++) {
+    if (hid->registered[i]) {
+      aoa_control(transport,
+                  LIBUSB_REQUEST_TYPE_VENDOR |
+                      LIBUSB_TRANSFER_TYPE_CONTROL |
+                      LIBUSB_ENDPOINT_OUT,
+                  55, i, 0, NULL, 0, HID_TIMEOUT_MS);
+    }
+  }
+}
+
+static void hid_pipeline_free(struct hid_pipeline *hid) {
+  // transfers that would not cancel are leaked with it
+  if (hid->busy > 0) {
+    return;
+  }
+  for (int i = 0; i < HID_TRANSFERS; i++) {
+    libusb_free_transfer(hid->xfers[i].transfer);
+  }
+  free(hid);
+}
+
+struct hid_stdin {
+  struct hid_source source;
+  struct arguments *arguments;
+  struct hid_input in;
+  uint8_t *frame;
+  uint8_t index;
+};
+
+static bool hid_stdin_fill(struct hid_source *source, struct hid_pipeline *hid,
+                           bool readable) {
+  struct hid_stdin *s = (struct hid_stdin *)source;
+  if (readable) {
+    hid_input_read(&s->in);
+  }
+  uint64_t now = now_ns();
+  size_t len;
+  int r;
+  while (hid->queue_len < HID_QUEUE &&
+         (r = hid_next_frame(s->arguments, &s->in, s->frame, &len)) != 0) {
+    if (r < 0) {
+      source->eof = s->in.eof = true;
+      break;
+    }
+    if (len > hid->max_report) {
+      fprintf(stderr, "event size too big for AOA (length: %zu, max: %zu)\n",
+              len, hid->max_report);
+      return false;
+    }
+    struct hid_event e = {.stamp = now, .index = s->index, .length = len};
+    memcpy(e.report, s->frame, len);
+    if (!hid_enqueue(hid, &e)) {
+      break;
+    }
+  }
+  return true;
+}
+
+static void aoa_hid(struct aoa_transport *transport, struct arguments *arguments) {
+  int r = 0;
+
+  struct hid_stdin s;
+  memset(&s, 0, sizeof(s));
+  s.source.fd = STDIN_FILENO;
+  s.source.fill = hid_stdin_fill;
+  s.arguments = arguments;
+  s.in.buf = malloc(HID_INPUT_SIZE + 1);
+  s.frame = malloc(HID_MAX_FRAME);
+  if (s.in.buf == NULL || s.frame == NULL) {
+    fprintf(stderr, "could not allocate the HID buffers\n");
+    free(s.in.buf);
+    free(s.frame);
+    return;
+  }
+
+  size_t frame_len = 0;
+  while ((r = hid_next_frame(arguments, &s.in, s.frame, &frame_len)) == 0) {
+    hid_input_read(&s.in);
+  }
+  struct hid_pipeline *hid = NULL;
+  if (r < 0) {
+    fprintf(stderr, "no HID descriptor on stdin\n");
+  } else if ((hid = hid_pipeline_new(transport, arguments)) != NULL &&
+             (r = hid_pipeline_add(hid, s.frame, frame_len)) >= 0) {
+    fprintf(stderr, "registered HID device (len=%zu)\n", frame_len);
+    fflush(stderr);
+    s.index = r;
+    struct hid_source *source = &s.source;
+    hid_run(hid, &source, 1);
+  }
+  if (hid != NULL) {
+    hid_pipeline_free(hid);
+  }
+  free(s.frame);
+  free(s.in.buf);
+}
+
+// --hid-replay: stdin has lines of
+//   descriptor INDEX BASE64
+// registering the HID device INDEX, all before the first of
+//   SECONDS INDEX BASE64
+// each an event for the device INDEX, sent SECONDS after the devices are
+// set up. Empty lines and those starting with # are skipped.
+struct hid_replay {
+  struct hid_source source;
+  struct hid_input in;
+  char *text;  // the current line, NUL terminated
+  uint8_t *frame;
+  uint8_t indexes[HID_MAX_DEVICES];  // of the input to the pipeline
+  bool known[HID_MAX_DEVICES];
+  size_t line;
+  double last;
+};
+
+// Take the next line that is not empty or a comment into text. Returns like
+// hid_input_line.
+static int hid_replay_line(struct hid_replay *r, char **line) {
+  char *p;
+  size_t length;
+  int ret;
+  while ((ret = hid_input_line(&r->in, &p, &length)) > 0) {
+    r->line++;
+    length -= p[length - 1] == '\n';
+    memcpy(r->text, p, length);
+    r->text[length] = '\0';
+    *line = r->text + strspn(r->text, " \t\r");
+    if (**line != '\0' && **line != '#') {
+      return 1;
+    }
+  }
+  return ret;
+}
+
+// Parse "INDEX BASE64" into the frame, returning its length or -1.
+static ssize_t hid_replay_frame(struct hid_replay *r, char *p,
+                                unsigned long *index) {
+  char *end;
+  *index = strtoul(p, &end, 10);
+  if (end == p || *index >= HID_MAX_DEVICES || (*end != ' ' && *end != '\t')) {
+    return -1;
+  }
+  end += strspn(end, " \t");
+  size_t length = strlen(end);
+  if (length / 4 * 3 + 2 > HID_MAX_FRAME) {
+    return -1;
+  }
+  return base64_decode(end, length, r->frame);
+}
+
+static bool hid_replay_fill(struct hid_source *source, struct hid_pipeline *hid,
+                            bool readable) {
+  struct hid_replay *r = (struct hid_replay *)source;
+  if (readable) {
+    hid_input_read(&r->in);
+  }
+  char *line;
+  int ret;
+  while (hid->queue_len < HID_QUEUE && (ret = hid_replay_line(r, &line)) != 0) {
+    if (ret < 0) {
+      source->eof = true;
+      break;
+    }
+    char *end;
+    double seconds = strtod(line, &end);
+    unsigned long index;
+    ssize_t len = end == line ? -1 : hid_replay_frame(r, end, &index);
+    if (len < 0 || !r->known[index] || !isfinite(seconds) ||
+        seconds < r->last ||
+        seconds * 1e9 >= (double)(UINT64_MAX - hid->ready_at)) {
+      fprintf(stderr, "invalid replay event in line %zu: %s\n", r->line, line);
+      return false;
+    }
+    if ((size_t)len > hid->max_report) {
+      fprintf(stderr, "event size too big for AOA (length: %zd, max: %zu)\n",
+              len, hid->max_report);
+      return false;
+    }
+    r->last = seconds;
+    struct hid_event e = {
+        .index = r->indexes[index],
+        .length = len,
+        // the schedule starts once the devices are set up
+        .due = hid->ready_at + (uint64_t)(seconds * 1e9),
+    };
+    e.stamp = e.due;
+    memcpy(e.report, r->frame, len);
+    if (!hid_enqueue(hid, &e)) {
+      break;
+    }
+  }
+  return true;
+}
+
+static void aoa_hid_replay(struct aoa_transport *transport,
+                           struct arguments *arguments) {
+  struct hid_replay r;
+  memset(&r, 0, sizeof(r));
+  r.source.fd = STDIN_FILENO;
+  r.source.fill = hid_replay_fill;
+  r.in.buf = malloc(HID_INPUT_SIZE + 1);
+  r.text = malloc(HID_INPUT_SIZE + 1);
+  r.frame = malloc(HID_MAX_FRAME);
+  struct hid_pipeline *hid = hid_pipeline_new(transport, arguments);
+  if (r.in.buf == NULL || r.text == NULL || r.frame == NULL || hid == NULL) {
+    goto out;
+  }
+
+  // the descriptors, up to the first event
+  size_t devices = 0;
+  while (true) {
+    char *line;
+    int ret;
+    size_t start = r.in.start, line_number = r.line;
+    while ((ret = hid_replay_line(&r, &line)) == 0) {
+      hid_input_read(&r.in);
+      start = r.in.start;
+    }
+    if (ret < 0) {
+      break;
+    }
+    if (strncmp(line, "descriptor", 10) != 0) {
+      // an event, leave it for hid_replay_fill
+      r.in.start = start;
+      r.line = line_number;
+      break;
+    }
+    unsigned long index;
+    ssize_t len = hid_replay_frame(&r, line + 10, &index);
+    if (len <= 0 || r.known[index]) {
+      fprintf(stderr, "invalid replay descriptor in line %zu\n", r.line);
+      goto out;
+    }
+    int i = hid_pipeline_add(hid, r.frame, len);
+    if (i < 0) {
+      goto out;
+    }
+    r.known[index] = true;
+    r.indexes[index] = i;
+    devices++;
+  }
+  if (devices == 0) {
+    fprintf(stderr, "no HID descriptor in the replay\n");
+    goto out;
+  }
+  fprintf(stderr, "registered %zu HID devices for the replay\n", devices);
+  fflush(stderr);
+
+  struct hid_source *source = &r.source;
+  hid_run(hid, &source, 1);
+
+out:
+  if (hid != NULL) {
+    hid_pipeline_free(hid);
+  }
+  free(r.frame);
+  free(r.text);
+  free(r.in.buf);
+}
+
+// --evdev: a local keyboard, mouse or touchscreen, described to the device
+// with one of these and translated into their reports here.
+static const uint8_t hid_keyboard_desc[] = {
+  0x05, 0x01, 0x09, 0x06, 0xa1, 0x01,  // Generic Desktop, Keyboard
+  0x05, 0x07, 0x19, 0xe0, 0x29, 0xe7, 0x15, 0x00, 0x25, 0x01,
+  0x75, 0x01, 0x95, 0x08, 0x81, 0x02,  // 8 modifier bits
+  0x95, 0x01, 0x75, 0x08, 0x81, 0x01,  // reserved
+  0x95, 0x06, 0x75, 0x08, 0x15, 0x00, 0x25, 0x73,
+  0x05, 0x07, 0x19, 0x00, 0x29, 0x73, 0x81, 0x00,  // 6 keys
+  0xc0,
+};
+
+static const uint8_t hid_mouse_desc[] = {
+  0x05, 0x01, 0x09, 0x02, 0xa1, 0x01,  // Generic Desktop, Mouse
+  0x09, 0x01, 0xa1, 0x00,              // Pointer
+  0x05, 0x09, 0x19, 0x01, 0x29, 0x05, 0x15, 0x00, 0x25, 0x01,
+  0x95, 0x05, 0x75, 0x01, 0x81, 0x02,  // 5 buttons
+  0x95, 0x01, 0x75, 0x03, 0x81, 0x01,  // padding
+  0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x16, 0x01, 0x80, 0x26, 0xff, 0x7f,
+  0x75, 0x10, 0x95, 0x02, 0x81, 0x06,  // relative X and Y, 16 bit
+  0x09, 0x38, 0x15, 0x81, 0x25, 0x7f,
+  0x75, 0x08, 0x95, 0x01, 0x81, 0x06,  // relative wheel
+  0xc0, 0xc0,
+};
+
+static const uint8_t hid_touch_desc[] = {
+  0x05, 0x0d, 0x09, 0x04, 0xa1, 0x01,  // Digitizer, Touch Screen
+  0x09, 0x22, 0xa1, 0x02,              // Finger
+  0x09, 0x42, 0x15, 0x00, 0x25, 0x01,
+  0x75, 0x01, 0x95, 0x01, 0x81, 0x02,  // tip switch
+  0x95, 0x07, 0x81, 0x01,              // padding
+  0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x15, 0x00, 0x26, 0xff, 0x7f,
+  0x75, 0x10, 0x95, 0x02, 0x81, 0x02,  // absolute X and Y, 0 to 32767
+  0xc0, 0xc0,
+};
+
+// HID keyboard usages 0x00 to 0x73 as Linux key codes
+static const uint8_t hid_keyboard_keys[] = {
+    0,   0,   0,   0,  30,  48,  46,  32,  18,  33,  34,  35,  23,  36,  37,  38,
+   50,  49,  24,  25,  16,  19,  31,  20,  22,  47,  17,  45,  21,  44,   2,   3,
+    4,   5,   6,   7,   8,   9,  10,  11,  28,   1,  14,  15,  57,  12,  13,  26,
+   27,  43,  43,  39,  40,  41,  51,  52,  53,  58,  59,  60,  61,  62,  63,  64,
+   65,  66,  67,  68,  87,  88,  99,  70, 119, 110, 102, 104, 111, 107, 109, 106,
+  105, 108, 103,  69,  98,  55,  74,  78,  96,  79,  80,  81,  75,  76,  77,  71,
+   72,  73,  82,  83,  86, 127, 116, 117, 183, 184, 185, 186, 187, 188, 189, 190,
+  191, 192, 193, 194,
+};
+
+// the modifiers, usages 0xe0 to 0xe7
+static const uint16_t hid_keyboard_modifiers[] = {
+  KEY_LEFTCTRL, KEY_LEFTSHIFT, KEY_LEFTALT, KEY_LEFTMETA,
+  KEY_RIGHTCTRL, KEY_RIGHTSHIFT, KEY_RIGHTALT, KEY_RIGHTMETA,
+};
+
+enum hid_evdev_kind {
+  HID_EVDEV_KEYBOARD,
+  HID_EVDEV_MOUSE,
+  HID_EVDEV_TOUCH,
+};
+
+struct hid_evdev {
+  struct hid_source source;
+  const char *path;
+  uint8_t index;
+  enum hid_evdev_kind kind;
+  uint8_t usages[KEY_CNT];  // key code to keyboard usage
+  struct input_absinfo abs_x, abs_y;
+  bool dropped;  // events were lost, skip to the next SYN_REPORT
+  bool changed;
+  uint64_t stamp;  // the first event of this report
+  // the state so far
+  uint8_t modifiers, keys[6];
+  uint8_t buttons;
+  int32_t dx, dy, wheel;
+  int32_t x, y;
+};
+
+static void put_le16(uint8_t *p, int32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static int32_t hid_evdev_scale(int32_t v, const struct input_absinfo *abs) {
+  if (abs->maximum <= abs->minimum) {
+    return 0;
+  }
+  v = MIN(MAX(v, abs->minimum), abs->maximum);
+  return (int64_t)(v - abs->minimum) * 32767 / (abs->maximum - abs->minimum);
+}
+
+static void hid_evdev_key(struct hid_evdev *e, uint16_t code, int32_t value) {
+  if (value == 2) {
+    return;  // autorepeat, the device does its own
+  }
+  switch (e->kind) {
+  case HID_EVDEV_KEYBOARD:
+    for (size_t i = 0; i < 8; i++) {
+      if (code == hid_keyboard_modifiers[i]) {
+        e->modifiers = value ? e->modifiers | 1 << i : e->modifiers & ~(1 << i);
+        e->changed = true;
+        return;
+      }
+    }
+    if (code >= KEY_CNT || e->usages[code] == 0) {
+      return;
+    }
+    for (size_t i = 0; i < sizeof(e->keys); i++) {
+      if (value && e->keys[i] == 0) {
+        e->keys[i] = e->usages[code];
+        e->changed = true;
+        return;
+      }
+      if (!value && e->keys[i] == e->usages[code]) {
+        memmove(e->keys + i, e->keys + i + 1, sizeof(e->keys) - i - 1);
+        e->keys[sizeof(e->keys) - 1] = 0;
+        e->changed = true;
+        return;
+      }
+    }
+    break;
+  case HID_EVDEV_MOUSE:
+    if (code >= BTN_LEFT && code <= BTN_EXTRA) {
+      uint8_t bit = 1 << (code - BTN_LEFT);
+      e->buttons = value ? e->buttons | bit : e->buttons & ~bit;
+      e->changed = true;
+    }
+    break;
+  case HID_EVDEV_TOUCH:
+    if (code == BTN_TOUCH) {
+      e->buttons = value != 0;
+      e->changed = true;
+    }
+    break;
+  }
+}
+
+static void hid_evdev_report(struct hid_evdev *e, struct hid_pipeline *hid) {
+  uint8_t report[8];
+  size_t len = 0;
+  switch (e->kind) {
+  case HID_EVDEV_KEYBOARD:
+    report[0] = e->modifiers;
+    report[1] = 0;
+    memcpy(report + 2, e->keys, sizeof(e->keys));
+    len = 8;
+    break;
+  case HID_EVDEV_MOUSE:
+    report[0] = e->buttons;
+    put_le16(report + 1, MIN(MAX(e->dx, -32767), 32767));
+    put_le16(report + 3, MIN(MAX(e->dy, -32767), 32767));
+    report[5] = MIN(MAX(e->wheel, -127), 127);
+    len = 6;
+    break;
+  case HID_EVDEV_TOUCH:
+    report[0] = e->buttons;
+    put_le16(report + 1, hid_evdev_scale(e->x, &e->abs_x));
+    put_le16(report + 3, hid_evdev_scale(e->y, &e->abs_y));
+    len = 5;
+    break;
+  }
+  struct hid_event event = {.stamp = e->stamp, .index = e->index, .length = len};
+  memcpy(event.report, report, len);
+  if (!hid_enqueue(hid, &event)) {
+    // still changed, goes out with the next report
+    return;
+  }
+  e->dx = e->dy = e->wheel = 0;
+  e->changed = false;
+}
+
+static bool hid_evdev_fill(struct hid_source *source, struct hid_pipeline *hid,
+                           bool readable) {
+  struct hid_evdev *e = (struct hid_evdev *)source;
+  if (!readable || hid->queue_len == HID_QUEUE) {
+    return true;
+  }
+  // a report needs a SYN_REPORT of its own, so no more events than there are
+  // free slots make no more reports than fit
+  struct input_event events[HID_QUEUE];
+  size_t room = HID_QUEUE - hid->queue_len;
+  ssize_t b = read(source->fd, events, room * sizeof(struct input_event));
+  if (b < 0) {
+    if (errno == EAGAIN || errno == EINTR) {
+      return true;
+    }
+    if (errno != ENODEV) {
+      fprintf(stderr, "error reading %s: %s\n", e->path, strerror(errno));
+    }
+    source->eof = true;
+    return true;
+  }
+  if (b == 0) {
+    source->eof = true;
+    return true;
+  }
+
+  for (size_t i = 0; i < b / sizeof(struct input_event); i++) {
+    struct input_event *ev = &events[i];
+    if (ev->type == EV_SYN) {
+      if (ev->code == SYN_DROPPED) {
+        // the state is lost, let everything go
+        e->dropped = true;
+        e->modifiers = e->buttons = 0;
+        memset(e->keys, 0, sizeof(e->keys));
+        e->dx = e->dy = e->wheel = 0;
+        e->changed = true;
+      } else if (ev->code == SYN_REPORT) {
+        e->dropped = false;
+        if (e->changed) {
+          hid_evdev_report(e, hid);
+        }
+      }
+      continue;
+    }
+    if (e->dropped) {
+      continue;
+    }
+    if (!e->changed) {
+      e->stamp = (uint64_t)ev->input_event_sec * 1000000000 +
+                 (uint64_t)ev->input_event_usec * 1000;
+    }
+    switch (ev->type) {
+    case EV_KEY:
+      hid_evdev_key(e, ev->code, ev->value);
+      break;
+    case EV_REL:
+      if (e->kind == HID_EVDEV_MOUSE) {
+        if (ev->code == REL_X) {
+          e->dx += ev->value;
+        } else if (ev->code == REL_Y) {
+          e->dy += ev->value;
+        } else if (ev->code == REL_WHEEL) {
+          e->wheel += ev->value;
+        } else {
+          break;
+        }
+        e->changed = true;
+      }
+      break;
+    case EV_ABS:
+      if (e->kind == HID_EVDEV_TOUCH) {
+        if (ev->code == ABS_X) {
+          e->x = ev->value;
+        } else if (ev->code == ABS_Y) {
+          e->y = ev->value;
+        } else {
+          break;
+        }
+        e->changed = true;
+      }
+      break;
+    }
+  }
+  return true;
+}
+
+#define test_bit(bits, bit) \
+  ((bits)[(bit) / (8 * sizeof(long))] >> ((bit) % (8 * sizeof(long))) & 1)
+
+// Open an input device and pick its descriptor. Returns false if it is none
+// of the kinds above.
+static bool hid_evdev_open(struct hid_evdev *e, const char *path,
+                           struct arguments *arguments, const uint8_t **desc,
+                           size_t *desc_len) {
+  e->path = path;
+  e->source.fill = hid_evdev_fill;
+  e->source.fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (e->source.fd < 0) {
+    fprintf(stderr, "could not open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+
+  unsigned long ev_bits[EV_CNT / (8 * sizeof(long)) + 1] = {0};
+  unsigned long key_bits[KEY_CNT / (8 * sizeof(long)) + 1] = {0};
+  unsigned long rel_bits[REL_CNT / (8 * sizeof(long)) + 1] = {0};
+  unsigned long abs_bits[ABS_CNT / (8 * sizeof(long)) + 1] = {0};
+  char name[256] = "";
+  if (ioctl(e->source.fd, EVIOCGBIT(0, sizeof(ev_bits)), ev_bits) < 0) {
+    fprintf(stderr, "%s is not an input device: %s\n", path, strerror(errno));
+    return false;
+  }
+  ioctl(e->source.fd, EVIOCGBIT(EV_KEY, sizeof(key_bits)), key_bits);
+  ioctl(e->source.fd, EVIOCGBIT(EV_REL, sizeof(rel_bits)), rel_bits);
+  ioctl(e->source.fd, EVIOCGBIT(EV_ABS, sizeof(abs_bits)), abs_bits);
+  ioctl(e->source.fd, EVIOCGNAME(sizeof(name) - 1), name);
+
+  static const char *kinds[] = {"keyboard", "mouse", "touchscreen"};
+  if (test_bit(ev_bits, EV_ABS) && test_bit(abs_bits, ABS_X) &&
+      test_bit(abs_bits, ABS_Y) && test_bit(key_bits, BTN_TOUCH)) {
+    e->kind = HID_EVDEV_TOUCH;
+    *desc = hid_touch_desc;
+    *desc_len = sizeof(hid_touch_desc);
+    ioctl(e->source.fd, EVIOCGABS(ABS_X), &e->abs_x);
+    ioctl(e->source.fd, EVIOCGABS(ABS_Y), &e->abs_y);
+  } else if (test_bit(ev_bits, EV_REL) && test_bit(rel_bits, REL_X) &&
+             test_bit(rel_bits, REL_Y) && test_bit(key_bits, BTN_LEFT)) {
+    e->kind = HID_EVDEV_MOUSE;
+    *desc = hid_mouse_desc;
+    *desc_len = sizeof(hid_mouse_desc);
+  } else if (test_bit(ev_bits, EV_KEY) && test_bit(key_bits, KEY_A)) {
+    e->kind = HID_EVDEV_KEYBOARD;
+    *desc = hid_keyboard_desc;
+    *desc_len = sizeof(hid_keyboard_desc);
+    for (size_t u = sizeof(hid_keyboard_keys); u-- > 0;) {
+      e->usages[hid_keyboard_keys[u]] = u;
+    }
+    e->usages[0] = 0;
+  } else {
+    fprintf(stderr, "%s (%s) is neither a keyboard, a mouse nor a "
+            "touchscreen\n", path, name);
+    return false;
+  }
+
+  // event times comparable to now_ns(), for the latency
+  int clock = CLOCK_MONOTONIC;
+  if (ioctl(e->source.fd, EVIOCSCLOCKID, &clock) < 0) {
+    fprintf(stderr, "warning: no monotonic event times, the latency is "
+            "meaningless\n");
+  }
+  if (arguments->grab && ioctl(e->source.fd, EVIOCGRAB, 1) < 0) {
+    fprintf(stderr, "could not grab %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  fprintf(stderr, "%s (%s) is a %s\n", path, name, kinds[e->kind]);
+  return true;
+}
+
+static void aoa_evdev(struct aoa_transport *transport,
+                      struct arguments *arguments) {
+  struct hid_evdev *devices = calloc(arguments->num_evdev,
+                                     sizeof(struct hid_evdev));
+  struct hid_source *sources[HID_MAX_DEVICES];
+  struct hid_pipeline *hid = hid_pipeline_new(transport, arguments);
+  size_t opened = 0;
+  if (devices == NULL || hid == NULL) {
+    goto out;
+  }
+  for (; opened < arguments->num_evdev; opened++) {
+    struct hid_evdev *e = &devices[opened];
+    const uint8_t *desc;
+    size_t desc_len;
+    bool ok = hid_evdev_open(e, arguments->evdev[opened], arguments, &desc,
+                             &desc_len);
+    int index = ok ? hid_pipeline_add(hid, (uint8_t *)desc, desc_len) : -1;
+    if (index < 0) {
+      if (e->source.fd >= 0) {
+        close(e->source.fd);
+      }
+      goto out;
+    }
+    e->index = index;
+    sources[opened] = &e->source;
+  }
+  fprintf(stderr, "registered %zu HID devices\n", opened);
+  fflush(stderr);
+  hid_run(hid, sources, opened);
+
+out:
+  for (size_t i = 0; i < opened; i++) {
+    close(devices[i].source.fd);
+  }
+  if (hid != NULL) {
+    hid_pipeline_free(hid);
+  }
+  free(devices);
+}
+
+// --audio-stream: the device sends what it plays over isochronous transfers,
+// one packet per 1 ms frame. Their callbacks put it into a ring, with
+// --threads from the USB thread, and the loop passes it on to the sink at
+// the nominal rate once --audio-latency of it is buffered. When the ring runs
+// dry, playing waits until that much is there again (an underrun); packets
+// that would fill it beyond twice that are dropped (an overrun). So the delay
+// stays near the target while the clocks of the phone and the sink drift
+// apart.
+#define AUDIO_BYTES_PER_SEC (AUDIO_RATE * AUDIO_FRAME_SIZE)
+#define AUDIO_MAX_PACKETS 8  // per transfer
+#define AUDIO_PERIOD_MS 5    // how often the sink is fed
+#define AUDIO_CANCEL_TIMEOUT_MS 5000
+
+struct aoa_audio {
+  struct aoa_transport *transport;
+  int num_transfers;
+  struct libusb_transfer **transfers;
+  int busy;          // transfers submitted, only touched by the USB side
+  bool stop;         // do not submit again
+  bool failed;       // the device went away or the stream broke
+  struct ring ring;  // PCM, produced by the callbacks, consumed by the loop
+  size_t target;     // --audio-latency in bytes
+  size_t limit;      // packets beyond this are dropped
+  int fd;            // the sink
+  int fd_flags;      // before it was made non-blocking
+  bool playing;      // the target was reached, the sink is fed
+  uint64_t started;  // ns, when playing (re)started
+  uint64_t played;   // bytes handed to the sink since then
+  bool threaded;
+  pthread_t thread;
+  // written by the USB side, read with STAT_GET while it runs
+  uint64_t packets, bytes, packet_errors, overruns, dropped;
+  size_t peak;
+  // written by the loop
+  uint64_t underruns, written;
+};
+
+static int audio_submit(struct aoa_audio *audio,
+                        struct libusb_transfer *transfer) {
+  int r = audio->transport->ops->submit(audio->transport, transfer);
+  if (r != 0) {
+    fprintf(stderr, "error submitting an audio transfer: %s\n",
+            libusb_error_name(r));
+    __atomic_store_n(&audio->failed, true, __ATOMIC_RELAXED);
+    return r;
+  }
+  audio->busy++;
+  return 0;
+}
+
+static void audio_cb(struct libusb_transfer *transfer) {
+  struct aoa_audio *audio = transfer->user_data;
+  audio->busy--;
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+    if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+      fprintf(stderr, "error receiving audio: %s\n",
+              transfer_status_name(transfer->status));
+      __atomic_store_n(&audio->failed, true, __ATOMIC_RELAXED);
+    }
+    return;
+  }
+  for (int i = 0; i < transfer->num_iso_packets; i++) {
+    struct libusb_iso_packet_descriptor *desc = &transfer->iso_packet_desc[i];
+    // whole frames only, so that a dropped packet keeps the channels apart
+    size_t len = desc->actual_length - desc->actual_length % AUDIO_FRAME_SIZE;
+    if (desc->status != LIBUSB_TRANSFER_COMPLETED) {
+      STAT_ADD(audio->packet_errors, 1);
+      continue;
+    }
+    if (len == 0) {
+      continue;
+    }
+    STAT_ADD(audio->packets, 1);
+    STAT_ADD(audio->bytes, len);
+    if (ring_used(&audio->ring) + len > audio->limit) {
+      STAT_ADD(audio->overruns, 1);
+      STAT_ADD(audio->dropped, len);
+      continue;
+    }
+    ring_write(&audio->ring, libusb_get_iso_packet_buffer_simple(transfer, i),
+               len);
+    STAT_PEAK(audio->peak, ring_used(&audio->ring));
+  }
+  if (!__atomic_load_n(&audio->stop, __ATOMIC_ACQUIRE)) {
+    audio_submit(audio, transfer);
+  }
+}
+
+// --threads: handle the transfers until aoa_audio stops it.
+static void *audio_thread(void *arg) {
+  struct aoa_audio *audio = arg;
+  struct aoa_transport *transport = audio->transport;
+  while (!__atomic_load_n(&audio->stop, __ATOMIC_ACQUIRE)) {
+    struct timeval tv = {1, 0};
+    int r = transport->ops->handle_events(transport, &tv);
+    if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+      fprintf(stderr, "error handling USB events: %s\n", libusb_error_name(r));
+      __atomic_store_n(&audio->failed, true, __ATOMIC_RELAXED);
+      break;
+    }
+  }
+  return NULL;
+}
+
+// Hand the sink what is due by now. Returns false once it went away.
+static bool audio_play(struct aoa_audio *audio, uint64_t now) {
+  size_t used = ring_used(&audio->ring);
+  if (!audio->playing) {
+    if (used < audio->target) {
+      return true;
+    }
+    audio->playing = true;
+    audio->started = now;
+    audio->played = 0;
+  }
+  uint64_t due = (now - audio->started) / 1000 * AUDIO_BYTES_PER_SEC / 1000000;
+  due -= due % AUDIO_FRAME_SIZE;
+  size_t want = due - audio->played;
+  size_t n = MIN(want, used);
+  size_t done = 0;
+  while (done < n) {
+    size_t len;
+    const uint8_t *data = ring_peek(&audio->ring, audio->ring.tail, &len);
+    ssize_t w = write(audio->fd, data, MIN(len, n - done));
+    if (w < 0 && errno == EINTR) {
+      continue;
+    }
+    if (w < 0 && errno == EAGAIN) {
+      break;
+    }
+    if (w <= 0) {
+      fprintf(stderr, "error writing the audio: %s\n",
+              w < 0 ? strerror(errno) : "nothing written");
+      return false;
+    }
+    ring_consume(&audio->ring, w);
+    done += w;
+  }
+  STAT_ADD(audio->written, done);
+  audio->played += done;
+  if (done < n) {
+    // the sink is behind and sets the pace until it takes data again
+    audio->played = due;
+  } else if (want > used) {
+    // the device is behind
+    STAT_ADD(audio->underruns, 1);
+    audio->playing = false;
+  }
+  return true;
+}
+
+static void audio_print_stats(struct aoa_audio *audio) {
+  fprintf(stderr, "audio: %" PRIu64 " packets, %" PRIu64 " bytes received, %"
+          PRIu64 " written, %" PRIu64 " packet errors\n"
+          "audio: %" PRIu64 " underruns, %" PRIu64 " overruns (%" PRIu64
+          " bytes dropped), at most %.1f ms buffered\n",
+          STAT_GET(audio->packets), STAT_GET(audio->bytes),
+          STAT_GET(audio->written), STAT_GET(audio->packet_errors),
+          STAT_GET(audio->underruns), STAT_GET(audio->overruns),
+          STAT_GET(audio->dropped),
+          STAT_GET(audio->peak) * 1000.0 / AUDIO_BYTES_PER_SEC);
+}
+
+// --audio-out, made non-blocking. Returns -1 on errors.
+static int audio_open_sink(struct aoa_audio *audio, const char *sink) {
+  int fd;
+  if (strcmp(sink, "-") == 0) {
+    fd = STDOUT_FILENO;
+  } else if (strncmp(sink, "unix:", 5) == 0) {
+    fd = connect_backend(sink);
+  } else {
+    // a FIFO blocks here until its reader opened it
+    fd = open(sink, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      fprintf(stderr, "could not open %s: %s\n", sink, strerror(errno));
+    }
+  }
+  if (fd < 0) {
+    return -1;
+  }
+  audio->fd_flags = fcntl(fd, F_GETFL);
+  fcntl(fd, F_SETFL, audio->fd_flags | O_NONBLOCK);
+  // a pipe that holds no more than the target makes a slow reader show up
+  // as overruns instead of as delay, the kernel rounds it up to a page
+  fcntl(fd, F_SETPIPE_SZ, (int)audio->target);
+  return fd;
+}
+
+static void aoa_audio(struct aoa_transport *transport,
+                      struct arguments *arguments) {
+  uint8_t endpoint;
+  int packet_size;
+  if (transport->ops->claim_audio(transport, &endpoint, &packet_size) != 0) {
+    return;
+  }
+  if (packet_size <= 0) {
+    fprintf(stderr, "error reading the audio packet size: %s\n",
+            libusb_error_name(packet_size));
+    transport->ops->release_audio(transport);
+    return;
+  }
+
+  struct aoa_audio audio;
+  memset(&audio, 0, sizeof(audio));
+  audio.transport = transport;
+  audio.num_transfers = arguments->transfers;
+  audio.target = arguments->audio_latency * AUDIO_BYTES_PER_SEC / 1000;
+  audio.target -= audio.target % AUDIO_FRAME_SIZE;
+  // shorter transfers for a small target, so that it outlasts one of them
+  int packets = MAX(1, MIN(AUDIO_MAX_PACKETS, (int)arguments->audio_latency / 2));
+  audio.limit = 2 * audio.target + audio.num_transfers * packets * packet_size;
+  audio.transfers = calloc(audio.num_transfers, sizeof(struct libusb_transfer *));
+  if (audio.transfers == NULL || ring_init(&audio.ring, audio.limit) != 0) {
+    fprintf(stderr, "could not allocate transfers\n");
+    libusb_exit(NULL);
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < audio.num_transfers; i++) {
+    struct libusb_transfer *transfer = libusb_alloc_transfer(packets);
+    uint8_t *buffer = malloc(packets * packet_size);
+    if (transfer == NULL || buffer == NULL) {
+      fprintf(stderr, "could not allocate transfers\n");
+      libusb_exit(NULL);
+      exit(EXIT_FAILURE);
+    }
+    libusb_fill_iso_transfer(transfer, transport->device, endpoint, buffer,
+                             packets * packet_size, packets, audio_cb, &audio,
+                             0);
+    libusb_set_iso_packet_lengths(transfer, packet_size);
+    audio.transfers[i] = transfer;
+  }
+
+  // a vanished reader shows up as EPIPE from write()
+  signal(SIGPIPE, SIG_IGN);
+  audio.fd = audio_open_sink(&audio, arguments->audio_out);
+  for (int i = 0; i < audio.num_transfers && audio.fd >= 0; i++) {
+    if (audio_submit(&audio, audio.transfers[i]) != 0) {
+      break;
+    }
+  }
+  if (audio.fd >= 0 && !audio.failed) {
+    fprintf(stderr, "audio: endpoint 0x%02x, %d transfers of %d packets, "
+            "%lu ms latency\n", endpoint, audio.num_transfers, packets,
+            arguments->audio_latency);
+    fflush(stderr);
+  }
+  // started once the transfers are submitted, the simulated device is not
+  // thread safe
+  if (arguments->threads && audio.busy > 0) {
+    loop_release_usb();
+    audio.threaded = true;
+    int r = pthread_create(&audio.thread, NULL, audio_thread, &audio);
+    if (r != 0) {
+      fprintf(stderr, "could not start the USB thread: %s\n", strerror(r));
+      audio.threaded = false;
+      audio.failed = true;
+    }
+  }
+
+  while (audio.fd >= 0 && !__atomic_load_n(&audio.failed, __ATOMIC_RELAXED)) {
+    uint64_t now = now_ns();
+    if (!audio_play(&audio, now)) {
+      break;
+    }
+    if (!audio.threaded && transport->ops->watch != NULL) {
+      transport->ops->watch(transport);
+    }
+    uint64_t deadline = now + AUDIO_PERIOD_MS * 1000000ull;
+    struct timeval tv;
+    if (!loop.usb_threaded && libusb_get_next_timeout(NULL, &tv) == 1) {
+      deadline = MIN(deadline, now + tv.tv_sec * 1000000000ull +
+                                   tv.tv_usec * 1000ull);
+    }
+    if (!loop_wait_until(deadline)) {
+      break;
+    }
+    if (loop.stats_requested) {
+      loop.stats_requested = false;
+      audio_print_stats(&audio);
+    }
+    if (!loop.usb_threaded && (loop.usb_ready || loop.num_events == 0)) {
+      struct timeval zero_tv = {0, 0};
+      libusb_handle_events_timeout(NULL, &zero_tv);
+    }
+    if (!audio.threaded && transport->ops->dispatch != NULL) {
+      transport->ops->dispatch(transport);
+    }
+  }
+
+  __atomic_store_n(&audio.stop, true, __ATOMIC_RELEASE);
+  if (audio.threaded) {
+    transport->ops->interrupt(transport);
+    pthread_join(audio.thread, NULL);
+  }
+  // not in flight is fine as well
+  for (int i = 0; i < audio.num_transfers; i++) {
+    transport->ops->cancel(transport, audio.transfers[i]);
+  }
+  uint64_t deadline = now_ns() + AUDIO_CANCEL_TIMEOUT_MS * 1000000ull;
+  while (audio.busy > 0 && now_ns() < deadline) {
+    struct timeval tv = {0, 100000};
+    if (transport->ops->handle_events(transport, &tv) < 0) {
+      break;
+    }
+  }
+  audio_print_stats(&audio);
+  transport->ops->release_audio(transport);
+
+  if (audio.fd >= 0) {
+    fcntl(audio.fd, F_SETFL, audio.fd_flags);
+    if (audio.fd != STDOUT_FILENO) {
+      close(audio.fd);
+    }
+  }
+  // transfers that would not cancel are leaked with their buffers
+  if (audio.busy == 0) {
+    for (int i = 0; i < audio.num_transfers; i++) {
+      free(audio.transfers[i]->buffer);
+      libusb_free_transfer(audio.transfers[i]);
+    }
+    free(audio.transfers);
+    free(audio.ring.data);
+  }
+}
+
+static void aoa_reset(struct aoa_transport *transport,
+                      __attribute__ ((unused)) struct arguments *arguments) {
+  int r = transport->ops->reset(transport);
+  if (r != 0 && r != LIBUSB_ERROR_NOT_FOUND) {
+    fprintf(stderr, "error resetting the device: %s\n", libusb_error_name(r));
+  }
+}
+
+struct hotplug_event {
+  libusb_device *dev;
+  libusb_hotplug_event event;
+  struct hotplug_event *next;
+};
+
+// How long an announced device may take to reappear in AOA mode, for the
+// time it took to be reported.
+#define ANNOUNCE_REENUMERATE_MS 30000
+
+struct aoa_daemon {
+  struct arguments *arguments;
+  struct aoa_session *sessions;
+  // in progress, or done and waiting for the device to reappear
+  struct aoa_announce *announces;
+  // hotplug callbacks only queue events, they are handled from the main loop
+  struct hotplug_event *pending;
+  struct hotplug_event **pending_tail;
+};
+
+static int hotplug_cb(__attribute__ ((unused)) libusb_context *ctx,
+                      libusb_device *dev, libusb_hotplug_event event,
+                      void *user_data) {
+  struct aoa_daemon *daemon = user_data;
+  struct hotplug_event *e = malloc(sizeof(struct hotplug_event));
+  if (e == NULL) {
+    return 0;
+  }
+  e->dev = libusb_ref_device(dev);
+  e->event = event;
+  e->next = NULL;
+  *daemon->pending_tail = e;
+  daemon->pending_tail = &e->next;
+  return 0;
+}
+
+// An announced device came back in AOA mode: report how long that took.
+static void aoa_daemon_reappeared(struct aoa_daemon *daemon, const char *port) {
+  for (struct aoa_announce **p = &daemon->announces; *p != NULL;
+       p = &(*p)->next) {
+    struct aoa_announce *a = *p;
+    if (a->transport == NULL && strcmp(a->port, port) == 0) {
+      fprintf(stderr, "%s: in AOA mode %.1f ms after it was plugged in\n",
+              port, (now_ns() - a->started) / 1e6);
+      *p = a->next;
+      aoa_announce_free(a);
+      return;
+    }
+  }
+}
+
+static void aoa_daemon_arrived(struct aoa_daemon *daemon, libusb_device *dev) {
+  struct arguments *arguments = daemon->arguments;
+  struct libusb_device_descriptor desc;
+  char port[4 * PORT_NUMBERS_LEN + 4];
+
+  libusb_get_device_descriptor(dev, &desc);
+  if (desc.bDeviceClass == LIBUSB_CLASS_HUB) {
+    return;
+  }
+  port_name(dev, port, sizeof(port));
+  bool aoa = is_AOA_product(&desc);
+  if (aoa) {
+    aoa_daemon_reappeared(daemon, port);
+  }
+  if (aoa && !(arguments->forward && has_accessory_interface(&desc))) {
+    return;
+  }
+  if (!aoa && !arguments->announce) {
+    return;
+  }
+
+  libusb_device_handle *device;
+  int r = libusb_open(dev, &device);
+  if (r != 0) {
+    fprintf(stderr, "%s: error opening the device: %s\n", port,
+            libusb_error_name(r));
+    return;
+  }
+  struct aoa_transport *transport = usb_transport_new(device);
+  if (transport == NULL) {
+    return;
+  }
+
+  if (!aoa) {
+    fprintf(stderr, "%s: announcing\n", port);
+    struct aoa_announce *a = aoa_announce_start(transport, arguments);
+    if (a == NULL) {
+      transport->ops->close(transport);
+      return;
+    }
+    a->next = daemon->announces;
+    daemon->announces = a;
+    return;
+  }
+
+  int sfd = -1;
+  // with --wait, once the device sent something
+  if (!arguments->route && !arguments->mux && !arguments->wait) {
+    sfd = connect_backend(arguments->connect);
+    if (sfd < 0) {
+      transport->ops->close(transport);
+      return;
+    }
+  }
+  struct aoa_session *session = malloc(sizeof(struct aoa_session));
+  if (session == NULL ||
+      aoa_session_start(session, transport, arguments, sfd, sfd) != 0) {
+    free(session);
+    if (sfd >= 0) {
+      close(sfd);
+    }
+    transport->ops->close(transport);
+    return;
+  }
+  session->next = daemon->sessions;
+  daemon->sessions = session;
+  fprintf(stderr, "%s: forwarding\n", port);
+}
+
+static void aoa_daemon_left(struct aoa_daemon *daemon, libusb_device *dev) {
+  for (struct aoa_session *s = daemon->sessions; s != NULL; s = s->next) {
+    if (libusb_get_device(s->transport->device) == dev) {
+      s->done = true;
+    }
+  }
+}
+
+static void aoa_daemon_reap(struct aoa_daemon *daemon) {
+  uint64_t now = now_ns();
+  struct aoa_announce **a = &daemon->announces;
+  while (*a != NULL) {
+    struct aoa_announce *announce = *a;
+    if (announce->done && announce->transport != NULL) {
+      announce->transport->ops->close(announce->transport);
+      announce->transport = NULL;
+    }
+    if (announce->done &&
+        (!announce->ok || now - announce->started >
+                              ANNOUNCE_REENUMERATE_MS * 1000000ull)) {
+      *a = announce->next;
+      aoa_announce_free(announce);
+    } else {
+      a = &announce->next;
+    }
+  }
+
+  struct aoa_session **p = &daemon->sessions;
+  while (*p != NULL) {
+    struct aoa_session *s = *p;
+    if (!s->done) {
+      p = &s->next;
+      continue;
+    }
+    *p = s->next;
+
+    char port[4 * PORT_NUMBERS_LEN + 4];
+    snprintf(port, sizeof(port), "%s", s->transport->name);
+    aoa_session_close(s);
+    if (daemon->arguments->reset) {
+      aoa_reset(s->transport, daemon->arguments);
+    }
+    s->transport->ops->close(s->transport);
+    free(s);
+    fprintf(stderr, "%s: session closed\n", port);
+  }
+}
+
+static void aoa_daemon(struct arguments *arguments) {
+  if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+    fprintf(stderr, "libusb does not support hotplug on this platform\n");
+    libusb_exit(NULL);
+    exit(EXIT_FAILURE);
+  }
+
+  // a vanished reader shows up as EPIPE from write()
+  signal(SIGPIPE, SIG_IGN);
+
+  struct aoa_daemon daemon;
+  memset(&daemon, 0, sizeof(daemon));
+  daemon.arguments = arguments;
+  daemon.pending_tail = &daemon.pending;
+
+  // LIBUSB_HOTPLUG_ENUMERATE also queues everything that is already attached
+  libusb_hotplug_callback_handle handle;
+  int r = libusb_hotplug_register_callback(
+      NULL,
+      LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+      LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY,
+      LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, hotplug_cb, &daemon,
+      &handle);
+  if (r != 0) {
+    fprintf(stderr, "error registering the hotplug callback: %s\n",
+            libusb_error_name(r));
+    libusb_exit(NULL);
+    exit(EXIT_FAILURE);
+  }
+
+  if (arguments->announce) {
+    host_info_watch();
+    host_info_update();
+  }
+
+  do {
+    host_info_dispatch();
+    while (daemon.pending != NULL) {
+      struct hotplug_event *e = daemon.pending;
+      daemon.pending = e->next;
+      if (daemon.pending == NULL) {
+        daemon.pending_tail = &daemon.pending;
+      }
+      if (e->event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+        aoa_daemon_arrived(&daemon, e->dev);
+      } else {
+        aoa_daemon_left(&daemon, e->dev);
+      }
+      libusb_unref_device(e->dev);
+      free(e);
+    }
+    aoa_daemon_reap(&daemon);
+  } while (aoa_poll_once(daemon.sessions));
+
+  libusb_hotplug_deregister_callback(NULL, handle);
+  host_info_unwatch();
+  // wait for announces in progress to be cancelled
+  for (bool busy = true; busy;) {
+    busy = false;
+    for (struct aoa_announce *a = daemon.announces; a != NULL; a = a->next) {
+      if (!a->done) {
+        a->transport->ops->cancel(a->transport, a->transfer);
+        busy = true;
+      }
+    }
+    if (busy) {
+      struct timeval tv = {1, 0};
+      libusb_handle_events_timeout(NULL, &tv);
+    }
+  }
+  while (daemon.announces != NULL) {
+    struct aoa_announce *a = daemon.announces;
+    daemon.announces = a->next;
+    if (a->transport != NULL) {
+      a->transport->ops->close(a->transport);
+    }
+    aoa_announce_free(a);
+  }
+  for (struct aoa_session *s = daemon.sessions; s != NULL; s = s->next) {
+    s->done = true;
+  }
+  aoa_daemon_reap(&daemon);
+  while (daemon.pending != NULL) {
+    struct hotplug_event *e = daemon.pending;
+    daemon.pending = e->next;
+    libusb_unref_device(e->dev);
+    free(e);
   }
 }
 
@@ -710,6 +7903,9 @@ int main(int argc, char *argv[]) {
 
   arguments.busnum = -1;
   memset(arguments.portnums, 0, PORT_NUMBERS_LEN);
+  arguments.port = NULL;
+  arguments.devname = NULL;
+  arguments.enumerate = false;
   arguments.manufacturer = "aoa-proxy";
   arguments.model = "generic-device";
   arguments.version = "0.1";
@@ -719,46 +7915,164 @@ int main(int argc, char *argv[]) {
   arguments.reset = false;
   arguments.wait = false;
   arguments.audio = false;
-#ifdef HAS_HID
   arguments.hid = false;
-#endif
+  arguments.hid_binary = false;
+  arguments.hid_rate = 0;
+  arguments.num_evdev = 0;
+  arguments.grab = false;
+  arguments.hid_replay = false;
+  arguments.listen = NULL;
+  arguments.capture = NULL;
+  arguments.capture_size = CAPTURE_DEFAULT_SIZE;
+  arguments.capture_snaplen = CAPTURE_DEFAULT_SNAPLEN;
+  arguments.capture_export = NULL;
+  arguments.capture_replay = NULL;
+  arguments.audio_stream = false;
+  arguments.audio_out = "-";
+  arguments.audio_latency = 40;
   arguments.announce = false;
   arguments.forward = false;
+  arguments.daemon = false;
+  arguments.simulate = false;
+  arguments.bench = false;
+  arguments.bench_size = 64 * 1024 * 1024;
+  arguments.bench_message = 64;
+  arguments.bench_rounds = 5000;
+  arguments.bench_pattern = BENCH_RANDOM;
+  arguments.json = false;
+  arguments.metrics = NULL;
+  arguments.sim_app = "echo";
+  arguments.sim_packet_size = 512;
+  arguments.sim_latency = 125;
+  arguments.sim_bandwidth = 40000000;
   arguments.connect = "";
+  memset(arguments.routes, 0, sizeof(arguments.routes));
+  arguments.route = false;
+  arguments.reconnect = false;
+  arguments.reconnect_marker = NULL;
+  arguments.mux = false;
+  memset(arguments.mux_loopback, 0, sizeof(arguments.mux_loopback));
+  arguments.num_mux_loopback = 0;
+  arguments.transfers = DEFAULT_TRANSFERS;
+  arguments.buffer_size = DEFAULT_BUFFER_SIZE;
+  arguments.coalesce_delay = 0;
+  arguments.coalesce_size = 0;
+  arguments.idle_timeout = 0;
+  arguments.stall_timeout = 0;
+  arguments.keepalive = 0;
+  arguments.threads = false;
+#ifdef HAS_URING
+  arguments.io_uring = false;
+#endif
 
   argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
+  if (arguments.capture_export != NULL) {
+    return capture_export(&arguments) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  // With the device node of --port at hand, libusb need not enumerate every
+  // USB device on the system when it starts.
+  int sys_fd = -1;
+#ifdef HAS_SYS_DEVICE
+  if (!arguments.simulate && !arguments.daemon && !arguments.enumerate &&
+      arguments.num_mux_loopback == 0) {
+    sys_fd = usb_open_node(&arguments);
+  }
+  if (sys_fd >= 0) {
+    libusb_set_option(NULL, LIBUSB_OPTION_NO_DEVICE_DISCOVERY);
+  }
+#endif
+
   if (0 > libusb_init(NULL)) {
     fprintf(stderr, "libusb_init failed\n");
     exit(-1);
   }
 
-  libusb_device_handle *dev =
-      get_usb_device((uint8_t)arguments.busnum, arguments.portnums);
+  if (arguments.capture != NULL) {
+    capture_ring = capture_create(arguments.capture, arguments.capture_size,
+                                  arguments.capture_snaplen);
+    if (capture_ring == NULL) {
+      libusb_exit(NULL);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (arguments.num_mux_loopback > 0) {
+    mux_loopback(&arguments);
+    return EXIT_SUCCESS;
+  }
+
+  if (arguments.metrics != NULL && metrics_listen(arguments.metrics) != 0) {
+    libusb_exit(NULL);
+    exit(EXIT_FAILURE);
+  }
+  // removes the socket again however main returns
+  atexit(metrics_close);
+
+  if (arguments.daemon) {
+    aoa_daemon(&arguments);
+    libusb_exit(NULL);
+    return EXIT_SUCCESS;
+  }
+
+  struct aoa_transport *dev;
+  if (arguments.simulate) {
+    dev = sim_transport_new(&arguments);
+  } else {
+    dev = usb_transport_open(&arguments, sys_fd);
+  }
+  if (dev == NULL) {
+    libusb_exit(NULL);
+    exit(EXIT_FAILURE);
+  }
 
+  // a real device reenumerates after the announcement, the simulated one
+  // switches in place and can be used right away
+  bool announced = false;
   if (!is_device_in_AOA_mode(dev) && arguments.announce) {
     aoa_announce(dev, &arguments);
-  } else {
-    if(arguments.announce){
-      fprintf(stderr, "device already in AOA mode\n");
-    }
-    if(arguments.forward){
+    announced = !arguments.simulate;
+  } else if (arguments.announce) {
+    fprintf(stderr, "device already in AOA mode\n");
+  }
+  if (!announced) {
+    if (arguments.bench) {
+      if (!aoa_bench(dev, &arguments)) {
+        dev->ops->close(dev);
+        libusb_exit(NULL);
+        exit(EXIT_FAILURE);
+      }
+    } else if (arguments.capture_replay != NULL) {
+      if (!aoa_capture_replay(dev, &arguments)) {
+        dev->ops->close(dev);
+        libusb_exit(NULL);
+        exit(EXIT_FAILURE);
+      }
+    } else if(arguments.forward){
       aoa_cat(dev, &arguments);
       if (arguments.reset) {
         aoa_reset(dev, &arguments);
       }
+    } else if (arguments.audio_stream) {
+      aoa_audio(dev, &arguments);
+      if (arguments.reset) {
+        aoa_reset(dev, &arguments);
+      }
     } else {
-#ifdef HAS_HID
-      if(arguments.hid){
+      if(arguments.num_evdev > 0){
+        aoa_evdev(dev, &arguments);
+      } else if(arguments.hid_replay){
+        aoa_hid_replay(dev, &arguments);
+      } else if(arguments.hid){
         aoa_hid(dev, &arguments);
       }
-#endif
       if (arguments.reset) {
         aoa_reset(dev, &arguments);
       }
     }
   }
-  libusb_close(dev);
+  dev->ops->close(dev);
 
   libusb_exit(NULL);
   return EXIT_SUCCESS;